@@ -0,0 +1,257 @@
+// telnetCoroutineTest.cpp : Checks the C++20 coroutine command handlers against a live server (Linux).
+//
+// Built as C++20 with its own copy of the library. Each awaitable is driven through a loopback
+// session, inline and with I/O threads, and a server shut down while handlers are suspended has
+// to destroy their frames. Checks stay in Release builds, where assert() is compiled out.
+
+#include "telnetservlib.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+#ifndef TELNETSERVLIB_COROUTINES
+#error telnetCoroutineTest needs C++20 coroutines
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static int s_failures = 0;
+#define CHECK(condition) do { if (!(condition)) { printf("FAILED line %d: %s\n", __LINE__, #condition); s_failures++; } } while (0)
+
+// Coroutine frames still alive. Each handler keeps one of these as a local
+static int s_frames = 0;
+struct FrameCounter
+{
+    FrameCounter() { s_frames++; }
+    ~FrameCounter() { s_frames--; }
+};
+
+static uint64_t s_updates = 0;
+
+// Swallows the library's per-connection logging
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+};
+
+static int connectClient(u_long port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        printf("connect failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static void sendText(int fd, const char * text)
+{
+    ssize_t sent = send(fd, text, strlen(text), MSG_NOSIGNAL);
+    (void)sent;
+}
+
+// Run frames until the client has been sent text, or a couple of seconds have gone by
+static bool waitFor(TelnetServer &ts, int fd, std::string &received, const char * text)
+{
+    Clock::time_point giveUp = Clock::now() + std::chrono::seconds(2);
+    while (received.find(text) == std::string::npos && Clock::now() < giveUp)
+    {
+        ts.update();
+        s_updates++;
+        char data[4096];
+        ssize_t length;
+        while ((length = recv(fd, data, sizeof(data), 0)) > 0)
+            received.append(data, length);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return received.find(text) != std::string::npos;
+}
+
+static void runFrames(TelnetServer &ts, int frames)
+{
+    for (int i = 0; i < frames; i++)
+    {
+        ts.update();
+        s_updates++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+static void testAwaitables(u_long port, unsigned ioThreads)
+{
+    auto ts = std::make_shared<TelnetServer>();
+    auto router = std::make_shared<TelnetCommandRouter>();
+    std::thread::id host = std::this_thread::get_id();
+    std::thread worker;
+    std::string lineResult;
+    uint64_t frameSteps[3] = { 0, 0, 0 };
+
+    router->add("status", [](SP_TelnetSession s, const TelnetArgs &) { s->sendLine("routed"); });
+    router->add("wait", [&](SP_TelnetSession s, const TelnetArgs &args) -> TelnetTask
+    {
+        FrameCounter frame;
+        std::string what(args.rest(1));     // The line is gone after the first co_await
+        Clock::time_point start = Clock::now();
+        co_await TelnetDelay(*s->server(), std::chrono::milliseconds(30));
+        CHECK(Clock::now() - start >= std::chrono::milliseconds(30));
+        CHECK(std::this_thread::get_id() == host);
+        s->sendLine("waited " + what);
+    });
+    router->add("frames", [&](SP_TelnetSession s, const TelnetArgs &) -> TelnetTask
+    {
+        FrameCounter frame;
+        for (int i = 0; i < 3; i++)
+        {
+            co_await TelnetNextFrame(*s->server());
+            frameSteps[i] = s_updates;
+        }
+        s->sendLine("frames done");
+    });
+    router->add("ask", [&](SP_TelnetSession s, const TelnetArgs &) -> TelnetTask
+    {
+        FrameCounter frame;
+        s->sendLine("name?");
+        std::optional<std::string> name = co_await TelnetNextLine(s);
+        CHECK(std::this_thread::get_id() == host);
+        if (!name)
+        {
+            lineResult = "closed";
+            co_return;
+        }
+        lineResult = *name;
+        s->sendLine("hello " + *name);
+    });
+    router->add("work", [&](SP_TelnetSession s, const TelnetArgs &) -> TelnetTask
+    {
+        FrameCounter frame;
+        TelnetToken<int> token(s->server());
+        worker = std::thread([token]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            token.complete(42);
+            token.complete(7);      // Only the first counts
+        });
+        int value = co_await token;
+        CHECK(std::this_thread::get_id() == host);
+        s->sendLine("worked " + std::to_string(value));
+    });
+    ts->commandRouter(router);
+    CHECK(ts->initialise(port, "py> ", ioThreads));
+
+    int fd = connectClient(port);
+    std::string received;
+    sendText(fd, "wait abc\r\n");
+    CHECK(waitFor(*ts, fd, received, "waited abc"));
+
+    // One step per update()
+    sendText(fd, "frames\r\n");
+    CHECK(waitFor(*ts, fd, received, "frames done"));
+    CHECK(frameSteps[0] > 0 && frameSteps[1] > frameSteps[0] && frameSteps[2] > frameSteps[1]);
+
+    // The next line goes to the coroutine rather than the router
+    received.clear();
+    sendText(fd, "ask\r\n");
+    CHECK(waitFor(*ts, fd, received, "name?"));
+    sendText(fd, "status\r\n");
+    CHECK(waitFor(*ts, fd, received, "hello status"));
+    CHECK(lineResult == "status" && received.find("routed") == std::string::npos);
+
+    sendText(fd, "work\r\n");
+    CHECK(waitFor(*ts, fd, received, "worked 42"));
+    worker.join();
+
+    // A session that closes while the coroutine waits for its line resumes it with nullopt
+    lineResult.clear();
+    sendText(fd, "ask\r\n");
+    CHECK(waitFor(*ts, fd, received, "name?"));
+    close(fd);
+    for (int i = 0; i < 2000 && lineResult.empty(); i++)
+        runFrames(*ts, 1);
+    CHECK(lineResult == "closed");
+    CHECK(s_frames == 0);
+
+    ts->shutdown();
+}
+
+static void testShutdown(u_long port, unsigned ioThreads)
+{
+    auto ts = std::make_shared<TelnetServer>();
+    auto router = std::make_shared<TelnetCommandRouter>();
+    std::string lineResult;
+    router->add("sleep", [](SP_TelnetSession s, const TelnetArgs &) -> TelnetTask
+    {
+        FrameCounter frame;
+        co_await TelnetDelay(*s->server(), std::chrono::hours(1));
+        s->sendLine("never");
+    });
+    router->add("spin", [](SP_TelnetSession s, const TelnetArgs &) -> TelnetTask
+    {
+        FrameCounter frame;
+        for (;;)
+            co_await TelnetNextFrame(*s->server());
+    });
+    router->add("ask", [&](SP_TelnetSession s, const TelnetArgs &) -> TelnetTask
+    {
+        FrameCounter frame;
+        s->sendLine("name?");
+        std::optional<std::string> name = co_await TelnetNextLine(s);
+        lineResult = name ? *name : "closed";
+    });
+    ts->commandRouter(router);
+    CHECK(ts->initialise(port, "py> ", ioThreads));
+
+    int fd = connectClient(port);
+    std::string received;
+    sendText(fd, "sleep\r\nspin\r\nask\r\n");
+    CHECK(waitFor(*ts, fd, received, "name?"));
+    runFrames(*ts, 5);
+    CHECK(s_frames == 3);
+
+    // Shutting down destroys the frames still waiting on a timer or a frame, and tells the one
+    // waiting for a line that its session has gone
+    ts->shutdown();
+    CHECK(lineResult == "closed");
+    CHECK(s_frames == 0);
+    close(fd);
+}
+
+int main(int argc, char * argv[])
+{
+    u_long port = 27100;
+    if (argc == 3 && strcmp(argv[1], "--port") == 0)
+        port = strtoul(argv[2], NULL, 10);
+
+    NullBuffer nullBuffer;
+    std::streambuf * coutBuffer = std::cout.rdbuf(&nullBuffer);
+    for (unsigned ioThreads : { 0u, 2u })
+    {
+        testAwaitables(port++, ioThreads);
+        testShutdown(port++, ioThreads);
+    }
+    std::cout.rdbuf(coutBuffer);
+
+    if (s_failures > 0)
+    {
+        printf("%d checks failed\n", s_failures);
+        return 1;
+    }
+    printf("Coroutine handlers OK\n");
+    return 0;
+}
@@ -0,0 +1,100 @@
+// telnetParserBenchmark.cpp : ns/byte of the per-byte input path.
+//
+// Feeds TelnetInputParser the kinds of input a session sees, split into reads the way they arrive
+// from the socket, and reports the cost per byte.
+
+#include "telnetservlib.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+struct ParserWorkload
+{
+    const char * name;
+    std::string  input;
+    size_t       readSize;      // Bytes handed to each parse call
+    bool         validateUtf8;
+};
+
+static std::vector<ParserWorkload> buildWorkloads()
+{
+    std::vector<ParserWorkload> workloads;
+
+    // Someone typing: every byte arrives in a read of its own
+    std::string typed;
+    while (typed.length() < 4096)
+        typed += "look north\r\n";
+    workloads.push_back({ "keystrokes", typed, 1, true });
+
+    // A 64 KB paste of plain lines, in reads the size of the session's input buffer
+    std::string paste;
+    for (int i = 0; paste.length() < 64 * 1024; i++)
+        paste += "say this is pasted line number " + std::to_string(i) + " of a long block of text\r\n";
+    workloads.push_back({ "paste", paste, TelnetSession::INPUT_BUFFER_SIZE, true });
+    workloads.push_back({ "paste (no utf8)", paste, TelnetSession::INPUT_BUFFER_SIZE, false });
+
+    std::string utf8;
+    while (utf8.length() < 64 * 1024)
+        utf8 += "say caf\xc3\xa9 \xe2\x82\xac\xf0\x9d\x84\x9e \xc3\xbcn\xc3\xaf" "c\xc3\xb6" "d\xc3\xa9 text\r\n";
+    workloads.push_back({ "utf8 paste", utf8, TelnetSession::INPUT_BUFFER_SIZE, true });
+
+    // Option negotiation as a client opens: WILL/DO pairs, NAWS and terminal type subnegotiations
+    static const char negotiation[] =
+        "\xff\xfb\x18\xff\xfb\x1f\xff\xfd\x01\xff\xfd\x03\xff\xfc\x22"
+        "\xff\xfa\x1f\x00\x50\x00\x18\xff\xf0"
+        "\xff\xfa\x18\x00" "xterm-256color" "\xff\xf0";
+    std::string iac;
+    while (iac.length() < 64 * 1024)
+        iac.append(negotiation, sizeof(negotiation) - 1);
+    workloads.push_back({ "iac burst", iac, TelnetSession::INPUT_BUFFER_SIZE, true });
+
+    // Held down arrow keys
+    std::string arrows;
+    while (arrows.length() < 64 * 1024)
+        arrows += "\x1b[A\x1b[B\x1b[C\x1b[D\x1bOA\x1b[3~";
+    workloads.push_back({ "ansi storm", arrows, TelnetSession::INPUT_BUFFER_SIZE, true });
+    workloads.push_back({ "ansi keys", arrows.substr(0, 4096), 3, true });
+
+    return workloads;
+}
+
+int main(int argc, char * argv[])
+{
+    double minimumSeconds = argc > 1 ? atof(argv[1]) : 0.25;     // Time spent on each workload
+
+    printf("%-18s %10s %12s %12s\n", "workload", "ns/byte", "MB/s", "events/KB");
+    for (const ParserWorkload &w : buildWorkloads())
+    {
+        TelnetInputParser parser;
+        parser.validateUtf8(w.validateUtf8);
+        std::vector<TelnetInputEvent> events;
+        events.reserve(w.readSize * 2);
+
+        size_t bytes = 0;
+        size_t eventCount = 0;
+        Clock::time_point start = Clock::now();
+        double elapsed = 0;
+        do
+        {
+            for (size_t offset = 0; offset < w.input.length(); offset += w.readSize)
+            {
+                events.clear();
+                parser.parse(w.input.data() + offset, std::min(w.readSize, w.input.length() - offset), events);
+                eventCount += events.size();
+            }
+            bytes += w.input.length();
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        while (elapsed < minimumSeconds);
+
+        printf("%-18s %10.3f %12.1f %12.1f\n", w.name, elapsed * 1e9 / bytes, bytes / elapsed / 1e6, eventCount * 1024.0 / bytes);
+    }
+    return 0;
+}
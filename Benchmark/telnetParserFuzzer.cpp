@@ -0,0 +1,206 @@
+// telnetParserFuzzer.cpp : libFuzzer target for TelnetInputParser.
+//
+// Every input is parsed in one piece, a byte at a time and in chunks sized by the input itself.
+// The three event streams must agree, since a client decides where its reads are split. With
+// UTF-8 validation on, the data handed out must be valid UTF-8.
+//
+// Built with clang this links against libFuzzer:
+//     ./telnetParserFuzzer corpus/parser
+// With other compilers TELNETSERVLIB_FUZZ_REPLAY adds a main() that runs the files or
+// directories it is given, plus -runs=N random mutations of them.
+
+#include "telnetservlib.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+// One event with its payload copied out, and neighbouring Data events merged, so streams from
+// differently split input can be compared
+struct FuzzEvent
+{
+    TelnetInputEvent::Type type;
+    unsigned char command;
+    unsigned char option;
+    std::string   data;
+
+    bool operator==(const FuzzEvent &other) const
+    {
+        return type == other.type && command == other.command && option == other.option && data == other.data;
+    }
+};
+
+static std::vector<FuzzEvent> parseInChunks(const uint8_t * data, size_t size, size_t chunk, bool validate)
+{
+    TelnetInputParser parser;
+    parser.validateUtf8(validate);
+    std::vector<TelnetInputEvent> events;
+    std::vector<FuzzEvent> result;
+
+    for (size_t offset = 0; offset < size; offset += chunk)
+    {
+        size_t length = std::min(chunk, size - offset);
+        events.clear();
+        parser.parse((const char *)data + offset, length, events);
+
+        for (const TelnetInputEvent &ev : events)
+        {
+            if (ev.type == TelnetInputEvent::Subnegotiation && ev.length > 256)
+                abort();    // MAX_SUBNEGOTIATION
+
+            // Only Data and Subnegotiation carry a payload. Command bytes are only meaningful for some types.
+            std::string payload;
+            if (ev.type == TelnetInputEvent::Data || ev.type == TelnetInputEvent::Subnegotiation)
+                payload.assign(ev.data, ev.length);
+            bool hasCommand = ev.type == TelnetInputEvent::Command || ev.type == TelnetInputEvent::Negotiation;
+            bool hasOption = ev.type == TelnetInputEvent::Negotiation || ev.type == TelnetInputEvent::Subnegotiation;
+
+            if (ev.type == TelnetInputEvent::Data && !result.empty() && result.back().type == TelnetInputEvent::Data)
+            {
+                result.back().data += payload;
+                continue;
+            }
+            FuzzEvent fuzzEvent = { ev.type, hasCommand ? ev.command : (unsigned char)0, hasOption ? ev.option : (unsigned char)0, payload };
+            result.push_back(fuzzEvent);
+        }
+    }
+    return result;
+}
+
+static bool validUtf8(const std::string &text)
+{
+    size_t i = 0;
+    while (i < text.length())
+    {
+        unsigned char lead = (unsigned char)text[i];
+        size_t length = lead < 0x80 ? 1 : (lead >= 0xc2 && lead <= 0xdf) ? 2 : (lead >= 0xe0 && lead <= 0xef) ? 3 : (lead >= 0xf0 && lead <= 0xf4) ? 4 : 0;
+        if (length == 0 || i + length > text.length())
+            return false;
+
+        uint32_t codePoint = length == 1 ? lead : lead & (0x7f >> length);
+        for (size_t j = 1; j < length; j++)
+        {
+            unsigned char c = (unsigned char)text[i + j];
+            if ((c & 0xc0) != 0x80)
+                return false;
+            codePoint = (codePoint << 6) | (c & 0x3f);
+        }
+
+        static const uint32_t minimum[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+        if (codePoint < minimum[length] || codePoint > 0x10ffff || (codePoint >= 0xd800 && codePoint <= 0xdfff))
+            return false;
+        i += length;
+    }
+    return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+    for (bool validate : { true, false })
+    {
+        std::vector<FuzzEvent> whole = parseInChunks(data, size, size > 0 ? size : 1, validate);
+        std::vector<FuzzEvent> bytes = parseInChunks(data, size, 1, validate);
+        std::vector<FuzzEvent> chunks = parseInChunks(data, size, size > 0 ? data[0] % 13 + 1 : 1, validate);
+
+        if (!(whole == bytes) || !(whole == chunks))
+            abort();    // How the input was split changed what the parser saw
+
+        if (whole.size() > size + 1)
+            abort();
+
+        if (validate)
+        {
+            for (const FuzzEvent &ev : whole)
+            {
+                if (ev.type == TelnetInputEvent::Data && !validUtf8(ev.data))
+                    abort();
+            }
+        }
+    }
+    return 0;
+}
+
+#ifdef TELNETSERVLIB_FUZZ_REPLAY
+#include <dirent.h>
+#include <string.h>
+#include <random>
+
+static bool readFile(const std::string &path, std::string &contents)
+{
+    FILE * f = fopen(path.c_str(), "rb");
+    if (f == nullptr)
+        return false;
+    char buffer[4096];
+    size_t n;
+    contents.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        contents.append(buffer, n);
+    fclose(f);
+    return true;
+}
+
+static void addInputs(const std::string &path, std::vector<std::string> &inputs)
+{
+    DIR * dir = opendir(path.c_str());
+    if (dir == nullptr)
+    {
+        std::string contents;
+        if (readFile(path, contents))
+            inputs.push_back(contents);
+        else
+            printf("Cannot read %s\n", path.c_str());
+        return;
+    }
+
+    while (struct dirent * entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+            addInputs(path + "/" + entry->d_name, inputs);
+    }
+    closedir(dir);
+}
+
+int main(int argc, char * argv[])
+{
+    long runs = 0;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-runs=", 6) == 0)
+            runs = strtol(argv[i] + 6, nullptr, 10);
+        else
+            addInputs(argv[i], inputs);
+    }
+
+    for (const std::string &input : inputs)
+        LLVMFuzzerTestOneInput((const uint8_t *)input.data(), input.size());
+
+    // Cheap mutations of the corpus: flip, insert and drop bytes, and splice inputs together
+    std::mt19937 random(12345);
+    static const char interesting[] = "\xff\xfa\xf0\xfb\xfd\x1b[O\r\n\x00\x7f\b\xc3\xe2\xf0\x80\xbf";
+    for (long run = 0; run < runs && !inputs.empty(); run++)
+    {
+        std::string input = inputs[random() % inputs.size()];
+        int mutations = 1 + random() % 8;
+        for (int m = 0; m < mutations; m++)
+        {
+            size_t at = input.empty() ? 0 : random() % (input.size() + 1);
+            char byte = (random() % 2) ? interesting[random() % (sizeof(interesting) - 1)] : (char)random();
+            switch (random() % 4)
+            {
+            case 0: if (at < input.size()) input[at] = byte; break;
+            case 1: input.insert(at, 1, byte); break;
+            case 2: if (at < input.size()) input.erase(at, 1); break;
+            case 3: input.insert(at, inputs[random() % inputs.size()].substr(0, 64)); break;
+            }
+        }
+        LLVMFuzzerTestOneInput((const uint8_t *)input.data(), input.size());
+    }
+
+    printf("Ran %zu inputs and %ld mutations\n", inputs.size(), runs);
+    return 0;
+}
+#endif
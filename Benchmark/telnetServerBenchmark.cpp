@@ -0,0 +1,893 @@
+// telnetServerBenchmark.cpp : Loopback load generator for TelnetServer (Linux).
+//
+// Runs a TelnetServer in this process and a client simulator on a second thread. The simulator
+// opens many loopback sessions, replays keystroke and paste traffic and pings the server, and
+// the report gives accepts/sec, lines/sec, bytes/sec, the wall time of TelnetServer::update()
+// and the end to end echo latency.
+//
+// With --handover PATH it instead starts a second copy of itself with --takeover PATH, hands its
+// live clients over mid-session and checks each one keeps its partial line, history and unsent
+// output. Adding --stall-ms MS stops the new process for that long, so its acknowledgement comes
+// after handOver() has given up, and checks the clients stay with this process.
+
+#include "telnetservlib.hpp"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchmarkOptions
+{
+    int      clients = 1000;
+    unsigned ioThreads = 0;
+    int      keystrokeLines = 20;       // Lines each client types a byte at a time
+    size_t   pasteBytes = 64 * 1024;    // Bytes each client pastes in one go
+    int      pings = 10;                // Echo round trips per client
+    int      frameMicroseconds = 1000;  // Target length of a host frame; 0 spins
+    int      budgetMicroseconds = 0;    // Time budget passed to update(); 0 runs it unbudgeted
+    u_long   port = 27099;
+    std::string handoverPath;           // Run the restart check, handing over at this Unix socket
+    std::string takeoverPath;           // Be the new process for a --handover run
+    int      stallMilliseconds = 0;     // --handover: stop the new process this long, so it answers too late
+};
+
+enum BenchmarkPhase { Connect, Keystroke, Paste, Echo, Done, PhaseCount };
+static const char * s_phaseNames[PhaseCount] = { "connect", "keystroke", "paste", "echo", "idle" };
+
+// Shared between the host loop and the client simulator
+static std::atomic<int>      s_phase(Connect);
+static std::atomic<int>      s_connected(0);
+static std::atomic<uint64_t> s_lines(0);
+static std::atomic<uint64_t> s_lineBytes(0);
+
+struct PhaseResult
+{
+    double   seconds = 0;
+    uint64_t lines = 0;
+    uint64_t bytes = 0;
+};
+
+static uint64_t nowNanoseconds()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+template <typename T>
+static T percentile(std::vector<T> &samples, double p)
+{
+    if (samples.empty())
+        return 0;
+    size_t index = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// Swallows the library's per-connection logging so it does not dominate the measurement
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; }
+};
+
+/* ------------------ Client Simulator -------------------*/
+class LoadClients
+{
+public:
+    LoadClients(const BenchmarkOptions &options) : m_options(options), m_epollFd(epoll_create1(0)), m_pongs(0) {}
+    ~LoadClients()
+    {
+        hangUp();
+        close(m_epollFd);
+    }
+
+    bool run(PhaseResult results[PhaseCount], std::vector<uint64_t> &latencies);
+    void hangUp()
+    {
+        for (Client &c : m_clients)
+            close(c.fd);
+        m_clients.clear();
+    }
+
+private:
+    struct Client
+    {
+        int         fd;
+        std::string received;   // Unparsed tail of what the server sent
+        std::string pending;    // Bytes we still have to send
+        size_t      sent;
+    };
+
+    bool connectAll();
+    bool sendAll();                                     // Push every client's pending bytes, reading as we go
+    void pumpReads(int timeoutMs);
+    bool waitForLines(uint64_t target);
+    void parsePongs(Client &c, std::vector<uint64_t> *latencies);
+
+    const BenchmarkOptions &m_options;
+    int m_epollFd;
+    std::vector<Client> m_clients;
+    std::vector<uint64_t> * m_latencies = nullptr;
+    uint64_t m_pongs;
+};
+
+bool LoadClients::connectAll()
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)m_options.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    m_clients.resize(m_options.clients);
+    for (int i = 0; i < m_options.clients; i++)
+    {
+        // Don't run more than a listen backlog ahead of the server, or the kernel starts dropping SYNs
+        while (i - s_connected.load() > 512)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+        Client &c = m_clients[i];
+        c.sent = 0;
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c.fd == -1)
+        {
+            printf("socket failed with error: %d\n", errno);
+            return false;
+        }
+        fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(c.fd, (struct sockaddr *)&address, sizeof(address)) == -1 && errno != EINPROGRESS)
+        {
+            printf("connect failed with error: %d\n", errno);
+            return false;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        epoll_ctl(m_epollFd, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(30);
+    while (s_connected.load() < m_options.clients)
+    {
+        pumpReads(1);
+        if (Clock::now() > deadline)
+        {
+            printf("Timed out with %d of %d clients connected\n", s_connected.load(), m_options.clients);
+            return false;
+        }
+    }
+    return true;
+}
+
+void LoadClients::parsePongs(Client &c, std::vector<uint64_t> *latencies)
+{
+    // The server answers "ping <ns>" with "pong <ns>". Everything else (echo, negotiation) is skipped.
+    size_t pos;
+    while ((pos = c.received.find("pong ")) != std::string::npos)
+    {
+        size_t end = c.received.find('\r', pos);
+        if (end == std::string::npos)
+        {
+            c.received.erase(0, pos);
+            return;
+        }
+        uint64_t sentAt = strtoull(c.received.c_str() + pos + 5, nullptr, 10);
+        if (latencies != nullptr)
+            latencies->push_back(nowNanoseconds() - sentAt);
+        m_pongs++;
+        c.received.erase(0, end);
+    }
+
+    // Keep enough of the tail to catch a "pong " split across reads
+    if (c.received.length() > 4)
+        c.received.erase(0, c.received.length() - 4);
+}
+
+void LoadClients::pumpReads(int timeoutMs)
+{
+    struct epoll_event events[256];
+    int count = epoll_wait(m_epollFd, events, 256, timeoutMs);
+    char buffer[16384];
+    for (int i = 0; i < count; i++)
+    {
+        Client &c = m_clients[events[i].data.u32];
+        ssize_t n;
+        while ((n = recv(c.fd, buffer, sizeof(buffer), 0)) > 0)
+        {
+            if (m_latencies != nullptr)
+            {
+                c.received.append(buffer, (size_t)n);
+                parsePongs(c, m_latencies);
+            }
+        }
+    }
+}
+
+bool LoadClients::sendAll()
+{
+    bool waiting = true;
+    while (waiting)
+    {
+        waiting = false;
+        for (Client &c : m_clients)
+        {
+            if (c.sent == c.pending.length())
+                continue;
+            ssize_t n = send(c.fd, c.pending.data() + c.sent, c.pending.length() - c.sent, MSG_NOSIGNAL);
+            if (n > 0)
+                c.sent += (size_t)n;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf("send failed with error: %d\n", errno);
+                return false;
+            }
+            if (c.sent < c.pending.length())
+                waiting = true;
+        }
+        pumpReads(0);
+    }
+
+    for (Client &c : m_clients)
+    {
+        c.pending.clear();
+        c.sent = 0;
+    }
+    return true;
+}
+
+bool LoadClients::waitForLines(uint64_t target)
+{
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(60);
+    while (s_lines.load() < target)
+    {
+        pumpReads(1);
+        if (Clock::now() > deadline)
+        {
+            printf("Timed out with %llu of %llu lines received\n", (unsigned long long)s_lines.load(), (unsigned long long)target);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LoadClients::run(PhaseResult results[PhaseCount], std::vector<uint64_t> &latencies)
+{
+    Clock::time_point start = Clock::now();
+    if (!connectAll())
+        return false;
+    results[Connect].seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    results[Connect].lines = (uint64_t)m_options.clients;
+
+    // Keystrokes: every client types its line one byte per send, interleaved with the others
+    s_phase = Keystroke;
+    static const char keystrokeLine[] = "look north\r\n";
+    uint64_t linesBefore = s_lines.load();
+    start = Clock::now();
+    for (int line = 0; line < m_options.keystrokeLines; line++)
+    {
+        for (size_t b = 0; b < sizeof(keystrokeLine) - 1; b++)
+        {
+            for (Client &c : m_clients)
+                c.pending.assign(1, keystrokeLine[b]);
+            if (!sendAll())
+                return false;
+        }
+    }
+    if (!waitForLines(linesBefore + (uint64_t)m_options.clients * m_options.keystrokeLines))
+        return false;
+    results[Keystroke].seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    results[Keystroke].lines = s_lines.load() - linesBefore;
+    results[Keystroke].bytes = results[Keystroke].lines * (sizeof(keystrokeLine) - 1);
+
+    // Paste: every client sends a large block of lines at once
+    s_phase = Paste;
+    std::string paste;
+    uint64_t pasteLines = 0;
+    while (paste.length() < m_options.pasteBytes)
+    {
+        paste += "say paste line " + std::to_string(pasteLines++) + "\r\n";
+    }
+    linesBefore = s_lines.load();
+    start = Clock::now();
+    for (Client &c : m_clients)
+        c.pending = paste;
+    if (!sendAll() || !waitForLines(linesBefore + (uint64_t)m_options.clients * pasteLines))
+        return false;
+    results[Paste].seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    results[Paste].lines = s_lines.load() - linesBefore;
+    results[Paste].bytes = (uint64_t)m_options.clients * paste.length();
+
+    // Echo: a round of pings, each answered by the host's line callback
+    s_phase = Echo;
+    m_latencies = &latencies;
+    start = Clock::now();
+    for (int ping = 0; ping < m_options.pings; ping++)
+    {
+        uint64_t target = m_pongs + (uint64_t)m_options.clients;
+        for (Client &c : m_clients)
+            c.pending = "ping " + std::to_string(nowNanoseconds()) + "\r\n";
+        if (!sendAll())
+            return false;
+
+        Clock::time_point deadline = Clock::now() + std::chrono::seconds(30);
+        while (m_pongs < target)
+        {
+            pumpReads(1);
+            if (Clock::now() > deadline)
+            {
+                printf("Timed out waiting for pongs\n");
+                return false;
+            }
+        }
+    }
+    results[Echo].seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    results[Echo].lines = (uint64_t)m_options.clients * m_options.pings;
+    m_latencies = nullptr;
+    return true;
+}
+
+/* ------------------ Restart -------------------*/
+// Sessions that asked for more output than they will read, and the lines sent to each so far
+struct BulkSession
+{
+    SP_TelnetSession session;
+    std::string      name;
+    int              lines;
+    uint64_t         bytes;     // What bytesOut reaches once all of them are written
+};
+static std::vector<BulkSession> s_bulkSessions;
+
+static TelnetOutputLimits handoffLimits()
+{
+    // Deep enough that none of the output the clients leave unread is dropped
+    TelnetOutputLimits limits;
+    limits.highWatermark = 16 * 1024 * 1024;
+    limits.lowWatermark = 4 * 1024 * 1024;
+    return limits;
+}
+
+// Both processes answer every line, saying which of them did
+static void answerLine(SP_TelnetSession session, std::string_view line)
+{
+    if (line.compare(0, 5, "bulk ") == 0)
+    {
+        BulkSession bulk = { session, std::string(line), 0, session->metrics().bytesOut };
+        s_bulkSessions.push_back(bulk);
+        return;
+    }
+    session->sendLine((session->adopted() ? "new got " : "old got ") + std::string(line));
+}
+
+struct HandoffClient
+{
+    int         fd;
+    std::string received;
+    size_t      sent;
+};
+
+static void sendText(HandoffClient &c, const std::string &text)
+{
+    // Each client only ever has a few short lines in flight, so the socket always takes them
+    c.sent += (size_t)std::max<ssize_t>(0, send(c.fd, text.data(), text.length(), MSG_NOSIGNAL));
+}
+
+// Run the server while it is still ours and read the clients until each has been sent its own
+// prefix + index + suffix
+static bool waitForClients(TelnetServer * ts, std::vector<HandoffClient> &clients, const std::string &prefix, const std::string &suffix)
+{
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(30);
+    size_t waiting = 0;
+    while (waiting < clients.size())
+    {
+        if (ts != nullptr)
+            ts->update();
+        char buffer[16384];
+        for (HandoffClient &c : clients)
+        {
+            ssize_t n;
+            while ((n = recv(c.fd, buffer, sizeof(buffer), 0)) > 0)
+                c.received.append(buffer, (size_t)n);
+        }
+        while (waiting < clients.size() && clients[waiting].received.find(prefix + std::to_string(waiting) + suffix) != std::string::npos)
+            waiting++;
+        if (Clock::now() > deadline)
+        {
+            printf("Timed out waiting for client %zu to be sent \"%s%zu\"\n", waiting, prefix.c_str(), waiting);
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+static pid_t startTakeover(const BenchmarkOptions &options)
+{
+    pid_t child = fork();
+    if (child != 0)
+        return child;
+
+    // Only the handoff should give the new process our sockets
+    for (int fd = 3; fd < (int)sysconf(_SC_OPEN_MAX); fd++)
+        close(fd);
+    std::string clients = std::to_string(options.clients);
+    std::string ioThreads = std::to_string(options.ioThreads);
+    execl("/proc/self/exe", "telnetServerBenchmark", "--takeover", options.handoverPath.c_str(), "--clients", clients.c_str(),
+        "--threads", ioThreads.c_str(), (char *)nullptr);
+    _exit(127);
+}
+
+// Run the server until it has read every byte the clients sent and handled lines of them,
+// without the clients reading anything
+static bool waitForInput(TelnetServer &ts, std::vector<HandoffClient> &clients, uint64_t lines)
+{
+    uint64_t expectedBytes = 0;
+    for (HandoffClient &c : clients)
+        expectedBytes += c.sent;
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(30);
+    while (ts.metrics().bytesIn < expectedBytes || ts.metrics().linesDispatched < lines)
+    {
+        if (Clock::now() > deadline)
+        {
+            printf("Timed out waiting for the server to read the partial lines\n");
+            return false;
+        }
+        ts.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// The new process creates the socket, but only starts listening a moment later
+static bool waitForTakeover(const BenchmarkOptions &options, TelnetServer &ts)
+{
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+    while (access(options.handoverPath.c_str(), F_OK) != 0)
+    {
+        if (Clock::now() > deadline)
+        {
+            printf("Nothing took over at %s\n", options.handoverPath.c_str());
+            return false;
+        }
+        ts.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+// --stall-ms: the new process is stopped for the whole of handOver(), so its acknowledgement only
+// arrives once the old process has carried on. It must leave the clients to the old process.
+static bool keepClients(const BenchmarkOptions &options, TelnetServer &ts, std::vector<HandoffClient> &clients, pid_t &child)
+{
+    for (size_t i = 0; i < clients.size(); i++)
+        sendText(clients[i], "history " + std::to_string(i) + "\r\n");
+    if (!waitForClients(&ts, clients, "old got history ", "\r\n"))
+        return false;
+    for (size_t i = 0; i < clients.size(); i++)
+        sendText(clients[i], "partial " + std::to_string(i));
+    if (!waitForInput(ts, clients, clients.size()))
+        return false;
+
+    child = startTakeover(options);
+    if (!waitForTakeover(options, ts))
+        return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));   // Past listen(), waiting for us
+    kill(child, SIGSTOP);
+    Clock::time_point stopped = Clock::now();
+    bool handedOver = ts.handOver(options.handoverPath, std::chrono::milliseconds(options.stallMilliseconds / 2));
+    std::this_thread::sleep_until(stopped + std::chrono::milliseconds(options.stallMilliseconds));
+    kill(child, SIGCONT);
+    if (handedOver)
+    {
+        printf("Handed over to a process that was stopped\n");
+        return false;
+    }
+
+    // The new process reads the snapshot, finds nobody to acknowledge and gives up
+    int status = 0;
+    while (waitpid(child, &status, WNOHANG) == 0)
+    {
+        ts.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    child = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 1)
+    {
+        printf("The late process did not give up\n");
+        return false;
+    }
+
+    // This process still has every client, partial line and history
+    for (HandoffClient &c : clients)
+        sendText(c, "\r\n");
+    if (!waitForClients(&ts, clients, "old got partial ", "\r\n"))
+        return false;
+    for (HandoffClient &c : clients)
+        sendText(c, "\x1b[A\x1b[A\r\n");
+    if (!waitForClients(&ts, clients, "old got history ", "\r\n"))
+        return false;
+    printf("Kept %zu clients when the new process answered too late\n", clients.size());
+    return true;
+}
+
+static bool moveClients(const BenchmarkOptions &options, TelnetServer &ts, std::vector<HandoffClient> &clients, pid_t &child)
+{
+    // Each client leaves a line in its history, asks for more output than it will read and
+    // starts typing another line
+    for (size_t i = 0; i < clients.size(); i++)
+        sendText(clients[i], "history " + std::to_string(i) + "\r\n");
+    if (!waitForClients(&ts, clients, "old got history ", "\r\n"))
+        return false;
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        sendText(clients[i], "bulk " + std::to_string(i) + "\r\n");
+        sendText(clients[i], "partial " + std::to_string(i));
+    }
+    if (!waitForInput(ts, clients, clients.size() * 2))
+        return false;
+
+    // Loopback send buffers grow to megabytes, so keep sending until each session has output the
+    // kernel would not take. A session only gets more once it has written what it had, which with
+    // I/O threads can take a few frames. Then a last line, so the client knows how many to expect.
+    std::string padding(80, '.');
+    bool backedUp = false;
+    while (!backedUp)
+    {
+        backedUp = true;
+        for (BulkSession &bulk : s_bulkSessions)
+        {
+            TelnetSessionMetrics metrics = bulk.session->metrics();
+            if (metrics.outputQueued > 0)
+                continue;
+            backedUp = false;
+            if (metrics.bytesOut < bulk.bytes)
+                continue;
+            if (bulk.lines > 1000000)
+            {
+                printf("%s never backed up\n", bulk.name.c_str());
+                return false;
+            }
+            for (int i = 0; i < 1000; i++)
+            {
+                std::string text = padding + bulk.name + " " + std::to_string(bulk.lines++);
+                bulk.bytes += text.length() + 2;
+                bulk.session->sendLine(text);
+            }
+        }
+        ts.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (BulkSession &bulk : s_bulkSessions)
+        bulk.session->sendLine(bulk.name + " end " + std::to_string(bulk.lines));
+    s_bulkSessions.clear();
+    ts.update();
+    TelnetServerMetrics before = ts.metrics();
+    if (before.bytesDropped > 0)
+    {
+        printf("%llu bytes of output were dropped\n", (unsigned long long)before.bytesDropped);
+        return false;
+    }
+
+    child = startTakeover(options);
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+    while (!waitForTakeover(options, ts) || !ts.handOver(options.handoverPath))
+    {
+        if (Clock::now() > deadline)
+        {
+            printf("Nothing took over at %s\n", options.handoverPath.c_str());
+            return false;
+        }
+        ts.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    printf("Handed %zu clients over with %llu bytes of output unsent\n", clients.size(), (unsigned long long)before.outputQueued);
+
+    // Every line of the output, in order, from whichever process sent it
+    if (!waitForClients(nullptr, clients, "bulk ", " end "))
+        return false;
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        const std::string &received = clients[i].received;
+        std::string name = "bulk " + std::to_string(i);
+        size_t end = received.find(name + " end ");
+        int lines = atoi(received.c_str() + end + name.length() + 5);
+        size_t at = 0;
+        for (int line = 0; line < lines && at < end; line++)
+            at = received.find(name + " " + std::to_string(line) + "\r\n", at);
+        if (lines == 0 || at >= end)
+        {
+            printf("Client %zu lost output in the handover\n", i);
+            return false;
+        }
+    }
+
+    // The new process finishes the partial line, then recalls the line before it from history
+    for (HandoffClient &c : clients)
+        sendText(c, "\r\n");
+    if (!waitForClients(nullptr, clients, "new got partial ", "\r\n"))
+        return false;
+    for (HandoffClient &c : clients)
+        sendText(c, "\x1b[A\x1b[A\x1b[A\r\n");
+    return waitForClients(nullptr, clients, "new got history ", "\r\n");
+}
+
+static int runHandover(const BenchmarkOptions &options)
+{
+    auto ts = std::make_shared<TelnetServer>();
+    ts->connectedCallback([](SP_TelnetSession) { s_connected++; });
+    ts->newLineViewCallback(answerLine);
+    ts->outputLimits(handoffLimits());
+    if (!ts->initialise(options.port, "> ", options.ioThreads))
+        return 1;
+
+    NullBuffer nullBuffer;
+    std::streambuf * coutBuffer = std::cout.rdbuf(&nullBuffer);
+
+    // Small receive windows, so what the clients leave unread backs up in the server's queues
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)options.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::vector<HandoffClient> clients(options.clients);
+    bool ok = true;
+    for (HandoffClient &c : clients)
+    {
+        int window = 4096;
+        c.sent = 0;
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(c.fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+        if (connect(c.fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        {
+            printf("connect failed with error: %d\n", errno);
+            ok = false;
+            break;
+        }
+        fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+    while (ok && s_connected.load() < options.clients && Clock::now() < deadline)
+        ts->update();
+
+    pid_t child = -1;
+    ok = ok && s_connected.load() == options.clients;
+    if (options.stallMilliseconds > 0)
+        ok = ok && keepClients(options, *ts, clients, child);
+    else
+        ok = ok && moveClients(options, *ts, clients, child);
+    // Let the server see the clients hang up before it shuts down
+    s_bulkSessions.clear();
+    for (HandoffClient &c : clients)
+        close(c.fd);
+    for (int i = 0; i < 50; i++)
+    {
+        ts->update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ts->shutdown();
+    std::cout.rdbuf(coutBuffer);
+
+    // The new process exits once its clients have all gone
+    if (child > 0)
+    {
+        if (!ok)
+            kill(child, SIGTERM);
+        int status = 0;
+        waitpid(child, &status, 0);
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    if (ok && options.stallMilliseconds == 0)
+        printf("Handover kept every partial line, history and unsent output\n");
+    else if (!ok)
+        printf("Handover check failed\n");
+    return ok ? 0 : 1;
+}
+
+static int runTakeover(const BenchmarkOptions &options)
+{
+    auto ts = std::make_shared<TelnetServer>();
+    ts->newLineViewCallback(answerLine);
+    ts->outputLimits(handoffLimits());
+
+    NullBuffer nullBuffer;
+    std::streambuf * coutBuffer = std::cout.rdbuf(&nullBuffer);
+    if (!ts->takeOver(options.takeoverPath, "> ", options.ioThreads, std::chrono::seconds(30)))
+    {
+        std::cout.rdbuf(coutBuffer);
+        printf("Did not take over at %s\n", options.takeoverPath.c_str());
+        return 1;
+    }
+
+    // Serve until the clients have all gone
+    uint64_t adopted = ts->metrics().sessions;
+    Clock::time_point deadline = Clock::now() + std::chrono::seconds(60);
+    while (ts->metrics().sessions > 0 && Clock::now() < deadline)
+    {
+        ts->update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bool ok = adopted == (uint64_t)options.clients && ts->metrics().sessions == 0;
+    ts->shutdown();
+    std::cout.rdbuf(coutBuffer);
+    printf("Took over %llu of %d clients\n", (unsigned long long)adopted, options.clients);
+    return ok ? 0 : 1;
+}
+
+/* ------------------ Host -------------------*/
+static void usage()
+{
+    printf("usage: telnetServerBenchmark [--clients N] [--threads N] [--lines N] [--paste BYTES] [--pings N] [--frame-us US] [--budget-us US] [--port PORT]\n");
+    printf("       telnetServerBenchmark --handover PATH [--stall-ms MS] [--clients N] [--threads N] [--port PORT]\n");
+    printf("       telnetServerBenchmark --takeover PATH [--clients N] [--threads N]\n");
+}
+
+static bool parseOptions(int argc, char * argv[], BenchmarkOptions &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        const char * text = argv[++i];
+        long value = strtol(text, nullptr, 10);
+        if (arg == "--clients")         options.clients = (int)value;
+        else if (arg == "--threads")    options.ioThreads = (unsigned)value;
+        else if (arg == "--lines")      options.keystrokeLines = (int)value;
+        else if (arg == "--paste")      options.pasteBytes = (size_t)value;
+        else if (arg == "--pings")      options.pings = (int)value;
+        else if (arg == "--frame-us")   options.frameMicroseconds = (int)value;
+        else if (arg == "--budget-us")  options.budgetMicroseconds = (int)value;
+        else if (arg == "--port")       options.port = (u_long)value;
+        else if (arg == "--handover")   options.handoverPath = text;
+        else if (arg == "--takeover")   options.takeoverPath = text;
+        else if (arg == "--stall-ms")   options.stallMilliseconds = (int)value;
+        else return false;
+    }
+    return options.clients > 0;
+}
+
+static void printUpdateTimes(const char * name, std::vector<uint32_t> &samples)
+{
+    if (samples.empty())
+        return;
+    printf("  %-10s %9zu frames   p50 %8.1f us   p99 %8.1f us   p999 %8.1f us\n", name, samples.size(),
+        percentile(samples, 0.50) / 1000.0, percentile(samples, 0.99) / 1000.0, percentile(samples, 0.999) / 1000.0);
+}
+
+int main(int argc, char * argv[])
+{
+    BenchmarkOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        usage();
+        return 1;
+    }
+    if (!options.takeoverPath.empty())
+        return runTakeover(options);
+    if (!options.handoverPath.empty())
+        return runHandover(options);
+
+    // Do unit tests
+    TelnetSession::UNIT_TEST();
+
+    // Two descriptors per client (both ends live in this process) plus some slack
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < (rlim_t)options.clients * 2 + 64)
+    {
+        printf("Need %d file descriptors but the limit is %llu\n", options.clients * 2 + 64, (unsigned long long)limit.rlim_cur);
+        return 1;
+    }
+
+    auto ts = std::make_shared<TelnetServer>();
+    ts->connectedCallback([](SP_TelnetSession) { s_connected++; });
+    ts->newLineViewCallback([](SP_TelnetSession session, std::string_view line)
+    {
+        s_lines++;
+        s_lineBytes += line.length();
+        if (line.compare(0, 5, "ping ") == 0)
+            session->sendLine("pong " + std::string(line.substr(5)));
+    });
+    if (!ts->initialise(options.port, "", options.ioThreads))
+        return 1;
+
+    NullBuffer nullBuffer;
+    std::streambuf * coutBuffer = std::cout.rdbuf(&nullBuffer);
+
+    PhaseResult results[PhaseCount];
+    std::vector<uint64_t> latencies;
+    std::atomic<bool> clientsDone(false);
+    bool clientsOk = false;
+    LoadClients clients(options);
+    std::thread clientThread([&]()
+    {
+        clientsOk = clients.run(results, latencies);
+        clientsDone = true;
+    });
+
+    // The host loop: what a game would do every frame
+    std::vector<uint32_t> updateTimes[PhaseCount];
+    uint64_t deferredFrames = 0;
+    while (!clientsDone)
+    {
+        int phase = s_phase.load();
+        Clock::time_point frameStart = Clock::now();
+        if (options.budgetMicroseconds > 0)
+        {
+            TelnetUpdateReport report = ts->update(std::chrono::microseconds(options.budgetMicroseconds));
+            if (report.budgetExhausted)
+                deferredFrames++;
+        }
+        else
+        {
+            ts->update();
+        }
+        uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - frameStart).count();
+        updateTimes[phase].push_back((uint32_t)std::min<uint64_t>(elapsed, UINT32_MAX));
+
+        if (options.frameMicroseconds > 0)
+            std::this_thread::sleep_until(frameStart + std::chrono::microseconds(options.frameMicroseconds));
+    }
+    clientThread.join();
+
+    // Let the server see the clients hang up before it shuts down
+    TelnetServerMetrics metrics = ts->metrics();
+    clients.hangUp();
+    for (int i = 0; i < 50; i++)
+    {
+        ts->update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ts->shutdown();
+    std::cout.rdbuf(coutBuffer);
+
+    if (!clientsOk)
+    {
+        printf("Benchmark did not complete\n");
+        return 1;
+    }
+
+    printf("\n%d clients, %u I/O threads, %d us frames\n\n", options.clients, options.ioThreads, options.frameMicroseconds);
+    printf("  accepts/sec     %12.0f\n", results[Connect].lines / results[Connect].seconds);
+    for (int phase : { Keystroke, Paste })
+    {
+        printf("  %-10s lines/sec %12.0f   bytes/sec %14.0f\n", s_phaseNames[phase],
+            results[phase].lines / results[phase].seconds, results[phase].bytes / results[phase].seconds);
+    }
+    printf("  output sent %llu bytes in %llu sends, dropped %llu, write stalls %llu\n", (unsigned long long)metrics.bytesOut,
+        (unsigned long long)metrics.sendCalls, (unsigned long long)metrics.bytesDropped, (unsigned long long)metrics.writeStalls);
+    printf("  input read %llu bytes in %llu reads\n", (unsigned long long)metrics.bytesIn, (unsigned long long)metrics.recvCalls);
+    printf("  callbacks p50 %8.1f us   p99 %8.1f us   max %8.1f us\n", metrics.callbackTime.percentile(0.5) / 1000.0,
+        metrics.callbackTime.percentile(0.99) / 1000.0, metrics.callbackTime.max / 1000.0);
+
+    if (options.budgetMicroseconds > 0)
+        printf("  %d us budget ran out in %llu frames\n", options.budgetMicroseconds, (unsigned long long)deferredFrames);
+
+    printf("\nTelnetServer::update() wall time\n");
+    for (int phase = 0; phase < PhaseCount; phase++)
+        printUpdateTimes(s_phaseNames[phase], updateTimes[phase]);
+
+    printf("\nEcho latency (%zu round trips)\n", latencies.size());
+    printf("  p50 %8.1f us   p99 %8.1f us   p999 %8.1f us\n\n",
+        percentile(latencies, 0.50) / 1000.0, percentile(latencies, 0.99) / 1000.0, percentile(latencies, 0.999) / 1000.0);
+    return 0;
+}
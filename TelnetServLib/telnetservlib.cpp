@@ -1,470 +1,4992 @@
 #include "telnetservlib.hpp"
 #include "iostream"
-#include <assert.h>
+#include <cstdlib>
 #include <array>
 #include <iterator>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 
+#ifdef _WIN32
 // Need to link with Ws2_32.lib
 #pragma comment (lib, "Ws2_32.lib")
 // #pragma comment (lib, "Mswsock.lib")
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#ifdef TELNETSERVLIB_EPOLL
+#include <sys/eventfd.h>
+#endif
+#if defined(__linux__)
+#define TELNETSERVLIB_ACCEPT4   // accept4 makes the new socket non-blocking in the same call
+#endif
 
-#define DEFAULT_BUFLEN 512
+// Map the handful of Winsock calls used below onto their POSIX equivalents
+#define closesocket     ::close
+#define SD_SEND         SHUT_WR
+#define WSAEWOULDBLOCK  EWOULDBLOCK
+#define WSAPoll         ::poll
+static int WSAGetLastError() { return errno; }
+#endif
 
-void TelnetSession::sendPromptAndBuffer()
+#ifdef TELNETSERVLIB_MCCP
+#include <zlib.h>
+
+// One session's MCCP2 deflate stream
+struct TelnetCompressor
 {
-    // Output the prompt
-    u_long iSendResult;
-    iSendResult = send(m_socket, m_telnetServer->promptString().c_str(), (u_long)m_telnetServer->promptString().length(), 0);
+    TelnetCompressor() : level(0), ready(false) { memset(&stream, 0, sizeof(stream)); }
+    ~TelnetCompressor() { if (ready) deflateEnd(&stream); }
 
-    if (m_buffer.length() > 0)
+    z_stream    stream;
+    int         level;      // Level the stream is running at right now
+    bool        ready;      // deflateInit2 succeeded
+    std::string scratch;    // Compressed output being built. Swapped into the output queue, so its capacity is reused
+};
+
+// Run data through a deflate stream, appending whatever comes out
+static void deflateInto(z_stream &stream, std::string &out, const char * data, size_t length, int flush)
+{
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)length;
+    do
     {
-        // resend the buffer
-        iSendResult = send(m_socket, m_buffer.c_str(), (u_long)m_buffer.length(), 0);
-    }
+        size_t used = out.length();
+        out.resize(used + length + 64);
+        stream.next_out = (Bytef *)&out[used];
+        stream.avail_out = (uInt)(out.length() - used);
+        deflate(&stream, flush);
+        out.resize(out.length() - stream.avail_out);
+    } while (stream.avail_out == 0);
 }
+#else
+struct TelnetCompressor {};
+#endif
 
-void TelnetSession::eraseLine()
-{
-    u_long iSendResult;
-    // send an erase line       
-    iSendResult = send(m_socket, ANSI_ERASE_LINE.c_str(), (u_long)ANSI_ERASE_LINE.length(), 0);
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL     // A client hanging up mid-send must not raise SIGPIPE
+#else
+#define SEND_FLAGS 0
+#endif
+
+#define MAX_EPOLL_EVENTS 256
+#define REACTOR_POLL_MS 5       // I/O thread poll timeout where there is no way to wake it
+#define TIMER_TICK_MS 100       // Resolution of the session timeouts
+#define MAX_IOV 64              // Chunks gathered into a single send
+#define OUTPUT_CHUNK_SIZE 4096  // Writes stop being coalesced into a chunk this big, so DropOldest can shed output in pieces
+#define MAX_SUBNEGOTIATION 256  // Longest IAC SB payload we keep, the rest is dropped
+#define MAX_CSI_PARAMS 16       // Longest ESC [ parameter string we keep
+#define TOPIC_BATCH 256         // Topic lines read from a ring at a time
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TELNETSERVLIB_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TELNETSERVLIB_TARGET(isa)
+static unsigned countTrailingZeros(unsigned x) { unsigned long i; _BitScanForward(&i, x); return (unsigned)i; }
+#else
+#define TELNETSERVLIB_TARGET(isa) __attribute__((target(isa)))
+static unsigned countTrailingZeros(unsigned x) { return (unsigned)__builtin_ctz(x); }
+#endif
+#endif
 
-    // Move the cursor to the beginning of the line
-    std::string moveBack = "\x1b[80D";
-    iSendResult = send(m_socket, moveBack.c_str(), (u_long)moveBack.length(), 0);
+static void setNonBlocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long iMode = 1;
+    ioctlsocket(s, FIONBIO, &iMode);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(s, F_SETFD, FD_CLOEXEC);     // Not inherited across exec, e.g. by the process we hand over to
+#endif
 }
 
-void TelnetSession::sendLine(std::string data)
+/* ------------------ Input Scanning -------------------*/
+// Finding the end of a run of printable ASCII (0x20-0x7e) is most of the work of parsing
+// typed or pasted input. The widest implementation the CPU supports is picked at startup.
+
+static size_t scanPrintableScalar(const char * data, size_t length)
 {
-    u_long iSendResult;
-    // If is something is on the prompt, wipe it off
-    if (m_telnetServer->interactivePrompt() || m_buffer.length() > 0)
+    size_t i = 0;
+    for (; i < length; i++)
     {
-        eraseLine();
+        unsigned char b = (unsigned char)data[i];
+        if (b < 0x20 || b >= 0x7f)
+            break;
     }
-
-    data.append("\r\n");
-    iSendResult = send(m_socket, data.c_str(), (u_long)data.length(), 0);
-
-    if (m_telnetServer->interactivePrompt())
-        sendPromptAndBuffer();
+    return i;
 }
 
-void TelnetSession::closeClient()
+#ifdef TELNETSERVLIB_X86
+// Signed compare: 0x00-0x1f and 0x80-0xff are both "less than 0x20". DEL is checked on its own.
+TELNETSERVLIB_TARGET("sse2") static size_t scanPrintableSSE2(const char * data, size_t length)
 {
-    u_long iResult;
-
-    // attempt to cleanly shutdown the connection since we're done
-    iResult = shutdown(m_socket, SD_SEND);
-    if (iResult == SOCKET_ERROR) {
-        printf("shutdown failed with error: %d\n", WSAGetLastError());
-        return;
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)));
+        if (mask != 0)
+            return i + countTrailingZeros((unsigned)mask);
     }
-
-    // cleanup
-    closesocket(m_socket);
+    return i + scanPrintableScalar(data + i, length - i);
 }
 
-void TelnetSession::echoBack(char * buffer, u_long length)
+TELNETSERVLIB_TARGET("avx2") static size_t scanPrintableAVX2(const char * data, size_t length)
 {
-    // Echo the buffer back to the sender
-
-    // If you are an NVT command (i.e. first it of data is 255) then ignore the echo back
-    unsigned char firstItem = * buffer;
-    if (firstItem == 0xff)
-        return;
-
-    u_long iSendResult;
-    iSendResult = send(m_socket, buffer, length, 0);
-
-    if (iSendResult == SOCKET_ERROR && iSendResult != WSAEWOULDBLOCK) {
-        printf("Send failed with Winsock error: %d\n", WSAGetLastError());
-        std::cout << "Closing session and socket.\r\n";
-        closesocket(m_socket);
-        return;
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del)));
+        if (mask != 0)
+            return i + countTrailingZeros((unsigned)mask);
     }
+    return i + scanPrintableSSE2(data + i, length - i);
 }
 
-void TelnetSession::initialise()
+static bool cpuHasAVX2()
 {
-    // get details of connection
-    SOCKADDR_IN client_info = { 0 };
-    int addrsize = sizeof(client_info);
-    getpeername(m_socket, (struct sockaddr*)&client_info, &addrsize);
-
-    char ip[16];
-    inet_ntop(AF_INET, &client_info.sin_addr, &ip[0], 16);
-
-    std::cout << "Client " << ip << " connected...\n";
-
-    // Set the connection to be non-blocking
-    u_long iMode = 1;
-    ioctlsocket(m_socket, FIONBIO, &iMode);
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)   // The OS must save the YMM registers
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
 
-    // Set NVT mode to say that I will echo back characters.
-    u_long iSendResult;
-    unsigned char willEcho[3] = { 0xff, 0xfb, 0x01 };
-    iSendResult = send(m_socket, (char *)willEcho, 3, 0);
+typedef size_t (*FPTR_ScanPrintable)(const char *, size_t);
 
-    // Set NVT requesting that the remote system not/dont echo back characters
-    unsigned char dontEcho[3] = { 0xff, 0xfe, 0x01 };
-    iSendResult = send(m_socket, (char *)dontEcho, 3, 0);
+static FPTR_ScanPrintable selectScanPrintable()
+{
+#ifdef TELNETSERVLIB_X86
+    return cpuHasAVX2() ? scanPrintableAVX2 : scanPrintableSSE2;
+#else
+    return scanPrintableScalar;
+#endif
+}
 
-    // Set NVT mode to say that I will supress go-ahead. Stops remote clients from doing local linemode.
-    unsigned char willSGA[3] = { 0xff, 0xfb, 0x03 };
-    iSendResult = send(m_socket, (char *)willSGA, 3, 0);
+// Chosen once at static initialisation, so I/O threads never race to pick it
+static const FPTR_ScanPrintable s_scanPrintable = selectScanPrintable();
 
-    if (m_telnetServer->connectedCallback())
-        m_telnetServer->connectedCallback()(shared_from_this());
+static bool utf8Continues(unsigned char lead, size_t position, unsigned char c)
+{
+    // Is c a legal byte at this position of a sequence starting with lead? Rejects overlong
+    // forms, UTF-16 surrogates and code points above U+10FFFF.
+    if ((c & 0xc0) != 0x80)
+        return false;
+    if (position != 1)
+        return true;
+    switch (lead)
+    {
+    case 0xe0: return c >= 0xa0;
+    case 0xed: return c <= 0x9f;
+    case 0xf0: return c >= 0x90;
+    case 0xf4: return c <= 0x8f;
+    default:   return true;
+    }
 }
 
-void TelnetSession::stripNVT(std::string &buffer)
+static int utf8SequenceLength(const char * p, const char * end, size_t &invalidLength)
 {
-    size_t found;
-    do
+    // Length of the valid UTF-8 sequence at p, 0 if it is invalid, or minus the full length
+    // if it is valid as far as it goes but runs past end. For an invalid sequence invalidLength
+    // is set to the bytes that were valid as far as they went (at least 1), which are replaced
+    // with a single U+FFFD. A character split across reads is treated the same way.
+    unsigned char lead = (unsigned char)*p;
+    int length;
+    if (lead >= 0xc2 && lead <= 0xdf)
+        length = 2;
+    else if (lead >= 0xe0 && lead <= 0xef)
+        length = 3;
+    else if (lead >= 0xf0 && lead <= 0xf4)
+        length = 4;
+    else
     {
-        unsigned char findChar = 0xff;
-        found = buffer.find_first_of((char)findChar);
-        if (found != std::string::npos && (found + 2) <= buffer.length() - 1)
+        invalidLength = 1;
+        return 0;
+    }
+
+    for (int i = 1; i < length; i++)
+    {
+        if (p + i == end)
+            return -length;
+        if (!utf8Continues(lead, i, (unsigned char)p[i]))
         {
-            buffer.erase(found, 3);
+            invalidLength = (size_t)i;
+            return 0;
         }
-    } while (found != std::string::npos);
+    }
+    return length;
 }
 
-void TelnetSession::stripEscapeCharacters(std::string &buffer)
+TelnetSession::TelnetSession(SOCKET ClientSocket, std::shared_ptr<TelnetServer> ts, std::shared_ptr<TelnetReactor> reactor) : m_socket(ClientSocket), m_telnetServer(ts), m_reactor(std::move(reactor)),
+    m_input(INPUT_BUFFER_SIZE), m_cursor(0), m_columns(80), m_eventCursor(0), m_readyQueued(false), m_outHead(0), m_outTail(0), m_outBytes(0), m_plainFrom(0), m_compressOffered(false), m_flushPending(false), m_writeBlocked(false), m_outputSuspended(false), m_skippedBytes(0),
+    m_bytesIn(0), m_bytesOut(0), m_linesIn(0), m_outQueued(0), m_history(ts->historyCapacity()), m_historyCursor(0), m_adopted(false), m_negotiated(false)
 {
-    size_t found;
-
-    std::array<std::string, 4> cursors = { ANSI_ARROW_UP, ANSI_ARROW_DOWN, ANSI_ARROW_RIGHT, ANSI_ARROW_LEFT };
+    m_timer.owner = this;
+}
 
-    for (auto c : cursors)
-    {
-        do
-        {
-            found = buffer.find(c);
-            if (found != std::string::npos)
-            {
-                buffer.erase(found, c.length());
-            }
-        } while (found != std::string::npos);
-    }
+TelnetSession::~TelnetSession()
+{
+    // Out of line so the header only needs TelnetCompressor declared
 }
 
-bool TelnetSession::processBackspace(std::string &buffer)
+void TelnetSession::sendPromptAndBuffer()
 {
-    bool foundBackspaces = false;
-    size_t found;
-    do
+    // Output the prompt
+    const std::string &prompt = m_reactor->m_promptString;
+    queueOutput(prompt.c_str(), prompt.length());
+
+    if (m_buffer.length() > 0)
     {
-        // Need to handle both \x7f and \b backspaces
-        unsigned char findChar = '\x7f';
-        found = buffer.find_first_of((char)findChar);
-        if (found == std::string::npos)
-        {
-            findChar = '\b';
-            found = buffer.find_first_of((char)findChar);
-        }
+        // resend the buffer
+        queueText(m_buffer);
+    }
 
-        if (found != std::string::npos)
-        {
-            if (buffer.length() > 1)
-                buffer.erase(found - 1, 2);
-            else
-                buffer = "";
-            foundBackspaces = true;
-        }
-    } while (found != std::string::npos);
-    return foundBackspaces;
+    // Columns are only counted for a line long enough to have wrapped
+    if (prompt.length() + m_buffer.length() >= m_columns || m_cursor < m_buffer.length())
+    {
+        size_t end = lineColumns(m_buffer.length());
+        textWritten(end);
+        queueCursorMove(end, lineColumns(m_cursor));
+    }
 }
 
-void TelnetSession::addToHistory(std::string line)
+bool TelnetSession::eraseLine()
 {
-    // Add it to the history
-    if (line != (m_history.size() > 0 ? m_history.back() : "") && line != "")
+    if (!m_reactor->interactivePrompt() && m_buffer.empty() && m_lineView.empty())
+        return false;   // Nothing on the client's line
+
+    // Up to the row the prompt is on, then clear from its start to the end of the screen, which
+    // takes any rows the line wrapped onto with it
+    keepPendingLine();
+    if (m_reactor->m_promptString.length() + m_cursor >= m_columns)
     {
-        m_history.push_back(line);
-        if (m_history.size() > 50)
-            m_history.pop_front();
+        size_t rows = lineColumns(m_cursor) / m_columns;
+        queueCursorMove(rows * m_columns, 0);
     }
-    m_historyCursor = m_history.end();
+    queueOutput("\r\x1b[J", 4);
+    return true;
 }
 
-bool TelnetSession::processCommandHistory(std::string &buffer)
+// Columns text takes on the client's screen: one for each UTF-8 character, none for control
+// characters or escape sequences (a coloured prompt)
+static size_t countColumns(std::string_view text)
 {
-    // Handle up and down arrow actions
-    if (m_telnetServer->interactivePrompt())
+    size_t columns = 0;
+    for (size_t i = 0; i < text.length(); i++)
     {
-        if (buffer.find(ANSI_ARROW_UP) != std::string::npos && m_history.size() > 0)
+        unsigned char c = (unsigned char)text[i];
+        if (c == 0x1b)
         {
-            if (m_historyCursor != m_history.begin())
+            // ESC [ parameters, then a final byte from @ to ~. Other escapes are taken to be two bytes
+            if (i + 1 < text.length() && text[i + 1] == '[')
             {
-                m_historyCursor--;
+                i += 2;
+                while (i < text.length() && ((unsigned char)text[i] < 0x40 || (unsigned char)text[i] > 0x7e))
+                    i++;
             }
-            buffer = *m_historyCursor;
-
-            // Issue a cursor command to counter it
-            u_long iSendResult;
-            iSendResult = send(m_socket, ANSI_ARROW_DOWN.c_str(), (u_long)ANSI_ARROW_DOWN.length(), 0);
-            return true;
-        }
-        if (buffer.find(ANSI_ARROW_DOWN) != std::string::npos && m_history.size() > 0)
-        {
-            if (next(m_historyCursor) != m_history.end())
+            else
             {
-                m_historyCursor++;
+                i++;
             }
-            buffer = *m_historyCursor;
-
-            // Issue a cursor command to counter it
-            u_long iSendResult;
-            iSendResult = send(m_socket, ANSI_ARROW_UP.c_str(), (u_long)ANSI_ARROW_UP.length(), 0);
-            return true;
         }
-        if (buffer.find(ANSI_ARROW_LEFT) != std::string::npos || buffer.find(ANSI_ARROW_RIGHT) != std::string::npos)
+        else if (c >= 0x20 && (c & 0xc0) != 0x80)
         {
-            // Ignore left and right and just reprint buffer
-            return true;
+            columns++;
         }
     }
-    return false;
+    return columns;
 }
 
-std::vector<std::string> TelnetSession::getCompleteLines(std::string &buffer)
+// Start of the UTF-8 character before byte at
+static size_t previousCharacter(std::string_view text, size_t at)
 {
-    // Now find all new lines (<CR><LF>) and place in a vector and delete from buffer
-    
-    char CRLF[2] = { 0x0D, 0x0A };
-    std::vector<std::string> lines;
-    size_t found;
-    do
+    if (at == 0)
+        return 0;
+    at--;
+    while (at > 0 && ((unsigned char)text[at] & 0xc0) == 0x80)
+        at--;
+    return at;
+}
+
+// Byte after the UTF-8 character that starts at at
+static size_t nextCharacter(std::string_view text, size_t at)
+{
+    if (at >= text.length())
+        return text.length();
+    at++;
+    while (at < text.length() && ((unsigned char)text[at] & 0xc0) == 0x80)
+        at++;
+    return at;
+}
+
+size_t TelnetSession::lineColumns(size_t bytes) const
+{
+    std::string_view line = m_lineView.empty() ? std::string_view(m_buffer) : m_lineView;
+    return countColumns(m_reactor->m_promptString) + countColumns(line.substr(0, bytes));
+}
+
+void TelnetSession::queueText(std::string_view text)
+{
+    // A 0xFF typed by the client has to go back to it as IAC IAC
+    size_t start = 0;
+    while (start < text.length())
     {
-        found = buffer.find("\r\n");
-        if (found != std::string::npos)
-        {
-            lines.push_back(buffer.substr(0, found));
-            buffer.erase(0, found + 2);
-        }
-    } while (found != std::string::npos);
+        const char * iac = (const char *)memchr(text.data() + start, TELNET_IAC, text.length() - start);
+        size_t end = iac ? (size_t)(iac - text.data()) + 1 : text.length();
+        queueOutput(text.data() + start, end - start);
+        if (iac)
+            queueOutput("\xff", 1);
+        start = end;
+    }
+}
+
+void TelnetSession::queueCursorMove(size_t from, size_t to)
+{
+    // Relative moves, so the prompt can start anywhere on the client's screen. One column to the
+    // left is a plain backspace.
+    char sequence[64];
+    size_t length = 0;
+    auto csi = [&](size_t count, char final)
+    {
+        sequence[length++] = '\x1b';
+        sequence[length++] = '[';
+        if (count > 1)
+            length = std::to_chars(sequence + length, sequence + length + 20, count).ptr - sequence;    // 20 digits hold any size_t
+        sequence[length++] = final;
+    };
 
-    return lines;
+    size_t fromRow = from / m_columns, toRow = to / m_columns;
+    size_t fromColumn = from % m_columns, toColumn = to % m_columns;
+    if (toRow < fromRow)
+        csi(fromRow - toRow, 'A');
+    else if (toRow > fromRow)
+        csi(toRow - fromRow, 'B');
+    if (toColumn + 1 == fromColumn)
+        sequence[length++] = '\b';
+    else if (toColumn < fromColumn)
+        csi(fromColumn - toColumn, 'D');
+    else if (toColumn > fromColumn)
+        csi(toColumn - fromColumn, 'C');
+
+    if (length > 0)
+        queueOutput(sequence, length);
 }
 
-void TelnetSession::update()
+void TelnetSession::textWritten(size_t column)
 {
-    int  readBytes;
-    char recvbuf[DEFAULT_BUFLEN];
-    u_long  recvbuflen = DEFAULT_BUFLEN;
+    // A terminal that has just written to its last column keeps the cursor there until the next
+    // character arrives. Move it on to the next row now, where the column count says it is.
+    if (column > 0 && column % m_columns == 0)
+        queueOutput("\r\n", 2);
+}
 
-    readBytes = recv(m_socket, recvbuf, recvbuflen, 0);
+void TelnetSession::redrawTail(size_t from, size_t oldEnd)
+{
+    std::string_view tail = std::string_view(m_buffer).substr(from);
+    size_t at = lineColumns(from) + countColumns(tail);
+    if (!tail.empty())
+    {
+        queueText(tail);
+        textWritten(at);
+    }
 
-    // Check for errors from the read
-    int error = WSAGetLastError();
-    if (error != WSAEWOULDBLOCK && error != 0)
+    if (oldEnd > at)
     {
-        std::cout << "Receive failed with Winsock error code: " << error << "\r\n";
-        std::cout << "Closing session and socket.\r\n";
-        closesocket(m_socket);
-        return;
+        if (oldEnd - at <= 4)
+        {
+            // Blank the few columns the line has lost
+            queueOutput("    ", oldEnd - at);
+            at = oldEnd;
+            textWritten(at);
+        }
+        else
+        {
+            queueOutput("\x1b[J", 3);     // Erase to the end of the screen, including rows the old line wrapped onto
+        }
     }
 
-    if (readBytes > 0) {
-        // Echo it back to the sender
-        echoBack(recvbuf, readBytes);
+    queueCursorMove(at, lineColumns(m_cursor));
+}
 
-        // we've got to be careful here. Telnet client might send null characters for New Lines mid-data block. We need to swap these out. recv is not null terminated, so its cool
-        for (int i = 0; i < readBytes; i++)
+void TelnetSession::editLine(const TelnetInputEvent &ev)
+{
+    // Each key sends only what it changes: a backspace at the end of the line is "\b \b", and an
+    // edit in the middle rewrites the rest of the line and moves the cursor back
+    size_t length = m_buffer.length();
+    size_t at = lineColumns(m_cursor);
+    switch (ev.type)
+    {
+    case TelnetInputEvent::CursorLeft:
+        if (m_cursor > 0)
         {
-            if (recvbuf[i] == 0x00)
-                recvbuf[i] = 0x0A;      // New Line
+            m_cursor = previousCharacter(m_buffer, m_cursor);
+            queueCursorMove(at, lineColumns(m_cursor));
         }
+        break;
 
-        // Add it to the received buffer
-        m_buffer.append(recvbuf, readBytes);
+    case TelnetInputEvent::CursorRight:
+        if (m_cursor < length)
+        {
+            // Writing the character again is as short as any cursor move
+            size_t next = nextCharacter(m_buffer, m_cursor);
+            queueText(std::string_view(m_buffer).substr(m_cursor, next - m_cursor));
+            m_cursor = next;
+            textWritten(lineColumns(m_cursor));
+        }
+        break;
 
-        stripNVT(m_buffer);                         // Remove telnet negotiation sequences
+    case TelnetInputEvent::Home:
+        m_cursor = 0;
+        queueCursorMove(at, lineColumns(m_cursor));
+        break;
 
-        bool requirePromptReprint = false;
+    case TelnetInputEvent::End:
+        m_cursor = length;
+        queueCursorMove(at, lineColumns(m_cursor));
+        break;
 
-        if (m_telnetServer->interactivePrompt())
+    case TelnetInputEvent::Erase:
+        if (m_cursor > 0)
         {
-            if (processCommandHistory(m_buffer))   // Read up and down arrow keys and scroll through history
-                requirePromptReprint = true;
-            stripEscapeCharacters(m_buffer);
-
-            if (processBackspace(m_buffer))
-                requirePromptReprint = true;
+            size_t oldEnd = lineColumns(length);
+            size_t start = previousCharacter(m_buffer, m_cursor);
+            m_buffer.erase(start, m_cursor - start);
+            m_cursor = start;
+            queueCursorMove(at, lineColumns(m_cursor));
+            redrawTail(m_cursor, oldEnd);
         }
+        break;
 
-        auto lines = getCompleteLines(m_buffer);
-        for (auto line : lines)
+    case TelnetInputEvent::Delete:
+        if (m_cursor < length)
         {
-            if (m_telnetServer->newLineCallBack())
-                m_telnetServer->newLineCallBack()(shared_from_this(), line);
-            
-            addToHistory(line);
+            size_t oldEnd = lineColumns(length);
+            m_buffer.erase(m_cursor, nextCharacter(m_buffer, m_cursor) - m_cursor);
+            redrawTail(m_cursor, oldEnd);
         }
+        break;
 
-        if (m_telnetServer->interactivePrompt() && requirePromptReprint)
-        {
-            eraseLine();
-            sendPromptAndBuffer();
-        }
+    default:
+        break;
     }
 }
 
-void TelnetSession::UNIT_TEST()
+void TelnetSession::replaceLine(std::string_view line)
 {
-    /* stripNVT */
-    std::cout << "TEST: stripNVT\n";
-    std::string origData = "12345";
-    std::string data = origData;
-    unsigned char toStrip[3] = { 255, 251, 1 };
-    data.insert(2, (char *)toStrip, 3);
-    TelnetSession::stripNVT(data);
+    // Keep what the two lines start with and rewrite from the first difference
+    size_t oldEnd = lineColumns(m_buffer.length());
+    size_t same = 0;
+    while (same < m_buffer.length() && same < line.length() && m_buffer[same] == line[same])
+        same++;
+    while (same > 0 && ((same < m_buffer.length() && ((unsigned char)m_buffer[same] & 0xc0) == 0x80) ||
+                        (same < line.length() && ((unsigned char)line[same] & 0xc0) == 0x80)))
+        same--;     // Back to the start of a character both share
 
-    assert(origData == data);
+    queueCursorMove(lineColumns(m_cursor), lineColumns(same));
+    m_buffer.assign(line.data(), line.length());
+    m_cursor = m_buffer.length();
+    redrawTail(same, oldEnd);
+}
 
-    /* processBackspace */
-    std::cout << "TEST: handleBackspace\n";
-    std::string bkData = "123455\x7f";
-    bool bkResult = TelnetSession::processBackspace(bkData);
-    assert(bkData == "12345");
-    assert(bkResult == true);
+void TelnetSession::sendLine(std::string data)
+{
+    if (m_telnetServer.expired())
+        return;     // The server has been destroyed
 
-    /* getCompleteLines */
-    std::cout << "TEST: getCompleteLines\n";
-    std::string multiData = "LINE1\r\nLINE2\r\nLINE3\r\n";
-    auto lines = TelnetSession::getCompleteLines(multiData);
+    if (m_reactor->m_threaded && !m_reactor->onReactorThread())
+    {
+        // The session belongs to an I/O thread, so hand the line over to it
+        TelnetReactorCommand cmd;
+        cmd.type = TelnetReactorCommand::Send;
+        cmd.session = shared_from_this();
+        cmd.data = std::move(data);
+        m_reactor->post(std::move(cmd));
+        return;
+    }
 
-    assert(lines.size() == 3);
-    assert(lines[0] == "LINE1");
-    assert(lines[1] == "LINE2");
-    assert(lines[2] == "LINE3");
+    queueLine(data);
 }
 
-/* ------------------ Telnet Server -------------------*/
-bool TelnetServer::initialise(u_long listenPort, std::string promptString)
+void TelnetSession::sendLineView(std::string_view line)
 {
-    if (m_initialised)
+    if (m_telnetServer.expired())
+        return;
+
+    if (m_reactor->m_threaded && !m_reactor->onReactorThread())
     {
-        std::cout << "This Telnet Server instance has already been initialised. Please shut it down before reinitialising it.";
-        return false;
+        // Only now does the line need a string of its own
+        TelnetReactorCommand cmd;
+        cmd.type = TelnetReactorCommand::Send;
+        cmd.session = shared_from_this();
+        cmd.data.assign(line.data(), line.length());
+        m_reactor->post(std::move(cmd));
+        return;
     }
 
-    m_listenPort = listenPort;
-    m_promptString = promptString;
+    queueLine(line);
+}
 
-    std::cout << "Starting Telnet Server on port " << std::to_string(m_listenPort) << "\n";
+void TelnetSession::queueLine(std::string_view line)
+{
+    // If is something is on the prompt, wipe it off
+    bool erased = eraseLine();
 
-    WSADATA wsaData;
-    int iResult;
+    queueOutput(line.data(), line.length());
+    queueOutput("\r\n", 2);
 
-    m_listenSocket = INVALID_SOCKET;
+    if (erased)
+        sendPromptAndBuffer();
+}
 
-    struct addrinfo *result = NULL;
-    struct addrinfo hints;
+void TelnetSession::sendf(const char *format, ...)
+{
+    TelnetFormatBuffer line;
+    va_list args;
+    va_start(args, format);
+    line.vprintf(format, args);
+    va_end(args);
+    sendLineView(line.view());
+}
 
-    // Initialize Winsock
-    iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        printf("WSAStartup failed with error: %d\n", iResult);
-        return false;
+void TelnetSession::sendLine(const SP_TelnetPayload &payload)
+{
+    if (m_telnetServer.expired())
+        return;
+
+    if (m_reactor->m_threaded && !m_reactor->onReactorThread())
+    {
+        TelnetReactorCommand cmd;
+        cmd.type = TelnetReactorCommand::SendPayload;
+        cmd.session = shared_from_this();
+        cmd.payload = payload;
+        m_reactor->post(std::move(cmd));
+        return;
     }
 
-    ZeroMemory(&hints, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = AI_PASSIVE;
+    // As above, but the already encoded line is queued by reference rather than copied
+    bool erased = eraseLine();
 
-    // Resolve the server address and port
-    iResult = getaddrinfo(NULL, std::to_string(m_listenPort).c_str(), &hints, &result);
-    if (iResult != 0) {
-        printf("getaddrinfo failed with error: %d\n", iResult);
-        return false;
-    }
+    queuePayload(payload);
 
-    // Create a SOCKET for connecting to server
-    m_listenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (m_listenSocket == INVALID_SOCKET) {
-        printf("socket failed with error: %ld\n", WSAGetLastError());
-        freeaddrinfo(result);
-        return false;
+    if (erased)
+        sendPromptAndBuffer();
+}
+
+void TelnetSession::sendRaw(std::string data)
+{
+    if (m_telnetServer.expired())
+        return;
+
+    if (m_reactor->m_threaded && !m_reactor->onReactorThread())
+    {
+        TelnetReactorCommand cmd;
+        cmd.type = TelnetReactorCommand::SendRaw;
+        cmd.session = shared_from_this();
+        cmd.data = std::move(data);
+        m_reactor->post(std::move(cmd));
+        return;
     }
 
-    // Setup the TCP listening socket
-    iResult = bind(m_listenSocket, result->ai_addr, (int)result->ai_addrlen);
-    if (iResult == SOCKET_ERROR) {
-        printf("bind failed with error: %d\n", WSAGetLastError());
-        freeaddrinfo(result);
-        closesocket(m_listenSocket);
+    queueOutput(data.c_str(), data.length());
+}
+
+bool TelnetSession::readLine(FPTR_LineReader reader)
+{
+    std::shared_ptr<TelnetServer> server = m_telnetServer.lock();
+    if (!server || server->session(m_handle) == nullptr)
         return false;
-    }
+    m_lineReader = std::move(reader);
+    return true;
+}
 
-    freeaddrinfo(result);
+TelnetScreen &TelnetSession::screen()
+{
+    if (!m_screen)
+        m_screen.reset(new TelnetScreen());
+    return *m_screen;
+}
 
-    iResult = listen(m_listenSocket, SOMAXCONN);
-    if (iResult == SOCKET_ERROR) {
-        printf("listen failed with error: %d\n", WSAGetLastError());
-        closesocket(m_listenSocket);
+bool TelnetSession::sendScreen()
+{
+    // A client still working through earlier output skips this frame rather than have the slow
+    // client policy drop part of it. The changes build up in the grid and go with a later frame.
+    if (!m_screen || m_socket == INVALID_SOCKET || m_outQueued.load(std::memory_order_relaxed) > 0)
         return false;
-    }
 
-    m_initialised = true;
+    std::string frame;
+    m_screen->render(frame);
+    if (!frame.empty())
+        sendRaw(std::move(frame));
     return true;
 }
 
-void TelnetServer::acceptConnection()
+void TelnetSession::closeClient()
 {
-    SOCKET ClientSocket = INVALID_SOCKET;
-    ClientSocket = accept(m_listenSocket, NULL, NULL);
-    if (ClientSocket == INVALID_SOCKET) {
-        printf("accept failed with error: %d\n", WSAGetLastError());
-        closesocket(m_listenSocket);
+    if (m_telnetServer.expired())
+        return;     // Already closed when the server went
+
+    if (m_reactor->m_threaded && !m_reactor->onReactorThread())
+    {
+        TelnetReactorCommand cmd;
+        cmd.type = TelnetReactorCommand::Close;
+        cmd.session = shared_from_this();
+        m_reactor->post(std::move(cmd));
         return;
     }
-    else
+
+    closeConnection();
+}
+
+void TelnetSession::closeConnection()
+{
+    int iResult;
+
+    if (m_socket == INVALID_SOCKET)
+        return;
+
+    // Give anything still queued a last chance to go out, ending the compressed stream properly
+    if (m_compressor)
+        endCompression();
+    flushOutput();
+    if (m_socket == INVALID_SOCKET)
+        return;
+
+    // attempt to cleanly shutdown the connection since we're done
+    iResult = shutdown(m_socket, SD_SEND);
+    if (iResult == SOCKET_ERROR) {
+        printf("shutdown failed with error: %d\n", WSAGetLastError());
+    }
+
+    // cleanup. Closing the socket also removes it from the server's epoll set.
+    closeSocket();
+}
+
+void TelnetSession::scheduleFlush()
+{
+    // The first write of a frame puts us on the server's flush list. A session waiting for its
+    // socket to become writable is flushed by the poller instead.
+    if (!m_flushPending && !m_writeBlocked)
     {
-        SP_TelnetSession s = std::make_shared < TelnetSession >(ClientSocket, shared_from_this());
-        m_sessions.push_back(s);
-        s->initialise();        
+        m_flushPending = true;
+        m_reactor->m_pendingFlush.push_back(this);
     }
 }
 
-void TelnetServer::update()
+void TelnetSession::queueOutput(const char * data, size_t length)
 {
-    // See if connection pending on the listening socket
-    fd_set readSet;
-    FD_ZERO(&readSet);
-    FD_SET(m_listenSocket, &readSet);
-    timeval timeout;
-    timeout.tv_sec = 0;  // Zero timeout (poll)
-    timeout.tv_usec = 0;
+    if (m_socket == INVALID_SOCKET || length == 0)
+        return;
 
-    if (select(m_listenSocket, &readSet, NULL, NULL, &timeout) == 1)
+    if (m_outputSuspended)
     {
-        // There is a connection pending, so accept it.
-        acceptConnection();
+        m_skippedBytes += length;
+        TelnetReactorCounters::add(m_reactor->m_counters.bytesDropped, length);
+        return;
     }
 
-    // Update all the telnet Sessions that are currently in flight.
-    for (SP_TelnetSession ts : m_sessions)
+    scheduleFlush();
+
+    // Small writes are coalesced into the last chunk when we own it
+    if (m_outTail == m_outHead || m_outTail == m_plainFrom || m_outChunks[m_outTail - 1].shared || m_outChunks[m_outTail - 1].owned.length() >= OUTPUT_CHUNK_SIZE)
     {
-        ts->update();
+        if (m_outTail == m_outChunks.size())
+            m_outChunks.emplace_back();
+        m_outChunks[m_outTail].owned.clear();   // Chunks are recycled, so this keeps their capacity
+        m_outChunks[m_outTail].shared.reset();
+        m_outChunks[m_outTail].sent = 0;
+        m_outTail++;
     }
+    m_outChunks[m_outTail - 1].owned.append(data, length);
+    m_outBytes += length;
+
+    if (m_outBytes > m_reactor->m_outputLimits.highWatermark)
+        enforceOutputLimit();
 }
 
-void TelnetServer::shutdown()
+void TelnetSession::queuePayload(const SP_TelnetPayload &payload)
 {
-    // Attempt to cleanly close every telnet session in flight.
-    for (SP_TelnetSession ts : m_sessions)
+    if (m_socket == INVALID_SOCKET || !payload || payload->empty())
+        return;
+
+    if (m_outputSuspended)
     {
-        ts->closeClient();
+        m_skippedBytes += payload->length();
+        TelnetReactorCounters::add(m_reactor->m_counters.bytesDropped, payload->length());
+        return;
     }
-    m_sessions.clear();
 
-    // No longer need server socket so close it.
-    closesocket(m_listenSocket);
-    m_initialised = false;
-}
\ No newline at end of file
+    scheduleFlush();
+
+    if (m_outTail == m_outChunks.size())
+        m_outChunks.emplace_back();
+    m_outChunks[m_outTail].owned.clear();
+    m_outChunks[m_outTail].shared = payload;
+    m_outChunks[m_outTail].sent = 0;
+    m_outTail++;
+    m_outBytes += payload->length();
+
+    if (m_outBytes > m_reactor->m_outputLimits.highWatermark)
+        enforceOutputLimit();
+}
+
+void TelnetSession::enforceOutputLimit()
+{
+    const TelnetOutputLimits &limits = m_reactor->m_outputLimits;
+    switch (limits.policy)
+    {
+    case TelnetOutputLimits::Disconnect:
+        printf("Client output queue passed %zu bytes, disconnecting.\n", limits.highWatermark);
+        TelnetReactorCounters::add(m_reactor->m_counters.slowDisconnects);
+        closeSocket();
+        break;
+
+    case TelnetOutputLimits::Coalesce:
+        // Keep what is queued, skip everything else until the client catches up
+        m_outputSuspended = true;
+        break;
+
+    case TelnetOutputLimits::DropOldest:
+    {
+        // Drop whole chunks from the front. A partly sent chunk has to be finished, and the newest
+        // chunk holds what was just written. Chunks end on write boundaries, so no escape
+        // sequence is cut in half. Compressed chunks are part of one stream and cannot be dropped.
+        size_t first = std::max(m_outHead + (m_outChunks[m_outHead].sent > 0 ? 1 : 0), m_plainFrom);
+        size_t last = first;
+        size_t dropped = 0;
+        while (last + 1 < m_outTail && m_outBytes - dropped > limits.lowWatermark)
+        {
+            TelnetOutputChunk &chunk = m_outChunks[last++];
+            dropped += chunk.shared ? chunk.shared->length() : chunk.owned.length();
+            chunk.shared.reset();
+        }
+        if (last == first)
+            break;
+
+        // Slide the survivors down. The dropped chunks move past the tail, ready to be recycled.
+        std::rotate(m_outChunks.begin() + first, m_outChunks.begin() + last, m_outChunks.begin() + m_outTail);
+        m_outTail -= last - first;
+        m_outBytes -= dropped;
+        TelnetReactorCounters::add(m_reactor->m_counters.bytesDropped, dropped);
+        break;
+    }
+    }
+}
+
+void TelnetSession::resumeOutput()
+{
+    m_outputSuspended = false;
+    std::string notice = "*** " + std::to_string(m_skippedBytes) + " bytes of output skipped ***";
+    m_skippedBytes = 0;
+
+    bool erased = eraseLine();
+    queueOutput(notice.c_str(), notice.length());
+    queueOutput("\r\n", 2);
+    if (erased)
+        sendPromptAndBuffer();
+}
+
+void TelnetSession::writable()
+{
+    if (flushOutput())
+        return;     // Still more than the socket will take
+
+    if (m_writeBlocked && m_socket != INVALID_SOCKET)
+    {
+        m_writeBlocked = false;
+        m_reactor->watchWritable(this, false);
+    }
+}
+
+void TelnetSession::clearOutput()
+{
+    for (size_t i = m_outHead; i < m_outTail; i++)
+        m_outChunks[i].shared.reset();
+    m_outHead = m_outTail = m_plainFrom = 0;
+    m_outBytes = 0;
+    publishQueued();
+}
+
+bool TelnetSession::flushOutput()
+{
+    // Send everything queued this frame in one gathered write. Returns true if output is still waiting.
+    compressPending(false);
+    while (m_socket != INVALID_SOCKET && m_outHead < m_outTail)
+    {
+#ifdef _WIN32
+        WSABUF iov[MAX_IOV];
+#else
+        struct iovec iov[MAX_IOV];
+#endif
+        int iovCount = 0;
+        for (size_t i = m_outHead; i < m_outTail && iovCount < MAX_IOV; i++, iovCount++)
+        {
+            const TelnetOutputChunk &chunk = m_outChunks[i];
+            const std::string &bytes = chunk.shared ? *chunk.shared : chunk.owned;
+#ifdef _WIN32
+            iov[iovCount].buf = (CHAR *)bytes.data() + chunk.sent;
+            iov[iovCount].len = (ULONG)(bytes.length() - chunk.sent);
+#else
+            iov[iovCount].iov_base = (void *)(bytes.data() + chunk.sent);
+            iov[iovCount].iov_len = bytes.length() - chunk.sent;
+#endif
+        }
+
+#ifdef _WIN32
+        DWORD sentBytes = 0;
+        int iSendResult = WSASend(m_socket, iov, iovCount, &sentBytes, 0, NULL, NULL);
+        if (iSendResult == 0)
+            iSendResult = (int)sentBytes;
+#else
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovCount;
+        int iSendResult = (int)sendmsg(m_socket, &msg, SEND_FLAGS);
+#endif
+        TelnetReactorCounters::add(m_reactor->m_counters.sendCalls);
+        if (iSendResult == SOCKET_ERROR)
+        {
+            int error = WSAGetLastError();
+            if (error == WSAEWOULDBLOCK)
+            {
+                publishQueued();
+                return true;        // Socket buffer is full, try again once it is writable
+            }
+
+            printf("Send failed with Winsock error: %d\n", error);
+            std::cout << "Closing session and socket.\r\n";
+            closeSocket();
+            return false;
+        }
+
+        // Retire the chunks that went out in full; a partly sent chunk remembers where it got to
+        size_t remaining = (size_t)iSendResult;
+        m_outBytes -= remaining;
+        TelnetReactorCounters::add(m_bytesOut, remaining);
+        TelnetReactorCounters::add(m_reactor->m_counters.bytesOut, remaining);
+        while (remaining > 0)
+        {
+            TelnetOutputChunk &chunk = m_outChunks[m_outHead];
+            size_t chunkLeft = (chunk.shared ? chunk.shared->length() : chunk.owned.length()) - chunk.sent;
+            if (remaining < chunkLeft)
+            {
+                chunk.sent += remaining;
+                break;
+            }
+            remaining -= chunkLeft;
+            chunk.shared.reset();
+            m_outHead++;
+        }
+
+        // Once a coalescing session has caught up, tell it what it missed. The notice is sent by
+        // this same loop.
+        if (m_outputSuspended && m_outBytes <= m_reactor->m_outputLimits.lowWatermark)
+        {
+            resumeOutput();
+            compressPending(false);
+        }
+    }
+
+    if (m_outHead == m_outTail)
+        m_outHead = m_outTail = m_plainFrom = 0;
+    publishQueued();
+    return false;
+}
+
+void TelnetSession::negotiateCompression(unsigned char command)
+{
+#ifdef TELNETSERVLIB_MCCP
+    if (command == TELNET_DO && !m_compressor)
+    {
+        if (!m_compressOffered)
+        {
+            // The client asked before we offered. Agree if we are allowed to, otherwise refuse.
+            bool enabled = m_reactor->m_compression.enabled;
+            unsigned char reply[3] = { TELNET_IAC, enabled ? TELNET_WILL : TELNET_WONT, TELNET_COMPRESS2 };
+            queueOutput((char *)reply, 3);
+            if (!enabled)
+                return;
+        }
+        m_compressOffered = false;
+        startCompression();
+    }
+    else if (command == TELNET_DONT)
+    {
+        m_compressOffered = false;
+        if (m_compressor)
+            endCompression();
+    }
+#else
+    (void)command;
+#endif
+}
+
+void TelnetSession::startCompression()
+{
+#ifdef TELNETSERVLIB_MCCP
+    const TelnetCompressionOptions &options = m_reactor->m_compression;
+    std::unique_ptr<TelnetCompressor> compressor(new TelnetCompressor());
+    if (deflateInit2(&compressor->stream, options.level, Z_DEFLATED, 15, options.memLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        printf("Could not start output compression: %s\n", compressor->stream.msg ? compressor->stream.msg : "bad level or memLevel");
+        unsigned char wontCompress[3] = { TELNET_IAC, TELNET_WONT, TELNET_COMPRESS2 };
+        queueOutput((char *)wontCompress, 3);
+        return;
+    }
+    compressor->ready = true;
+    compressor->level = options.level;
+
+    // Everything queued up to and including the start marker goes out as it is. The client needs
+    // the marker even if the Coalesce policy is skipping output.
+    static const char begin[] = { (char)TELNET_IAC, (char)TELNET_SB, (char)TELNET_COMPRESS2, (char)TELNET_IAC, (char)TELNET_SE };
+    bool suspended = m_outputSuspended;
+    m_outputSuspended = false;
+    queueOutput(begin, sizeof(begin));
+    m_outputSuspended = suspended;
+    if (m_socket == INVALID_SOCKET)
+        return;     // Closed by the Disconnect policy
+
+    m_compressor = std::move(compressor);
+    m_plainFrom = m_outTail;
+#endif
+}
+
+void TelnetSession::endCompression()
+{
+    compressPending(true);
+    scheduleFlush();
+    m_compressor.reset();
+    m_plainFrom = 0;
+}
+
+void TelnetSession::compressPending(bool finish)
+{
+#ifdef TELNETSERVLIB_MCCP
+    if (!m_compressor || (m_plainFrom == m_outTail && !finish))
+        return;
+
+    TelnetCompressor &compressor = *m_compressor;
+    size_t plainBytes = 0;
+    for (size_t i = m_plainFrom; i < m_outTail; i++)
+        plainBytes += m_outChunks[i].shared ? m_outChunks[i].shared->length() : m_outChunks[i].owned.length();
+
+    // A keystroke echo gains nothing from match searching and its latency matters, so small
+    // flushes go out as stored blocks. MCCP2 has no way to send plain bytes mid-stream, so this
+    // is as close to bypassing the compressor as the protocol allows.
+    std::string &out = compressor.scratch;
+    out.clear();
+    int level = plainBytes < m_reactor->m_compression.bypassBytes ? 0 : m_reactor->m_compression.level;
+    if (level != compressor.level)
+    {
+        // The last flush emptied the stream, so this only writes a block boundary, if anything
+        out.resize(64);
+        compressor.stream.next_in = nullptr;
+        compressor.stream.avail_in = 0;
+        compressor.stream.next_out = (Bytef *)&out[0];
+        compressor.stream.avail_out = (uInt)out.length();
+        deflateParams(&compressor.stream, level, Z_DEFAULT_STRATEGY);
+        out.resize(out.length() - compressor.stream.avail_out);
+        compressor.level = level;
+    }
+
+    for (size_t i = m_plainFrom; i < m_outTail; i++)
+    {
+        TelnetOutputChunk &chunk = m_outChunks[i];
+        const std::string &bytes = chunk.shared ? *chunk.shared : chunk.owned;
+        deflateInto(compressor.stream, out, bytes.data(), bytes.length(), Z_NO_FLUSH);
+        chunk.shared.reset();
+    }
+    deflateInto(compressor.stream, out, nullptr, 0, finish ? Z_FINISH : Z_SYNC_FLUSH);
+
+    // The compressed bytes replace the first plain chunk and the others go back for reuse
+    if (m_plainFrom == m_outTail)
+    {
+        if (m_outTail == m_outChunks.size())
+            m_outChunks.emplace_back();
+        m_outTail++;
+    }
+    TelnetOutputChunk &chunk = m_outChunks[m_plainFrom];
+    chunk.owned.swap(out);
+    chunk.shared.reset();
+    chunk.sent = 0;
+    m_outTail = m_plainFrom + 1;
+    m_plainFrom = m_outTail;
+    m_outBytes = m_outBytes - plainBytes + chunk.owned.length();
+    TelnetReactorCounters::add(m_reactor->m_counters.compressIn, plainBytes);
+    TelnetReactorCounters::add(m_reactor->m_counters.compressOut, chunk.owned.length());
+#else
+    (void)finish;
+#endif
+}
+
+void TelnetSession::publishQueued()
+{
+    uint64_t previous = m_outQueued.load(std::memory_order_relaxed);
+    if (previous == m_outBytes)
+        return;
+    m_outQueued.store(m_outBytes, std::memory_order_relaxed);
+    TelnetReactorCounters::add(m_reactor->m_counters.outputQueued, (uint64_t)m_outBytes - previous);   // Wraps round for a decrease
+}
+
+TelnetSessionMetrics TelnetSession::metrics() const
+{
+    TelnetSessionMetrics metrics;
+    metrics.bytesIn = m_bytesIn.load(std::memory_order_relaxed);
+    metrics.bytesOut = m_bytesOut.load(std::memory_order_relaxed);
+    metrics.linesIn = m_linesIn.load(std::memory_order_relaxed);
+    metrics.outputQueued = m_outQueued.load(std::memory_order_relaxed);
+    return metrics;
+}
+
+void TelnetSession::initialise()
+{
+    // get details of connection
+    sockaddr_in client_info = { 0 };
+    socklen_t addrsize = sizeof(client_info);
+    getpeername(m_socket, (struct sockaddr*)&client_info, &addrsize);
+
+    char ip[16];
+    inet_ntop(AF_INET, &client_info.sin_addr, &ip[0], 16);
+
+    std::cout << "Client " << ip << (m_adopted ? " taken over...\n" : " connected...\n");
+
+#ifndef TELNETSERVLIB_ACCEPT4
+    // Set the connection to be non-blocking
+    setNonBlocking(m_socket);
+#endif
+
+    startTimers();
+
+    // The client agreed its options with the process that handed it over
+    if (m_adopted)
+    {
+        m_reactor->sessionConnected(shared_from_this());
+        return;
+    }
+
+    // Set NVT mode to say that I will echo back characters.
+    unsigned char willEcho[3] = { 0xff, 0xfb, 0x01 };
+    queueOutput((char *)willEcho, 3);
+
+    // Set NVT requesting that the remote system not/dont echo back characters
+    unsigned char dontEcho[3] = { 0xff, 0xfe, 0x01 };
+    queueOutput((char *)dontEcho, 3);
+
+    // Set NVT mode to say that I will supress go-ahead. Stops remote clients from doing local linemode.
+    unsigned char willSGA[3] = { 0xff, 0xfb, 0x03 };
+    queueOutput((char *)willSGA, 3);
+
+    // Ask for the window size, so the line editor knows where long lines wrap
+    unsigned char doNaws[3] = { TELNET_IAC, TELNET_DO, TELNET_NAWS };
+    queueOutput((char *)doNaws, 3);
+
+#ifdef TELNETSERVLIB_MCCP
+    // Offer to compress everything we send. Compression starts when the client says DO.
+    if (m_reactor->m_compression.enabled)
+    {
+        unsigned char willCompress[3] = { TELNET_IAC, TELNET_WILL, TELNET_COMPRESS2 };
+        queueOutput((char *)willCompress, 3);
+        m_compressOffered = true;
+    }
+#endif
+
+    m_reactor->sessionConnected(shared_from_this());
+}
+
+void TelnetSession::completeCommand()
+{
+    const TelnetCommandRouter &router = *m_reactor->m_router;
+    keepPendingLine();
+    TelnetCompletion completion = router.complete(m_buffer);
+    if (!completion.append.empty() || completion.complete)
+    {
+        // Completion adds to the end of the line, wherever the cursor was
+        queueCursorMove(lineColumns(m_cursor), lineColumns(m_buffer.length()));
+        m_buffer.append(completion.append.data(), completion.append.length());
+        queueOutput(completion.append.data(), completion.append.length());
+        if (completion.complete)
+        {
+            m_buffer += ' ';
+            queueOutput(" ", 1);
+        }
+        m_cursor = m_buffer.length();
+        textWritten(lineColumns(m_cursor));
+    }
+    else if (completion.candidates > 1)
+    {
+        // List what the word could become, then put the line back
+        router.candidates(m_buffer, m_completions);
+        queueCursorMove(lineColumns(m_cursor), lineColumns(m_buffer.length()));
+        queueOutput("\r\n", 2);
+        for (size_t i = 0; i < m_completions.size(); i++)
+        {
+            if (i > 0)
+                queueOutput("  ", 2);
+            queueOutput(m_completions[i].data(), m_completions[i].length());
+        }
+        queueOutput("\r\n", 2);
+        sendPromptAndBuffer();
+    }
+    else
+    {
+        queueOutput("\a", 1);     // Nothing to complete
+    }
+}
+
+void TelnetSession::addToHistory(std::string_view line)
+{
+    // Add it to the history
+    if (line != (m_history.size() > 0 ? std::string_view(m_history.back()) : std::string_view()) && line != "")
+    {
+        m_history.push(line);
+    }
+    m_historyCursor = m_history.size();
+}
+
+bool TelnetSession::recallHistory(bool older)
+{
+    // Handle up and down arrow actions. Returns true if the input buffer was changed.
+    if (m_history.size() == 0)
+        return false;
+
+    if (older)
+    {
+        if (m_historyCursor > 0)
+        {
+            m_historyCursor--;
+        }
+    }
+    else
+    {
+        if (m_historyCursor + 1 < m_history.size())
+        {
+            m_historyCursor++;
+        }
+    }
+
+    if (m_historyCursor >= m_history.size())
+        return false;
+
+    replaceLine(m_history.at(m_historyCursor));
+    return true;
+}
+
+void TelnetSession::closeSocket()
+{
+    if (m_socket == INVALID_SOCKET)
+        return;
+
+    TelnetReactorCounters::add(m_reactor->m_counters.disconnects);
+    closesocket(m_socket);
+    m_socket = INVALID_SOCKET;
+    clearOutput();
+    m_compressor.reset();
+    m_reactor->m_wheel.cancel(m_timer);
+    dropSubscriptions();
+    m_reactor->m_server->m_admission.release();
+    m_reactor->sessionClosed(this);
+}
+
+void TelnetSession::startTimers()
+{
+    m_connectedAt = m_reactor->m_pollTime;
+    m_lastInput = m_connectedAt;
+    m_lastKeepalive = m_connectedAt;
+    m_negotiated = m_adopted;
+
+    // The timer is armed for the shortest timeout. Input does not touch it: when it fires it looks
+    // at what has happened since and goes back on the wheel for whatever is due next.
+    const TelnetTimeouts &timeouts = m_reactor->m_timeouts;
+    std::chrono::milliseconds first = std::chrono::milliseconds::max();
+    for (std::chrono::milliseconds timeout : { timeouts.idle, timeouts.keepalive, timeouts.negotiation })
+    {
+        if (timeout.count() > 0 && timeout < first)
+            first = timeout;
+    }
+    if (first != std::chrono::milliseconds::max())
+        m_reactor->armTimer(m_timer, m_connectedAt + first);
+}
+
+void TelnetSession::timerExpired()
+{
+    const TelnetTimeouts &timeouts = m_reactor->m_timeouts;
+    std::chrono::steady_clock::time_point now = m_reactor->m_pollTime;
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::time_point::max();
+
+    if (timeouts.negotiation.count() > 0 && !m_negotiated)
+    {
+        if (now >= m_connectedAt + timeouts.negotiation)
+        {
+            std::cout << "Client did not negotiate. Closing session and socket.\r\n";
+            TelnetReactorCounters::add(m_reactor->m_counters.timeouts);
+            closeSocket();
+            return;
+        }
+        next = std::min(next, m_connectedAt + timeouts.negotiation);
+    }
+
+    if (timeouts.idle.count() > 0)
+    {
+        if (now >= m_lastInput + timeouts.idle)
+        {
+            std::cout << "Client idle. Closing session and socket.\r\n";
+            TelnetReactorCounters::add(m_reactor->m_counters.timeouts);
+            closeConnection();
+            return;
+        }
+        next = std::min(next, m_lastInput + timeouts.idle);
+    }
+
+    if (timeouts.keepalive.count() > 0)
+    {
+        // NOP rather than AYT: clients answer AYT with text, which would land in the input line
+        std::chrono::steady_clock::time_point quietSince = std::max(m_lastInput, m_lastKeepalive);
+        if (now >= quietSince + timeouts.keepalive)
+        {
+            unsigned char nop[2] = { TELNET_IAC, TELNET_NOP };
+            queueOutput((char *)nop, 2);
+            TelnetReactorCounters::add(m_reactor->m_counters.keepalives);
+            m_lastKeepalive = now;
+            quietSince = now;
+        }
+        next = std::min(next, quietSince + timeouts.keepalive);
+    }
+
+    if (next != std::chrono::steady_clock::time_point::max())
+        m_reactor->armTimer(m_timer, next);
+}
+
+void TelnetSession::subscribe(const SP_TelnetTopic &topic, size_t backlog)
+{
+    if (m_telnetServer.expired() || !topic)
+        return;
+
+    if (m_reactor->m_threaded && !m_reactor->onReactorThread())
+    {
+        TelnetReactorCommand cmd;
+        cmd.type = TelnetReactorCommand::Subscribe;
+        cmd.session = shared_from_this();
+        cmd.topic = topic;
+        cmd.count = backlog;
+        m_reactor->post(std::move(cmd));
+        return;
+    }
+
+    if (m_socket == INVALID_SOCKET)
+        return;
+    for (const Subscription &subscription : m_subscriptions)
+    {
+        if (subscription.topic == topic)
+            return;
+    }
+
+    // Counted before the head is read, so a line published meanwhile either falls before the
+    // cursor or finds the count raised and wakes us
+    topic->m_subscribers.fetch_add(1);
+    uint64_t head = topic->m_head.load();
+    backlog = (size_t)std::min<uint64_t>(backlog, std::min<uint64_t>(head, topic->capacity()));
+    m_subscriptions.push_back(Subscription{ topic, head - backlog });
+    if (m_subscriptions.size() == 1)
+        m_reactor->subscriberAdded(this);
+}
+
+void TelnetSession::unsubscribe(const SP_TelnetTopic &topic)
+{
+    if (m_telnetServer.expired() || !topic)
+        return;
+
+    if (m_reactor->m_threaded && !m_reactor->onReactorThread())
+    {
+        TelnetReactorCommand cmd;
+        cmd.type = TelnetReactorCommand::Unsubscribe;
+        cmd.session = shared_from_this();
+        cmd.topic = topic;
+        m_reactor->post(std::move(cmd));
+        return;
+    }
+
+    for (size_t i = 0; i < m_subscriptions.size(); i++)
+    {
+        if (m_subscriptions[i].topic == topic)
+        {
+            topic->m_subscribers.fetch_sub(1);
+            m_subscriptions.erase(m_subscriptions.begin() + i);
+            if (m_subscriptions.empty())
+                m_reactor->subscriberRemoved(this);
+            return;
+        }
+    }
+}
+
+bool TelnetSession::pumpTopics()
+{
+    // Lines are only taken while the output queue is below the low watermark, so a slow client
+    // falls behind in the ring, where it costs nothing, rather than in its queue. A client whose
+    // socket is full waits for the poller to report it writable.
+    if (m_writeBlocked || m_outputSuspended || m_socket == INVALID_SOCKET)
+        return false;
+
+    size_t lowWatermark = m_reactor->m_outputLimits.lowWatermark;
+    std::vector<SP_TelnetPayload> &lines = m_reactor->m_topicLines;
+    bool started = false;
+    bool erased = false;
+    for (size_t i = 0; i < m_subscriptions.size(); i++)
+    {
+        while (m_subscriptions[i].next < m_subscriptions[i].topic->head())
+        {
+            if (m_outBytes >= lowWatermark)
+            {
+                if (erased)
+                    sendPromptAndBuffer();
+                return true;
+            }
+
+            Subscription &subscription = m_subscriptions[i];
+            uint64_t first = subscription.topic->read(subscription.next, TOPIC_BATCH, lines);
+            if (!started)
+            {
+                // The lines go above the prompt, which is put back once at the end
+                started = true;
+                erased = eraseLine();
+            }
+            if (first > subscription.next)
+            {
+                uint64_t dropped = first - subscription.next;
+                TelnetReactorCounters::add(m_reactor->m_counters.topicDropped, dropped);
+                TelnetFormatBuffer notice;
+                notice.append("*** ");
+                notice.append(dropped);
+                notice.append(" lines of ");
+                notice.append(subscription.topic->name());
+                notice.append(" dropped ***\r\n");
+                queueOutput(notice.view().data(), notice.view().length());
+            }
+
+            // As many as fit under the watermark, and always at least one
+            size_t count = 0;
+            size_t bytes = m_outBytes;
+            while (count < lines.size() && (count == 0 || bytes < lowWatermark))
+                bytes += lines[count++]->length();
+            subscription.next = first + count;
+            for (size_t j = 0; j < count; j++)
+                queuePayload(lines[j]);
+            lines.clear();
+
+            if (m_socket == INVALID_SOCKET)
+                return false;   // Closed by the slow client policy, which also dropped the subscriptions
+        }
+    }
+
+    if (erased)
+        sendPromptAndBuffer();
+    return false;
+}
+
+void TelnetSession::dropSubscriptions()
+{
+    if (m_subscriptions.empty())
+        return;
+
+    for (Subscription &subscription : m_subscriptions)
+        subscription.topic->m_subscribers.fetch_sub(1);
+    m_subscriptions.clear();
+    m_reactor->subscriberRemoved(this);
+}
+
+bool TelnetSession::update(size_t maxLines)
+{
+    if (m_socket == INVALID_SOCKET)
+        return false;
+
+    // Events left from the last turn are finished before anything more is read
+    if (m_eventCursor == m_inputEvents.size() && !receive())
+        return false;
+
+    processInputEvents(maxLines);
+    if (m_socket == INVALID_SOCKET)
+        return false;   // A callback closed the session
+    if (m_eventCursor < m_inputEvents.size())
+        return true;    // Hit the line limit. The rest stays in the input buffer until our next turn
+
+    // Data events point into the input buffer, so it is only refilled once they have all been handled
+    m_inputEvents.clear();
+    m_eventCursor = 0;
+    return false;
+}
+
+bool TelnetSession::receive()
+{
+    // Read straight into the input buffer. Only called once every event from the last read has
+    // been handled, so the whole buffer is free and what the parser sees is one contiguous run.
+    int readBytes = (int)recv(m_socket, m_input.data(), (int)m_input.size(), 0);
+    TelnetReactorCounters::add(m_reactor->m_counters.recvCalls);
+
+    // Check for errors from the read
+    if (readBytes == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        if (error == WSAEWOULDBLOCK)
+            return false;
+
+        std::cout << "Receive failed with Winsock error code: " << error << "\r\n";
+        std::cout << "Closing session and socket.\r\n";
+        closeSocket();
+        return false;
+    }
+
+    if (readBytes == 0)
+    {
+        // The client has closed its end of the connection
+        std::cout << "Client disconnected. Closing session and socket.\r\n";
+        closeSocket();
+        return false;
+    }
+
+    m_lastInput = m_reactor->m_pollTime;
+    TelnetReactorCounters::add(m_bytesIn, readBytes);
+    TelnetReactorCounters::add(m_reactor->m_counters.bytesIn, readBytes);
+
+    // Every received byte goes through the parser exactly once. Sequences split across reads
+    // are carried over in the parser's state.
+    m_inputEvents.clear();
+    m_eventCursor = 0;
+    m_parser.parse(m_input.data(), readBytes, m_inputEvents);
+    return true;
+}
+
+void TelnetSession::keepPendingLine()
+{
+    // The zero-copy start of the line is about to be edited or the input buffer refilled, so copy it
+    if (!m_lineView.empty())
+    {
+        m_buffer.assign(m_lineView.data(), m_lineView.length());
+        m_lineView = std::string_view();
+    }
+}
+
+void TelnetSession::processInputEvents(size_t maxLines)
+{
+    bool interactive = m_reactor->interactivePrompt();
+    size_t lines = 0;
+
+    while (m_eventCursor < m_inputEvents.size() && lines < maxLines)
+    {
+        const TelnetInputEvent &ev = m_inputEvents[m_eventCursor++];
+        switch (ev.type)
+        {
+        case TelnetInputEvent::Tab:
+            if (m_reactor->m_router)
+            {
+                completeCommand();
+                break;
+            }
+            [[fallthrough]];    // Without a router a tab is part of the line
+
+        case TelnetInputEvent::Data:
+            if (m_lineView.empty() && m_cursor < m_buffer.length())
+            {
+                // Typed into the middle of the line: insert it and rewrite the rest of the line
+                size_t from = m_cursor;
+                m_buffer.insert(m_cursor, ev.data, ev.length);
+                m_cursor += ev.length;
+                redrawTail(from, 0);
+                break;
+            }
+
+            // Echo it back to the sender (an escaped 0xFF has to go back escaped) and add it to the line
+            if (ev.length == 1 && (unsigned char)ev.data[0] == TELNET_IAC)
+                queueOutput("\xff\xff", 2);
+            else
+                queueOutput(ev.data, ev.length);
+
+            // A line that arrives in one piece is handed to the callback straight from the input buffer
+            if (m_buffer.empty() && m_lineView.empty())
+            {
+                m_lineView = std::string_view(ev.data, ev.length);
+            }
+            else
+            {
+                keepPendingLine();
+                m_buffer.append(ev.data, ev.length);
+            }
+            m_cursor += ev.length;
+            if (m_reactor->m_promptString.length() + m_cursor >= m_columns)
+                textWritten(lineColumns(m_cursor));
+            break;
+
+        case TelnetInputEvent::Erase:
+        case TelnetInputEvent::Delete:
+        case TelnetInputEvent::CursorLeft:
+        case TelnetInputEvent::CursorRight:
+        case TelnetInputEvent::Home:
+        case TelnetInputEvent::End:
+            keepPendingLine();
+            editLine(ev);
+            break;
+
+        case TelnetInputEvent::CursorUp:
+        case TelnetInputEvent::CursorDown:
+            // Read up and down arrow keys and scroll through history
+            keepPendingLine();
+            if (interactive)
+                recallHistory(ev.type == TelnetInputEvent::CursorUp);
+            break;
+
+        case TelnetInputEvent::EndOfLine:
+        {
+            // The line ends where the client sees it end, even if the cursor was moved back into it
+            if (m_cursor < m_buffer.length())
+                queueCursorMove(lineColumns(m_cursor), lineColumns(m_buffer.length()));
+            queueOutput("\r\n", 2);
+
+            // Take the line out of the buffer first so the callback sees an empty prompt. Swapping
+            // keeps the capacity of both strings, so there is no allocation per line.
+            std::string_view line = m_lineView;
+            m_lineView = std::string_view();
+            if (line.empty() && !m_buffer.empty())
+            {
+                m_dispatchBuffer.swap(m_buffer);
+                m_buffer.clear();
+                line = m_dispatchBuffer;
+            }
+            m_cursor = 0;
+
+            TelnetReactorCounters::add(m_linesIn);
+            TelnetReactorCounters::add(m_reactor->m_counters.linesIn);
+            m_reactor->lineReceived(shared_from_this(), line);
+
+            if (interactive)
+                addToHistory(line);
+            lines++;
+            break;
+        }
+
+        case TelnetInputEvent::Negotiation:
+            m_negotiated = true;
+            if (ev.option == TELNET_COMPRESS2)
+                negotiateCompression(ev.command);
+            break;
+
+        case TelnetInputEvent::Subnegotiation:
+            m_negotiated = true;
+            if (ev.option == TELNET_NAWS && ev.length >= 4)
+            {
+                // Width then height, 16 bits each. A width of 0 means the client does not know
+                uint16_t width = (uint16_t)(((unsigned char)ev.data[0] << 8) | (unsigned char)ev.data[1]);
+                if (width > 0)
+                    m_columns = width;
+            }
+            break;
+
+        default:
+            // Telnet commands are not acted on yet
+            break;
+        }
+
+        if (m_socket == INVALID_SOCKET)
+            return;     // A callback closed the session
+    }
+
+    keepPendingLine();
+}
+
+// UNIT_TEST's checks, which unlike assert() still run in Release builds
+#define UNIT_CHECK(condition) do { if (!(condition)) { printf("UNIT_TEST failed at line %d: %s\n", __LINE__, #condition); fflush(stdout); abort(); } } while (0)
+
+void TelnetSession::UNIT_TEST()
+{
+    // Feed chunks through a parser and apply the events the way a session would
+    auto parseChunks = [](const std::vector<std::string> &chunks, std::string &buffer) -> std::vector<std::string>
+    {
+        TelnetInputParser parser;
+        std::vector<TelnetInputEvent> events;
+        std::vector<std::string> lines;
+        for (const std::string &chunk : chunks)
+        {
+            events.clear();
+            parser.parse(chunk.data(), chunk.length(), events);
+            for (const TelnetInputEvent &ev : events)
+            {
+                if (ev.type == TelnetInputEvent::Data)
+                    buffer.append(ev.data, ev.length);
+                else if (ev.type == TelnetInputEvent::Erase)
+                    buffer.resize(previousCharacter(buffer, buffer.length()));
+                else if (ev.type == TelnetInputEvent::EndOfLine)
+                {
+                    lines.push_back(buffer);
+                    buffer.clear();
+                }
+            }
+        }
+        return lines;
+    };
+
+    /* Telnet commands are stripped from the data */
+    std::cout << "TEST: parser NVT stripping\n";
+    std::string origData = "12345";
+    std::string data = origData;
+    unsigned char toStrip[3] = { 255, 251, 1 };
+    data.insert(2, (char *)toStrip, 3);
+    std::string nvtResult;
+    parseChunks({ data }, nvtResult);
+
+    UNIT_CHECK(origData == nvtResult);
+
+    /* Backspace and DEL erase the character before them */
+    std::cout << "TEST: parser erase\n";
+    std::string bkData;
+    parseChunks({ "123455\x7f" }, bkData);
+    UNIT_CHECK(bkData == "12345");
+    bkData.clear();
+    parseChunks({ "1234\b\b345" }, bkData);
+    UNIT_CHECK(bkData == "12345");
+
+    /* CR LF ends a line */
+    std::cout << "TEST: parser line completion\n";
+    std::string multiData;
+    auto lines = parseChunks({ "LINE1\r\nLINE2\r\nLINE3\r\n" }, multiData);
+
+    UNIT_CHECK(lines.size() == 3);
+    UNIT_CHECK(lines[0] == "LINE1");
+    UNIT_CHECK(lines[1] == "LINE2");
+    UNIT_CHECK(lines[2] == "LINE3");
+    UNIT_CHECK(multiData.empty());
+
+    /* Sequences split across reads */
+    std::cout << "TEST: split sequences\n";
+    std::string splitData;
+    lines = parseChunks({ "ab\xff", "\xfb", "\x01" "cd\x1b", "[", "Aef\r", "\ngh\r", std::string("\0", 1), "ij\n" }, splitData);
+    UNIT_CHECK(lines.size() == 3);
+    UNIT_CHECK(lines[0] == "abcdef");
+    UNIT_CHECK(lines[1] == "gh");
+    UNIT_CHECK(lines[2] == "ij");
+
+    /* Subnegotiation and escaped IAC */
+    std::cout << "TEST: subnegotiation\n";
+    TelnetInputParser parser;
+    parser.validateUtf8(false);
+    std::vector<TelnetInputEvent> events;
+    std::string sb("x\xff\xfa\x1f\x00\x50\xff\xff\x00\x18\xff\xf0y\xff\xff", 15);
+    parser.parse(sb.data(), sb.length(), events);
+    UNIT_CHECK(events.size() == 4);
+    UNIT_CHECK(events[0].type == TelnetInputEvent::Data && std::string(events[0].data, events[0].length) == "x");
+    UNIT_CHECK(events[1].type == TelnetInputEvent::Subnegotiation && events[1].option == 0x1f);
+    UNIT_CHECK(std::string(events[1].data, events[1].length) == std::string("\x00\x50\xff\x00\x18", 5));
+    UNIT_CHECK(events[2].type == TelnetInputEvent::Data && std::string(events[2].data, events[2].length) == "y");
+    UNIT_CHECK(events[3].type == TelnetInputEvent::Data && std::string(events[3].data, events[3].length) == "\xff");
+    events.clear();
+    parser.parse("\xff\xfa\x18" "abc\xff\xf0\xff\xfa\x18" "de\xff\xf0", 15, events);     // Two in one read
+    UNIT_CHECK(events.size() == 2 && std::string(events[0].data, events[0].length) == "abc" && std::string(events[1].data, events[1].length) == "de");
+
+    /* UTF-8 validation */
+    std::cout << "TEST: utf8\n";
+    std::string utf8Data;
+    lines = parseChunks({ "caf\xc3", "\xa9 \xe2\x82", "\xac\r\n" }, utf8Data);
+    UNIT_CHECK(lines.size() == 1 && lines[0] == "caf\xc3\xa9 \xe2\x82\xac");
+    lines = parseChunks({ "a\xc0\xaf" "b\xed\xa0\x80" "c\xe2\x82\r\n" }, utf8Data);     // Overlong, surrogate, truncated
+    UNIT_CHECK(lines.size() == 1);
+    UNIT_CHECK(lines[0] == "a\xef\xbf\xbd\xef\xbf\xbd" "b\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd" "c\xef\xbf\xbd");
+    lines = parseChunks({ "c\xe2", "\x82\r\n" }, utf8Data);      // Truncated the same way across two reads
+    UNIT_CHECK(lines.size() == 1 && lines[0] == "c\xef\xbf\xbd");
+    parseChunks({ "x\xc3\xa9\x7f" }, utf8Data);
+    UNIT_CHECK(utf8Data == "x");
+
+    /* History ring */
+    std::cout << "TEST: historyRing\n";
+    TelnetHistoryRing history(3);
+    history.push("one");
+    history.push("two");
+    UNIT_CHECK(history.size() == 2 && history.at(0) == "one" && history.back() == "two");
+    history.push("three");
+    history.push("four");
+    UNIT_CHECK(history.size() == 3 && history.capacity() == 3);
+    UNIT_CHECK(history.at(0) == "two" && history.at(1) == "three" && history.back() == "four");
+    TelnetHistoryRing noHistory(0);
+    noHistory.push("lost");
+    UNIT_CHECK(noHistory.size() == 0);
+
+    /* Histogram */
+    std::cout << "TEST: histogram\n";
+    for (uint64_t value : { (uint64_t)0, (uint64_t)15, (uint64_t)16, (uint64_t)17, (uint64_t)1000, (uint64_t)123456789, UINT64_MAX })
+    {
+        int index = TelnetHistogram::bucketIndex(value);
+        UNIT_CHECK(index >= 0 && index < TelnetHistogram::BUCKET_COUNT);
+        UNIT_CHECK(TelnetHistogram::bucketLowest(index) <= value && value <= TelnetHistogram::bucketHighest(index));
+    }
+    TelnetHistogram histogram;
+    for (uint64_t value = 1; value <= 1000; value++)
+        histogram.record(value * 1000);
+    TelnetHistogramSnapshot latency = histogram.snapshot();
+    UNIT_CHECK(latency.count == 1000 && latency.max == 1000000 && latency.mean() == 500500.0);
+    UNIT_CHECK(latency.percentile(0.5) >= 500000 && latency.percentile(0.5) <= 500000 * 17 / 16);
+    UNIT_CHECK(latency.percentile(1.0) == 1000000 && latency.percentile(0.0) >= 1000);
+
+    /* Slab pool */
+    std::cout << "TEST: slabPool\n";
+    TelnetSlabPool pool(24, 2);
+    void * blockA = pool.allocate();
+    void * blockB = pool.allocate();
+    void * blockC = pool.allocate();    // Second slab
+    UNIT_CHECK(blockA != blockB && blockB != blockC && pool.blockSize() % alignof(std::max_align_t) == 0);
+    pool.deallocate(blockB);
+    void * reused = pool.allocate();
+    UNIT_CHECK(reused == blockB);
+    pool.deallocate(blockA);
+    pool.deallocate(blockB);
+    pool.deallocate(blockC);
+
+    std::cout << "TEST: slotMap\n";
+    TelnetSlotMap<int> slots;
+    TelnetSlotHandle one = slots.insert(1);
+    TelnetSlotHandle two = slots.insert(2);
+    TelnetSlotHandle three = slots.insert(3);
+    UNIT_CHECK(slots.erase(one) && slots.size() == 2 && slots[0] == 3 && slots.denseIndex(three) == 0);    // The last value fills the gap
+    UNIT_CHECK(slots.find(one) == nullptr && !slots.erase(one) && *slots.find(two) == 2);
+    TelnetSlotHandle four = slots.insert(4);
+    UNIT_CHECK(four.index == one.index && four != one && slots.find(one) == nullptr && *slots.find(four) == 4);   // Slot reused, old handle stays dead
+    slots.clear();
+    UNIT_CHECK(slots.empty() && slots.find(two) == nullptr && slots.find(four) == nullptr);
+
+    std::cout << "TEST: admission\n";
+    TelnetAdmission admission;
+    TelnetAdmissionLimits admissionLimits;
+    admissionLimits.maxSessions = 3;
+    admissionLimits.connectRate = 1;
+    admissionLimits.connectBurst = 2;
+    admission.limits(admissionLimits);
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    bool first = admission.admit(1, t0);
+    bool second = admission.admit(1, t0);
+    bool third = admission.admit(1, t0);
+    UNIT_CHECK(first && second && !third);                  // Burst of two, then the rate applies
+    bool refilled = admission.admit(1, t0 + std::chrono::seconds(1));
+    bool full = admission.admit(2, t0 + std::chrono::seconds(1));
+    UNIT_CHECK(refilled && !full);                          // Three sessions open
+    admission.release();
+    bool other = admission.admit(2, t0 + std::chrono::seconds(1));
+    UNIT_CHECK(other);
+    for (uint32_t address = 10; address < 3000; address++)
+    {
+        admission.admit(address, t0 + std::chrono::seconds(address));   // Each one idle long enough to refill before the next
+        admission.release();
+    }
+    UNIT_CHECK(admission.trackedAddresses() < 3000);        // Idle addresses have been pruned
+
+    /* Replay each render through a minimal terminal and check it ends up showing the grid */
+    std::cout << "TEST: screen\n";
+    struct Terminal
+    {
+        Terminal(int w, int h) : width(w), height(h), x(0), y(0), cells((size_t)w * h) {}
+
+        void apply(const std::string &bytes)
+        {
+            for (size_t i = 0; i < bytes.length(); )
+            {
+                unsigned char c = (unsigned char)bytes[i];
+                if (c == 0x1b)
+                {
+                    std::vector<unsigned> params(1, 0);
+                    for (i += 2; bytes[i] == ';' || (bytes[i] >= '0' && bytes[i] <= '9'); i++)
+                    {
+                        if (bytes[i] == ';')
+                            params.push_back(0);
+                        else
+                            params.back() = params.back() * 10 + (bytes[i] - '0');
+                    }
+                    char final = bytes[i++];
+                    if (final == 'H')
+                    {
+                        y = std::max(1u, params[0]) - 1;
+                        x = params.size() > 1 ? std::max(1u, params[1]) - 1 : 0;
+                    }
+                    else if (final == 'C')
+                        x = std::min(width - 1, x + (int)std::max(1u, params[0]));
+                    else if (final == 'J')
+                        std::fill(cells.begin(), cells.end(), TelnetCell());
+                    else if (final == 'm')
+                    {
+                        for (unsigned p : params)
+                        {
+                            if (p == 0)
+                                style = TelnetCell();
+                            else if (p >= 30 && p <= 39)
+                                style.fg = (uint8_t)(p - 30);
+                            else if (p >= 40 && p <= 49)
+                                style.bg = (uint8_t)(p - 40);
+                            static const unsigned on[] = { 1, 3, 4, 7, 9 }, off[] = { 22, 23, 24, 27, 29 };
+                            for (int bit = 0; bit < 5; bit++)
+                            {
+                                if (p == on[bit])
+                                    style.attrs |= (uint16_t)(1 << bit);
+                                else if (p == off[bit])
+                                    style.attrs &= (uint16_t)~(1 << bit);
+                            }
+                        }
+                    }
+                }
+                else if (c == '\r')
+                    x = 0, i++;
+                else if (c == '\n')
+                    y++, i++;
+                else
+                {
+                    size_t invalidLength;
+                    int length = c < 0x80 ? 1 : utf8SequenceLength(&bytes[i], bytes.data() + bytes.length(), invalidLength);
+                    UNIT_CHECK(length > 0);
+                    char32_t ch = length == 1 ? c : c & (0xff >> (length + 1));
+                    for (int k = 1; k < length; k++)
+                        ch = (ch << 6) | ((unsigned char)bytes[i + k] & 0x3f);
+                    i += length;
+                    UNIT_CHECK(x < width && y < height);
+                    cells[(size_t)y * width + x] = TelnetCell(ch, style.fg, style.bg, style.attrs);
+                    x = std::min(width - 1, x + 1);
+                }
+            }
+        }
+
+        int width, height, x, y;
+        TelnetCell style;
+        std::vector<TelnetCell> cells;
+    };
+
+    TelnetScreen screen(20, 6);
+    Terminal terminal(20, 6);
+    std::string frame;
+    screen.print(2, 1, "Load: 0.42 \xc3\xa9t\xc3\xa9", TelnetCell::Green, TelnetCell::Default, TelnetCell::Bold);
+    screen.render(frame);
+    terminal.apply(frame);
+    frame.clear();
+    screen.render(frame);
+    UNIT_CHECK(frame.empty());                              // Nothing changed, nothing sent
+    screen.print(8, 1, "7");
+    screen.render(frame);
+    UNIT_CHECK(frame.length() < 16);                        // One cell: a cursor move, a style and a character
+    terminal.apply(frame);
+    unsigned seed = 12345;
+    auto random = [&seed](unsigned range) { seed = seed * 1103515245 + 12345; return (seed >> 16) % range; };
+    for (int round = 0; round < 300; round++)
+    {
+        for (unsigned changes = random(12); changes > 0; changes--)
+        {
+            static const char32_t glyphs[] = { ' ', 'a', 'b', '#', 0xe9, 0x2588 };
+            screen.set((uint16_t)random(20), (uint16_t)random(6), TelnetCell(glyphs[random(6)], (uint8_t)(random(3) == 0 ? (unsigned)TelnetCell::Default : random(8)),
+                (uint8_t)(random(3) == 0 ? (unsigned)TelnetCell::Default : random(8)), (uint16_t)random(32)));
+        }
+        if (round % 50 == 0)
+            screen.print(0, (uint16_t)random(6), "a row of text that is clipped", TelnetCell::Cyan);
+        terminal.apply("\x1b[4;4H\x1b[1;35m");         // Other output in between moves the cursor and changes the style
+        frame.clear();
+        screen.render(frame);
+        terminal.apply(frame);
+        for (uint16_t y = 0; y < 6; y++)
+            for (uint16_t x = 0; x < 20; x++)
+                UNIT_CHECK(terminal.cells[(size_t)y * 20 + x] == screen.at(x, y));
+    }
+
+    std::cout << "TEST: commandRouter\n";
+    static int routed[3] = { 0, 0, 0 };
+    static constexpr TelnetCommand table[] =
+    {
+        { "status", [](SP_TelnetSession, const TelnetArgs &) { routed[0]++; }, "Show status" },
+        { "set",    [](SP_TelnetSession, const TelnetArgs &) { routed[1]++; }, "Set a value" },
+        { "setup",  [](SP_TelnetSession, const TelnetArgs &) { routed[2]++; }, "Run setup" },
+    };
+    TelnetCommandRouter router;
+    router.add(table);
+    std::string said;
+    UNIT_CHECK(router.add("Say", [&said](SP_TelnetSession, const TelnetArgs &args) { said = std::string(args.rest(1)); }));
+    UNIT_CHECK(!router.add("STATUS", [](SP_TelnetSession, const TelnetArgs &) {}) && router.size() == 4);
+
+    size_t command = 0;
+    UNIT_CHECK(router.resolve("stat", command) == TelnetCommandRouter::Found && router.name(command) == "status");
+    UNIT_CHECK(router.resolve("se", command) == TelnetCommandRouter::Ambiguous);
+    UNIT_CHECK(router.resolve("SET", command) == TelnetCommandRouter::Found && router.name(command) == "set");      // A whole name beats a longer one
+    UNIT_CHECK(router.resolve("setu", command) == TelnetCommandRouter::Found && router.name(command) == "setup");
+    UNIT_CHECK(router.resolve("sets", command) == TelnetCommandRouter::Unknown);
+
+    TelnetArgs args("  say  \"two words\" three  ");
+    UNIT_CHECK(args.size() == 3 && args[1] == "two words" && args[2] == "three" && args[3].empty());
+    UNIT_CHECK(args.rest(1) == "\"two words\" three");
+    std::string many;
+    for (int i = 0; i < 40; i++)
+        many += "w" + std::to_string(i) + " ";
+    TelnetArgs capped(many);
+    UNIT_CHECK(capped.size() == TelnetArgs::MAX_ARGS && capped[TelnetArgs::MAX_ARGS - 1].substr(0, 7) == "w31 w32" && capped[TelnetArgs::MAX_ARGS - 1].back() == '9');
+
+    TelnetCommandRouter::Match missed = TelnetCommandRouter::Found;
+    router.fallback([&missed](SP_TelnetSession, const TelnetArgs &, TelnetCommandRouter::Match match) { missed = match; });
+    UNIT_CHECK(router.dispatch(nullptr, "st") && routed[0] == 1);
+    UNIT_CHECK(router.dispatch(nullptr, "SAY hello   there ") && said == "hello   there");
+    UNIT_CHECK(!router.dispatch(nullptr, "se 1") && missed == TelnetCommandRouter::Ambiguous && routed[1] == 0);
+
+    TelnetCompletion completion = router.complete("st");
+    UNIT_CHECK(completion.append == "atus" && completion.complete && completion.candidates == 1);
+    completion = router.complete("  se");
+    UNIT_CHECK(completion.append == "t" && !completion.complete && completion.candidates == 2);
+    completion = router.complete("s");
+    UNIT_CHECK(completion.append.empty() && completion.candidates == 4);
+    completion = router.complete("set x");
+    UNIT_CHECK(completion.candidates == 0);
+    std::vector<std::string_view> names;
+    router.candidates("SE", names);
+    UNIT_CHECK(names.size() == 2 && names[0] == "set" && names[1] == "setup");
+
+    std::cout << "TEST: formatBuffer\n";
+    {
+        TelnetFormatBuffer format;
+        format.append(ANSI_FG_RED);
+        format.append("HP ");
+        format.append(-12);
+        format.append('/');
+        format.append(40u);
+        format.append(' ');
+        format.append(1.5);
+        UNIT_CHECK(format.view() == "\x1b[31mHP -12/40 1.5" && format.styled());
+        auto formatInto = [](TelnetFormatBuffer &buffer, const char *format, ...)
+        {
+            va_list args;
+            va_start(args, format);
+            buffer.vprintf(format, args);
+            va_end(args);
+        };
+        TelnetFormatBuffer printed;
+        printed.append("x=");
+        formatInto(printed, "%d %s", 7, "seven");
+        UNIT_CHECK(printed.view() == "x=7 seven" && !printed.styled());
+        std::string wide(600, 'w');
+        formatInto(printed, "[%s]", wide.c_str());
+        UNIT_CHECK(printed.view() == "x=7 seven[" + wide + "]");
+    }
+    {
+        // Spills to the heap once, keeping what was already there
+        TelnetFormatBuffer format;
+        std::string expected;
+        for (int i = 0; i < 200; i++)
+        {
+            format.append(i);
+            format.append(',');
+            expected += std::to_string(i) + ",";
+        }
+        UNIT_CHECK(expected.length() > TelnetFormatBuffer::INLINE_CAPACITY && format.view() == expected);
+    }
+
+    std::cout << "TEST: lineColumns\n";
+    UNIT_CHECK(countColumns("py> ") == 4);
+    UNIT_CHECK(countColumns("\x1b[32mpy\x1b[0m> ") == 4);        // Colours take no room
+    UNIT_CHECK(countColumns("caf\xc3\xa9 \xe2\x82\xac") == 6);  // One column per UTF-8 character
+    {
+        std::string text = "a\xc3\xa9\xe2\x82\xac" "b";
+        UNIT_CHECK(nextCharacter(text, 0) == 1 && nextCharacter(text, 1) == 3 && nextCharacter(text, 3) == 6 && nextCharacter(text, 7) == 7);
+        UNIT_CHECK(previousCharacter(text, 7) == 6 && previousCharacter(text, 6) == 3 && previousCharacter(text, 3) == 1 && previousCharacter(text, 0) == 0);
+    }
+
+    std::cout << "TEST: timerWheel\n";
+    {
+        TelnetTimerWheel wheel;
+        TelnetTimerNode soon, cascaded, far, cancelled, past;
+        std::vector<TelnetTimerNode *> fired;
+        auto collect = [&fired](TelnetTimerNode * node) { fired.push_back(node); };
+        wheel.arm(soon, 5);
+        wheel.arm(cascaded, 100);       // Level 1
+        wheel.arm(far, 70000);          // Level 2
+        wheel.arm(cancelled, 20);
+        wheel.cancel(cancelled);
+        UNIT_CHECK(wheel.size() == 3 && !cancelled.armed());
+        UNIT_CHECK(wheel.advance(4, collect) == 0);
+        UNIT_CHECK(wheel.advance(5, collect) == 1 && fired.back() == &soon && !soon.armed());
+        UNIT_CHECK(wheel.advance(99, collect) == 0);
+        UNIT_CHECK(wheel.advance(100, collect) == 1 && fired.back() == &cascaded);
+        wheel.arm(far, 200);            // Moved
+        wheel.arm(past, 50);            // Already passed: the next tick
+        UNIT_CHECK(wheel.advance(101, collect) == 1 && fired.back() == &past);
+        UNIT_CHECK(wheel.advance(199, collect) == 0);
+        UNIT_CHECK(wheel.advance(200, collect) == 1 && fired.back() == &far);
+        UNIT_CHECK(wheel.empty() && fired.size() == 4);
+
+        // A callback can re-arm the timer it was given
+        wheel.arm(soon, 70000);
+        size_t rearmed = 0;
+        auto again = [&](TelnetTimerNode * node) { if (++rearmed < 3) wheel.arm(*node, wheel.now() + 4096); };
+        UNIT_CHECK(wheel.advance(69999, again) == 0);
+        UNIT_CHECK(wheel.advance(70000 + 2 * 4096, again) == 3 && wheel.empty());
+
+        // An empty wheel jumps straight to the tick, and delays past the top level are brought in
+        wheel.advance(1000000, collect);
+        UNIT_CHECK(wheel.now() == 1000000);
+        wheel.arm(far, wheel.now() + TelnetTimerWheel::MAX_DELAY + 1000);
+        UNIT_CHECK(far.due == 1000000 + TelnetTimerWheel::MAX_DELAY);
+        wheel.cancel(far);
+        UNIT_CHECK(wheel.empty());
+    }
+
+    std::cout << "TEST: topic\n";
+    {
+        TelnetTopic topic("log", 4);
+        std::vector<SP_TelnetPayload> lines;
+        for (int i = 0; i < 3; i++)
+            topic.publish(TelnetServer::encodeLine("line " + std::to_string(i)));
+        UNIT_CHECK(topic.read(0, TOPIC_BATCH, lines) == 0 && topic.head() == 3 && lines.size() == 3 && *lines[2] == "line 2\r\n");
+        lines.clear();
+        for (int i = 3; i < 6; i++)
+            topic.publish(TelnetServer::encodeLine("line " + std::to_string(i)));
+        UNIT_CHECK(topic.read(0, TOPIC_BATCH, lines) == 2 && lines.size() == 4 && *lines[0] == "line 2\r\n" && *lines[3] == "line 5\r\n");    // 0 and 1 overwritten
+        lines.clear();
+        UNIT_CHECK(topic.read(3, 2, lines) == 3 && lines.size() == 2 && *lines[1] == "line 4\r\n");
+        lines.clear();
+        UNIT_CHECK(topic.read(6, TOPIC_BATCH, lines) == 6 && lines.empty());
+        UNIT_CHECK(TelnetTopic("empty", 0).capacity() == 1);
+    }
+
+    /* Vector scan agrees with the byte at a time scan at every offset */
+    std::cout << "TEST: scanPrintable\n";
+    std::string printable(100, 'a');
+    for (size_t i = 0; i < printable.length(); i++)
+    {
+        for (unsigned char stop : { 0x00, 0x1b, 0x7f, 0x80, 0xff })
+        {
+            std::string probe = printable;
+            probe[i] = (char)stop;
+            UNIT_CHECK(s_scanPrintable(probe.data(), probe.length()) == i);
+            UNIT_CHECK(scanPrintableScalar(probe.data(), probe.length()) == i);
+        }
+    }
+    UNIT_CHECK(s_scanPrintable(printable.data(), printable.length()) == printable.length());
+}
+
+/* ------------------ Format Buffer -------------------*/
+
+void TelnetFormatBuffer::append(std::string_view text)
+{
+    if (m_overflow.empty() && m_length + text.length() <= m_inline.size())
+    {
+        memcpy(m_inline.data() + m_length, text.data(), text.length());
+        m_length += text.length();
+        return;
+    }
+
+    if (m_overflow.empty())
+        m_overflow.assign(m_inline.data(), m_length);
+    m_overflow.append(text.data(), text.length());
+}
+
+void TelnetFormatBuffer::append(double value)
+{
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), "%g", value);
+    if (length > 0)
+        append(std::string_view(digits, std::min((size_t)length, sizeof(digits) - 1)));
+}
+
+void TelnetFormatBuffer::vprintf(const char *format, va_list args)
+{
+    // Straight into the space left inline, and only if that is too small into a string
+    va_list retry;
+    va_copy(retry, args);
+    size_t space = m_overflow.empty() ? m_inline.size() - m_length : 0;
+    int length = vsnprintf(space ? m_inline.data() + m_length : nullptr, space, format, args);
+    if (length < 0)
+    {
+        va_end(retry);
+        return;
+    }
+
+    if ((size_t)length < space)
+    {
+        m_length += length;
+    }
+    else
+    {
+        if (m_overflow.empty())
+            m_overflow.assign(m_inline.data(), m_length);
+        size_t start = m_overflow.length();
+        m_overflow.resize(start + length + 1);
+        vsnprintf(&m_overflow[start], length + 1, format, retry);
+        m_overflow.resize(start + length);
+    }
+    va_end(retry);
+}
+
+/* ------------------ Histogram -------------------*/
+static int highestBit(uint64_t value)
+{
+    // Index of the top set bit. value must not be 0.
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#elif defined(__GNUC__)
+    return 63 - __builtin_clzll(value);
+#else
+    int index = 0;
+    while (value >>= 1)
+        index++;
+    return index;
+#endif
+}
+
+TelnetHistogram::TelnetHistogram() : m_count(0), m_sum(0), m_max(0)
+{
+    for (std::atomic<uint64_t> &bucket : m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+int TelnetHistogram::bucketIndex(uint64_t value)
+{
+    // Values below SUB_BUCKETS get a bucket each. Above that each power of two is split into
+    // SUB_BUCKETS linear steps, picked by the bits just under the top one.
+    if (value < (uint64_t)SUB_BUCKETS)
+        return (int)value;
+    int exponent = highestBit(value);
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t TelnetHistogram::bucketLowest(int index)
+{
+    if (index < SUB_BUCKETS)
+        return (uint64_t)index;
+    int shift = index / SUB_BUCKETS - 1;
+    return ((uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS)) << shift;
+}
+
+uint64_t TelnetHistogram::bucketHighest(int index)
+{
+    if (index < SUB_BUCKETS)
+        return (uint64_t)index;
+    int shift = index / SUB_BUCKETS - 1;
+    return bucketLowest(index) + ((uint64_t)1 << shift) - 1;
+}
+
+void TelnetHistogram::record(uint64_t value)
+{
+    m_buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+TelnetHistogramSnapshot TelnetHistogram::snapshot() const
+{
+    // Each field is read on its own, so a snapshot taken while values are being recorded may be
+    // a few records out between fields. Good enough for monitoring.
+    TelnetHistogramSnapshot snapshot;
+    snapshot.buckets.resize(BUCKET_COUNT);
+    for (int i = 0; i < BUCKET_COUNT; i++)
+        snapshot.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    snapshot.count = m_count.load(std::memory_order_relaxed);
+    snapshot.sum = m_sum.load(std::memory_order_relaxed);
+    snapshot.max = m_max.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+uint64_t TelnetHistogramSnapshot::percentile(double p) const
+{
+    uint64_t total = 0;
+    for (uint64_t bucket : buckets)
+        total += bucket;
+    if (total == 0)
+        return 0;
+
+    // The value reported for a bucket is its highest, capped at the largest value seen
+    uint64_t rank = (uint64_t)(std::min(std::max(p, 0.0), 1.0) * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return std::min(TelnetHistogram::bucketHighest((int)i), max);
+    }
+    return max;
+}
+
+/* ------------------ History Ring -------------------*/
+void TelnetHistoryRing::push(std::string_view line)
+{
+    if (m_entries.empty())
+        return;
+
+    if (m_count < m_entries.size())
+    {
+        m_entries[(m_first + m_count) % m_entries.size()].assign(line.data(), line.length());
+        m_count++;
+    }
+    else
+    {
+        // Full: the oldest entry becomes the newest and keeps its capacity
+        m_entries[m_first].assign(line.data(), line.length());
+        m_first = (m_first + 1) % m_entries.size();
+    }
+}
+
+/* ------------------ Slab Pool -------------------*/
+TelnetSlabPool::TelnetSlabPool(size_t blockSize, size_t blocksPerSlab) : m_blocksPerSlab(blocksPerSlab), m_free(nullptr)
+{
+    // Every block must be able to hold the free list link and stay aligned for any type
+    size_t align = alignof(std::max_align_t);
+    m_blockSize = (std::max(blockSize, sizeof(FreeBlock)) + align - 1) / align * align;
+}
+
+TelnetSlabPool::~TelnetSlabPool()
+{
+    for (void * slab : m_slabs)
+        ::operator delete(slab);
+}
+
+void * TelnetSlabPool::allocate()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_free == nullptr)
+    {
+        // Carve a new slab into blocks and thread them onto the free list
+        char * slab = static_cast<char *>(::operator new(m_blockSize * m_blocksPerSlab));
+        m_slabs.push_back(slab);
+        for (size_t i = m_blocksPerSlab; i-- > 0;)
+        {
+            FreeBlock * block = reinterpret_cast<FreeBlock *>(slab + i * m_blockSize);
+            block->next = m_free;
+            m_free = block;
+        }
+    }
+
+    FreeBlock * block = m_free;
+    m_free = block->next;
+    return block;
+}
+
+void TelnetSlabPool::deallocate(void * block)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    FreeBlock * freed = static_cast<FreeBlock *>(block);
+    freed->next = m_free;
+    m_free = freed;
+}
+
+/* ------------------ Admission -------------------*/
+void TelnetAdmission::limits(const TelnetAdmissionLimits &limits)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_limits = limits;
+    m_buckets.clear();
+    m_pruneAt = MIN_PRUNE;
+}
+
+bool TelnetAdmission::admit(uint32_t address, std::chrono::steady_clock::time_point now)
+{
+    // Take the session place first, so reactors admitting at the same moment cannot overshoot
+    if (m_open.fetch_add(1, std::memory_order_relaxed) >= m_limits.maxSessions && m_limits.maxSessions > 0)
+    {
+        release();
+        return false;
+    }
+
+    if (m_limits.connectRate > 0)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_buckets.size() >= m_pruneAt)
+            prune(now);
+
+        // A new address starts with a full bucket
+        auto found = m_buckets.emplace(address, Bucket{ m_limits.connectBurst, now });
+        Bucket &bucket = found.first->second;
+        if (!found.second)
+            refill(bucket, now);
+
+        if (bucket.tokens < 1.0)
+        {
+            release();
+            return false;
+        }
+        bucket.tokens -= 1.0;
+    }
+    return true;
+}
+
+void TelnetAdmission::refill(Bucket &bucket, std::chrono::steady_clock::time_point now) const
+{
+    double seconds = std::chrono::duration<double>(now - bucket.updated).count();
+    bucket.tokens = std::min(m_limits.connectBurst, bucket.tokens + seconds * m_limits.connectRate);
+    bucket.updated = now;
+}
+
+void TelnetAdmission::prune(std::chrono::steady_clock::time_point now)
+{
+    // A full bucket is the same as no bucket, so forget those addresses
+    for (auto it = m_buckets.begin(); it != m_buckets.end();)
+    {
+        refill(it->second, now);
+        if (it->second.tokens >= m_limits.connectBurst)
+            it = m_buckets.erase(it);
+        else
+            ++it;
+    }
+    m_pruneAt = std::max(MIN_PRUNE, m_buckets.size() * 2);
+}
+
+size_t TelnetAdmission::trackedAddresses()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_buckets.size();
+}
+
+/* ------------------ Screen -------------------*/
+static void appendNumber(std::string &out, unsigned n)
+{
+    char digits[10];
+    int count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    while (count > 0)
+        out += digits[--count];
+}
+
+static void appendUtf8(std::string &out, char32_t c)
+{
+    if (c < 0x80)
+        out += (char)c;
+    else if (c < 0x800)
+    {
+        out += (char)(0xc0 | (c >> 6));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000)
+    {
+        out += (char)(0xe0 | (c >> 12));
+        out += (char)(0x80 | ((c >> 6) & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+    else
+    {
+        out += (char)(0xf0 | (c >> 18));
+        out += (char)(0x80 | ((c >> 12) & 0x3f));
+        out += (char)(0x80 | ((c >> 6) & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+}
+
+static const unsigned char SGR_ON[] = { 1, 3, 4, 7, 9 };        // In TelnetCell::Attribute bit order
+static const unsigned char SGR_OFF[] = { 22, 23, 24, 27, 29 };
+
+TelnetScreen::TelnetScreen(uint16_t width, uint16_t height) : m_width(0), m_height(0), m_repaint(true),
+    m_cursorX(-1), m_cursorY(-1), m_styleKnown(false)
+{
+    static_assert(sizeof(TelnetCell) == 8, "TelnetCell rows are compared with memcmp");
+    resize(width, height);
+}
+
+void TelnetScreen::resize(uint16_t width, uint16_t height)
+{
+    m_width = width;
+    m_height = height;
+    m_cells.assign((size_t)width * height, TelnetCell());
+    m_sent.assign((size_t)width * height, TelnetCell());
+    m_repaint = true;
+}
+
+void TelnetScreen::clear(const TelnetCell &blank)
+{
+    std::fill(m_cells.begin(), m_cells.end(), blank);
+}
+
+void TelnetScreen::set(uint16_t x, uint16_t y, const TelnetCell &cell)
+{
+    if (x < m_width && y < m_height)
+        m_cells[(size_t)y * m_width + x] = cell;
+}
+
+uint16_t TelnetScreen::print(uint16_t x, uint16_t y, std::string_view text, uint8_t fg, uint8_t bg, uint16_t attrs)
+{
+    if (y >= m_height)
+        return x;
+
+    const char * p = text.data();
+    const char * end = p + text.length();
+    while (p < end && x < m_width)
+    {
+        char32_t c = (unsigned char)*p;
+        if (c < 0x80)
+        {
+            p++;
+            if (c < 0x20 || c == 0x7f)
+                c = ' ';        // A control character would move the client's cursor
+        }
+        else
+        {
+            size_t invalidLength = 1;
+            int length = utf8SequenceLength(p, end, invalidLength);
+            if (length > 0)
+            {
+                c = (unsigned char)p[0] & (0xff >> (length + 1));
+                for (int i = 1; i < length; i++)
+                    c = (c << 6) | ((unsigned char)p[i] & 0x3f);
+                p += length;
+            }
+            else
+            {
+                c = 0xfffd;
+                p += length < 0 ? (size_t)(end - p) : invalidLength;
+            }
+        }
+        m_cells[(size_t)y * m_width + x++] = TelnetCell(c, fg, bg, attrs);
+    }
+    return x;
+}
+
+void TelnetScreen::render(std::string &out)
+{
+    // Anything sent to the session since the last render may have moved the cursor or changed
+    // the style, so neither is trusted from one render to the next
+    m_cursorX = m_cursorY = -1;
+    m_styleKnown = false;
+
+    if (m_repaint)
+    {
+        out += "\x1b[0m\x1b[2J";
+        m_style = TelnetCell();
+        m_styleKnown = true;
+        std::fill(m_sent.begin(), m_sent.end(), TelnetCell());
+        m_repaint = false;
+    }
+
+    for (uint16_t y = 0; y < m_height; y++)
+    {
+        const TelnetCell * row = &m_cells[(size_t)y * m_width];
+        TelnetCell * sent = &m_sent[(size_t)y * m_width];
+        if (memcmp(row, sent, m_width * sizeof(TelnetCell)) == 0)
+            continue;
+
+        for (uint16_t x = 0; x < m_width; x++)
+        {
+            if (row[x] == sent[x])
+                continue;
+
+            moveTo(out, x, y);
+            applyStyle(out, row[x]);
+            appendUtf8(out, row[x].ch);
+            sent[x] = row[x];
+
+            // Terminals differ over where the cursor sits after the last column, so forget it
+            m_cursorX = x + 1 < m_width ? x + 1 : -1;
+            m_cursorY = m_cursorX >= 0 ? y : -1;
+        }
+    }
+
+    // Leave the client drawing in the default style, ready for ordinary output
+    if (m_styleKnown && !m_style.sameStyle(TelnetCell()))
+    {
+        out += "\x1b[0m";
+        m_style = TelnetCell();
+    }
+}
+
+void TelnetScreen::moveTo(std::string &out, uint16_t x, uint16_t y)
+{
+    if (m_cursorY == y && m_cursorX == x)
+        return;
+
+    if (m_cursorY == y && m_cursorX >= 0 && x > m_cursorX)
+    {
+        // Along the same row: step over the gap, or redraw it if that is shorter. The cells in
+        // the gap are unchanged, so redrawing them only works in the style already set.
+        size_t gap = x - m_cursorX;
+        size_t stepLength = gap > 1 ? (gap > 9 ? 5 : 4) : 3;
+        const TelnetCell * row = &m_cells[(size_t)y * m_width];
+        bool redraw = gap < stepLength && m_styleKnown;
+        for (int i = m_cursorX; redraw && i < x; i++)
+            redraw = row[i].sameStyle(m_style) && row[i].ch >= 0x20 && row[i].ch < 0x7f;
+        if (redraw)
+        {
+            for (int i = m_cursorX; i < x; i++)
+                out += (char)row[i].ch;
+        }
+        else
+        {
+            out += "\x1b[";
+            if (gap > 1)
+                appendNumber(out, (unsigned)gap);
+            out += 'C';
+        }
+    }
+    else if (x == 0 && m_cursorY >= 0 && (y == m_cursorY || y == m_cursorY + 1))
+    {
+        out += y == m_cursorY ? "\r" : "\r\n";
+    }
+    else
+    {
+        out += "\x1b[";
+        appendNumber(out, y + 1u);
+        if (x > 0)
+        {
+            out += ';';
+            appendNumber(out, x + 1u);
+        }
+        out += 'H';
+    }
+    m_cursorX = x;
+    m_cursorY = y;
+}
+
+void TelnetScreen::applyStyle(std::string &out, const TelnetCell &cell)
+{
+    if (m_styleKnown && cell.sameStyle(m_style))
+        return;
+
+    // Build both a change from the current style and a reset followed by the whole style, and
+    // send whichever is shorter
+    std::string change;
+    if (m_styleKnown)
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            uint16_t bit = (uint16_t)(1 << i);
+            if ((m_style.attrs & bit) != (cell.attrs & bit))
+            {
+                change += ';';
+                appendNumber(change, (cell.attrs & bit) ? SGR_ON[i] : SGR_OFF[i]);
+            }
+        }
+        if (m_style.fg != cell.fg)
+        {
+            change += ';';
+            appendNumber(change, 30u + cell.fg);
+        }
+        if (m_style.bg != cell.bg)
+        {
+            change += ';';
+            appendNumber(change, 40u + cell.bg);
+        }
+    }
+
+    std::string reset = ";0";
+    for (int i = 0; i < 5; i++)
+    {
+        if (cell.attrs & (1 << i))
+        {
+            reset += ';';
+            appendNumber(reset, SGR_ON[i]);
+        }
+    }
+    if (cell.fg != TelnetCell::Default)
+    {
+        reset += ';';
+        appendNumber(reset, 30u + cell.fg);
+    }
+    if (cell.bg != TelnetCell::Default)
+    {
+        reset += ';';
+        appendNumber(reset, 40u + cell.bg);
+    }
+
+    const std::string &params = m_styleKnown && change.length() <= reset.length() ? change : reset;
+    out += "\x1b[";
+    out.append(params, 1, std::string::npos);   // Drop the leading separator
+    out += 'm';
+    m_style = cell;
+    m_styleKnown = true;
+}
+
+/* ------------------ Command Router -------------------*/
+void TelnetArgs::parse(std::string_view line)
+{
+    m_line = line;
+    m_count = 0;
+    size_t i = 0;
+    while (m_count < MAX_ARGS)
+    {
+        while (i < line.length() && (line[i] == ' ' || line[i] == '\t'))
+            i++;
+        if (i == line.length())
+            break;
+
+        size_t start = i;
+        if (m_count == MAX_ARGS - 1)
+        {
+            // The last slot takes whatever is left
+            m_args[m_count++] = line.substr(start, line.find_last_not_of(" \t") + 1 - start);
+            break;
+        }
+
+        if (line[i] == '"')
+        {
+            size_t close = line.find('"', i + 1);
+            size_t end = close == std::string_view::npos ? line.length() : close;
+            m_args[m_count++] = line.substr(i + 1, end - i - 1);
+            i = close == std::string_view::npos ? end : close + 1;
+        }
+        else
+        {
+            while (i < line.length() && line[i] != ' ' && line[i] != '\t')
+                i++;
+            m_args[m_count++] = line.substr(start, i - start);
+        }
+    }
+}
+
+std::string_view TelnetArgs::rest(size_t i) const
+{
+    if (i >= m_count)
+        return std::string_view();
+
+    const char * start = m_args[i].data();
+    if (start > m_line.data() && start[-1] == '"')
+        start--;    // Keep the opening quote of a quoted word
+    size_t offset = start - m_line.data();
+    return m_line.substr(offset, m_line.find_last_not_of(" \t") + 1 - offset);
+}
+
+static char lowerAscii(char c)
+{
+    return c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+}
+
+TelnetCommandRouter::TelnetCommandRouter()
+{
+    m_nodes.emplace_back('\0');
+}
+
+bool TelnetCommandRouter::add(std::string_view name, FPTR_CommandHandler handler, std::string_view help)
+{
+    if (name.empty() || !handler || name.find_first_of(" \t\"") != std::string_view::npos)
+        return false;
+
+    // Walk down, adding the nodes that are missing in order of their character
+    std::vector<uint32_t> path(1, 0);
+    uint32_t node = 0;
+    for (char c : name)
+    {
+        char lower = lowerAscii(c);
+        uint32_t previous = NONE;
+        uint32_t child = m_nodes[node].firstChild;
+        while (child != NONE && m_nodes[child].c < lower)
+        {
+            previous = child;
+            child = m_nodes[child].nextSibling;
+        }
+        if (child == NONE || m_nodes[child].c != lower)
+        {
+            uint32_t added = (uint32_t)m_nodes.size();
+            m_nodes.emplace_back(lower);
+            m_nodes[added].nextSibling = child;
+            if (previous == NONE)
+                m_nodes[node].firstChild = added;
+            else
+                m_nodes[previous].nextSibling = added;
+            child = added;
+        }
+        node = child;
+        path.push_back(node);
+    }
+    if (m_nodes[node].command != NONE)
+        return false;
+
+    uint32_t command = (uint32_t)m_commands.size();
+    m_commands.push_back(Entry{ std::string(name), handler, std::string(help) });
+    m_nodes[node].command = command;
+    for (uint32_t step : path)
+    {
+        m_nodes[step].count++;
+        if (m_nodes[step].anyCommand == NONE)
+            m_nodes[step].anyCommand = command;
+    }
+    return true;
+}
+
+uint32_t TelnetCommandRouter::find(std::string_view prefix) const
+{
+    uint32_t node = 0;
+    for (char c : prefix)
+    {
+        char lower = lowerAscii(c);
+        uint32_t child = m_nodes[node].firstChild;
+        while (child != NONE && m_nodes[child].c < lower)
+            child = m_nodes[child].nextSibling;
+        if (child == NONE || m_nodes[child].c != lower)
+            return NONE;
+        node = child;
+    }
+    return node;
+}
+
+TelnetCommandRouter::Match TelnetCommandRouter::resolve(std::string_view word, size_t &command) const
+{
+    uint32_t node = word.empty() ? NONE : find(word);
+    if (node == NONE)
+        return Unknown;
+
+    // A whole name wins over the longer names it is a prefix of
+    if (m_nodes[node].command != NONE)
+        command = m_nodes[node].command;
+    else if (m_nodes[node].count == 1)
+        command = m_nodes[node].anyCommand;
+    else
+        return Ambiguous;
+    return Found;
+}
+
+bool TelnetCommandRouter::dispatch(const SP_TelnetSession &session, std::string_view line) const
+{
+    TelnetArgs args(line);
+    if (args.empty())
+        return false;
+
+    size_t command = 0;
+    Match match = resolve(args[0], command);
+    if (match == Found)
+    {
+        m_commands[command].handler(session, args);
+        return true;
+    }
+
+    if (m_fallback)
+        m_fallback(session, args, match);
+    else
+        session->sendLine(std::string(match == Ambiguous ? "Ambiguous command: " : "Unknown command: ") + std::string(args[0]));
+    return false;
+}
+
+TelnetCompletion TelnetCommandRouter::complete(std::string_view line) const
+{
+    TelnetCompletion completion;
+    size_t start = line.find_first_not_of(" \t");
+    std::string_view word = start == std::string_view::npos ? std::string_view() : line.substr(start);
+    if (word.find_first_of(" \t") != std::string_view::npos)
+        return completion;      // Already past the command name
+
+    uint32_t node = find(word);
+    if (node == NONE || m_nodes[node].count == 0)
+        return completion;
+
+    // Follow the trie for as long as there is only one way to go
+    size_t length = word.length();
+    while (m_nodes[node].command == NONE && m_nodes[m_nodes[node].firstChild].nextSibling == NONE)
+    {
+        node = m_nodes[node].firstChild;
+        length++;
+    }
+
+    completion.candidates = m_nodes[node].count;
+    completion.complete = m_nodes[node].count == 1;
+    completion.append = std::string_view(m_commands[m_nodes[node].anyCommand].name).substr(word.length(), length - word.length());
+    return completion;
+}
+
+void TelnetCommandRouter::candidates(std::string_view prefix, std::vector<std::string_view> &names) const
+{
+    names.clear();
+    size_t start = prefix.find_first_not_of(" \t");
+    uint32_t node = find(start == std::string_view::npos ? std::string_view() : prefix.substr(start));
+    if (node != NONE)
+        collect(node, names);
+}
+
+void TelnetCommandRouter::collect(uint32_t node, std::vector<std::string_view> &names) const
+{
+    if (m_nodes[node].command != NONE)
+        names.push_back(m_commands[m_nodes[node].command].name);
+    for (uint32_t child = m_nodes[node].firstChild; child != NONE; child = m_nodes[child].nextSibling)
+        collect(child, names);
+}
+
+/* ------------------ Topic -------------------*/
+TelnetTopic::TelnetTopic(const std::string &name, size_t capacity) : m_name(name), m_lines(std::max<size_t>(capacity, 1)), m_head(0), m_subscribers(0)
+{
+}
+
+uint64_t TelnetTopic::read(uint64_t from, size_t max, std::vector<SP_TelnetPayload> &out) const
+{
+    // Only pointers are copied under the lock. The lines are sent once it has been released.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    uint64_t oldest = head > m_lines.size() ? head - m_lines.size() : 0;
+    if (from < oldest)
+        from = oldest;
+    for (uint64_t n = from; n < head && n - from < max; n++)
+        out.push_back(m_lines[n % m_lines.size()]);
+    return from;
+}
+
+void TelnetTopic::publish(const SP_TelnetPayload &line)
+{
+    SP_TelnetPayload overwritten = line;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        m_lines[head % m_lines.size()].swap(overwritten);
+        m_head.store(head + 1);
+    }
+    // The line that fell off the end is freed here, outside the lock
+}
+
+/* ------------------ Timer Wheel -------------------*/
+TelnetTimerWheel::TelnetTimerWheel() : m_now(0), m_count(0)
+{
+    for (int level = 0; level < LEVELS; level++)
+    {
+        for (size_t i = 0; i < SLOTS; i++)
+            m_slots[level][i].prev = m_slots[level][i].next = &m_slots[level][i];
+    }
+}
+
+void TelnetTimerWheel::arm(TelnetTimerNode &node, uint64_t due)
+{
+    cancel(node);
+    if (due <= m_now)
+        due = m_now + 1;
+    if (due - m_now > MAX_DELAY)
+        due = m_now + MAX_DELAY;
+    node.due = due;
+    place(node);
+}
+
+void TelnetTimerWheel::cancel(TelnetTimerNode &node)
+{
+    if (node.armed())
+        unlink(node);
+}
+
+void TelnetTimerWheel::place(TelnetTimerNode &node)
+{
+    // The lowest level whose span reaches the due tick. The slot is picked from the tick itself,
+    // so the wheel reaches it exactly when the timer is due to move down (or, on level 0, expire).
+    uint64_t delta = node.due > m_now ? node.due - m_now : 0;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+        level++;
+    TelnetTimerNode &slot = m_slots[level][(node.due >> (SLOT_BITS * level)) & (SLOTS - 1)];
+
+    node.prev = slot.prev;
+    node.next = &slot;
+    slot.prev->next = &node;
+    slot.prev = &node;
+    m_count++;
+}
+
+void TelnetTimerWheel::unlink(TelnetTimerNode &node)
+{
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = nullptr;
+    node.next = nullptr;
+    m_count--;
+}
+
+void TelnetTimerWheel::cascade()
+{
+    // Each time level 0 comes round to its first slot, the next slot of level 1 holds the timers
+    // for the coming span and is spread over level 0. Level 1 coming round does the same for
+    // level 2, and so on up.
+    for (int level = 1; level < LEVELS; level++)
+    {
+        if ((m_now & (((uint64_t)1 << (SLOT_BITS * level)) - 1)) != 0)
+            break;
+
+        TelnetTimerNode list;
+        take(m_slots[level][(m_now >> (SLOT_BITS * level)) & (SLOTS - 1)], list);
+        while (list.next != &list)
+        {
+            TelnetTimerNode * node = list.next;
+            unlink(*node);
+            place(*node);
+        }
+    }
+}
+
+void TelnetTimerWheel::take(TelnetTimerNode &slot, TelnetTimerNode &list)
+{
+    list.prev = list.next = &list;
+    if (slot.next == &slot)
+        return;
+    list.next = slot.next;
+    list.prev = slot.prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    slot.prev = slot.next = &slot;
+}
+
+/* ------------------ Telnet Input Parser -------------------*/
+static const char IAC_BYTE = (char)TELNET_IAC;
+static const char UTF8_REPLACEMENT[] = "\xef\xbf\xbd";   // U+FFFD
+
+void TelnetInputParser::reset()
+{
+    m_state = Normal;
+    m_utf8Carry.clear();
+    m_subBuffer.clear();
+    m_csiParams.clear();
+}
+
+void TelnetInputParser::emit(std::vector<TelnetInputEvent> &events, TelnetInputEvent::Type type, const char * data, size_t length)
+{
+    TelnetInputEvent ev;
+    ev.type = type;
+    ev.command = m_command;
+    ev.option = m_option;
+    ev.data = data;
+    ev.length = length;
+    events.push_back(ev);
+}
+
+void TelnetInputParser::parse(const char * data, size_t length, std::vector<TelnetInputEvent> &events)
+{
+    const char * end = data + length;
+    const char * p = data;
+    m_subPayloadCount = 0;      // Payloads handed out by the last parse are no longer in use
+
+    while (p < end)
+    {
+        unsigned char c = (unsigned char)*p;
+
+        switch (m_state)
+        {
+        case CarriageReturn:
+            // CR LF and CR NUL are both a single end of line
+            m_state = Normal;
+            if (c == '\n' || c == '\0')
+            {
+                p++;
+                continue;
+            }
+            break;      // Anything else is handled as normal input below
+
+        case Iac:
+            p++;
+            m_command = c;
+            if (c == TELNET_IAC)
+            {
+                // Escaped 0xFF data byte, which can never be part of valid UTF-8
+                m_state = Normal;
+                if (m_validateUtf8)
+                    emit(events, TelnetInputEvent::Data, UTF8_REPLACEMENT, sizeof(UTF8_REPLACEMENT) - 1);
+                else
+                    emit(events, TelnetInputEvent::Data, &IAC_BYTE, 1);
+            }
+            else if (c == TELNET_WILL || c == TELNET_WONT || c == TELNET_DO || c == TELNET_DONT)
+            {
+                m_state = IacOption;
+            }
+            else if (c == TELNET_SB)
+            {
+                m_state = SubOption;
+            }
+            else
+            {
+                m_state = Normal;
+                m_option = 0;
+                if (c == TELNET_EC)
+                    emit(events, TelnetInputEvent::Erase, nullptr, 0);
+                else
+                    emit(events, TelnetInputEvent::Command, nullptr, 0);
+            }
+            continue;
+
+        case IacOption:
+            p++;
+            m_option = c;
+            m_state = Normal;
+            emit(events, TelnetInputEvent::Negotiation, nullptr, 0);
+            continue;
+
+        case Utf8:
+            // Finish a multi-byte character that started at the end of the previous read
+            if (((c & 0xc0) == 0x80) && utf8Continues((unsigned char)m_utf8Carry[0], m_utf8Carry.length(), c))
+            {
+                p++;
+                m_utf8Carry.push_back((char)c);
+                if ((int)m_utf8Carry.length() == m_utf8Expected)
+                {
+                    m_state = Normal;
+                    m_utf8Done = m_utf8Carry;
+                    emit(events, TelnetInputEvent::Data, m_utf8Done.data(), m_utf8Done.length());
+                }
+                continue;
+            }
+            m_state = Normal;
+            emit(events, TelnetInputEvent::Data, UTF8_REPLACEMENT, sizeof(UTF8_REPLACEMENT) - 1);
+            break;      // The byte that broke the sequence is handled normally
+
+        case SubOption:
+            p++;
+            m_option = c;
+            m_subBuffer.clear();
+            m_state = SubData;
+            continue;
+
+        case SubData:
+        {
+            // Copy the run of payload up to the next IAC
+            const char * iac = (const char *)memchr(p, IAC_BYTE, end - p);
+            const char * runEnd = iac ? iac : end;
+            size_t room = MAX_SUBNEGOTIATION - m_subBuffer.length();
+            m_subBuffer.append(p, std::min((size_t)(runEnd - p), room));
+            p = runEnd;
+            if (iac)
+            {
+                p++;
+                m_state = SubIac;
+            }
+            continue;
+        }
+
+        case SubIac:
+            p++;
+            if (c == TELNET_IAC)
+            {
+                if (m_subBuffer.length() < MAX_SUBNEGOTIATION)
+                    m_subBuffer.push_back(IAC_BYTE);
+                m_state = SubData;
+            }
+            else
+            {
+                // IAC SE ends the subnegotiation. Any other command aborts it, as is conventional.
+                m_state = Normal;
+                m_command = TELNET_SB;
+
+                // Move the payload somewhere it stays put until the next parse, as a read can
+                // hold more than one subnegotiation
+                if (m_subPayloadCount == m_subPayloads.size())
+                    m_subPayloads.emplace_back();
+                std::string &payload = m_subPayloads[m_subPayloadCount++];
+                payload.swap(m_subBuffer);
+                emit(events, TelnetInputEvent::Subnegotiation, payload.data(), payload.length());
+            }
+            continue;
+
+        case Escape:
+            if (c == '[')
+            {
+                p++;
+                m_csiParams.clear();
+                m_state = Csi;
+                continue;
+            }
+            if (c == 'O')
+            {
+                p++;
+                m_state = Ss3;
+                continue;
+            }
+            m_state = Normal;   // A lone ESC is dropped and the next byte handled normally
+            break;
+
+        case Csi:
+            if (c == TELNET_IAC)
+            {
+                m_state = Normal;   // Telnet commands take priority over a half received sequence
+                break;
+            }
+            p++;
+            if (c >= 0x40 && c <= 0x7e)
+            {
+                m_state = Normal;
+                emitCsi(events, c);
+            }
+            else if (m_csiParams.length() < MAX_CSI_PARAMS)
+            {
+                m_csiParams.push_back((char)c);
+            }
+            continue;
+
+        case Ss3:
+            if (c == TELNET_IAC)
+            {
+                m_state = Normal;
+                break;
+            }
+            p++;
+            m_state = Normal;
+            m_csiParams.clear();
+            emitCsi(events, c);
+            continue;
+
+        case Normal:
+            break;
+        }
+
+        // Normal state. Hand out runs of plain data as a single event pointing into the input.
+        // Printable ASCII is skipped in vector strides; only the bytes it stops on are looked at here.
+        const char * run = p;
+        bool stashed = false;
+        while (p < end)
+        {
+            p += s_scanPrintable(p, end - p);
+            if (p == end)
+                break;
+
+            unsigned char b = (unsigned char)*p;
+            if (b == TELNET_IAC || b == 0x1b || b == '\r' || b == '\n' || b == '\0' || b == '\b' || b == 0x7f || b == '\t')
+                break;
+
+            if (b < 0x80 || !m_validateUtf8)
+            {
+                p++;    // Other control characters and unchecked 8 bit data stay in the line
+                continue;
+            }
+
+            size_t invalidLength = 0;
+            int sequence = utf8SequenceLength(p, end, invalidLength);
+            if (sequence > 0)
+            {
+                p += sequence;
+            }
+            else if (sequence == 0)
+            {
+                // Invalid sequence: swap the offending bytes for one U+FFFD
+                if (p > run)
+                    emit(events, TelnetInputEvent::Data, run, p - run);
+                emit(events, TelnetInputEvent::Data, UTF8_REPLACEMENT, sizeof(UTF8_REPLACEMENT) - 1);
+                p += invalidLength;
+                run = p;
+            }
+            else
+            {
+                // Valid so far but cut off by the end of the read. Finish it on the next one.
+                if (p > run)
+                    emit(events, TelnetInputEvent::Data, run, p - run);
+                m_utf8Expected = -sequence;
+                m_utf8Carry.assign(p, end - p);
+                m_state = Utf8;
+                run = p = end;
+                stashed = true;
+            }
+        }
+        if (p > run)
+            emit(events, TelnetInputEvent::Data, run, p - run);
+        if (p == end || stashed)
+            break;
+
+        c = (unsigned char)*p++;
+        switch (c)
+        {
+        case TELNET_IAC:
+            m_state = Iac;
+            break;
+        case 0x1b:
+            m_state = Escape;
+            break;
+        case '\r':
+            m_state = CarriageReturn;
+            emit(events, TelnetInputEvent::EndOfLine, nullptr, 0);
+            break;
+        case '\n':
+            emit(events, TelnetInputEvent::EndOfLine, nullptr, 0);
+            break;
+        case '\b':
+        case 0x7f:
+            emit(events, TelnetInputEvent::Erase, nullptr, 0);
+            break;
+        case '\t':
+            emit(events, TelnetInputEvent::Tab, p - 1, 1);
+            break;
+        default:
+            break;      // A bare NUL carries no data
+        }
+    }
+}
+
+void TelnetInputParser::emitCsi(std::vector<TelnetInputEvent> &events, unsigned char final)
+{
+    switch (final)
+    {
+    case 'A': emit(events, TelnetInputEvent::CursorUp, nullptr, 0); break;
+    case 'B': emit(events, TelnetInputEvent::CursorDown, nullptr, 0); break;
+    case 'C': emit(events, TelnetInputEvent::CursorRight, nullptr, 0); break;
+    case 'D': emit(events, TelnetInputEvent::CursorLeft, nullptr, 0); break;
+    case 'H': emit(events, TelnetInputEvent::Home, nullptr, 0); break;
+    case 'F': emit(events, TelnetInputEvent::End, nullptr, 0); break;
+    case '~':
+        // VT220 style keys: ESC [ n ~
+        if (m_csiParams == "1" || m_csiParams == "7")
+            emit(events, TelnetInputEvent::Home, nullptr, 0);
+        else if (m_csiParams == "4" || m_csiParams == "8")
+            emit(events, TelnetInputEvent::End, nullptr, 0);
+        else if (m_csiParams == "3")
+            emit(events, TelnetInputEvent::Delete, nullptr, 0);
+        break;
+    default:
+        break;      // Other sequences are swallowed
+    }
+}
+
+/* ------------------ Telnet Reactor -------------------*/
+static SOCKET createListenSocket(u_long listenPort, bool reusePort)
+{
+    int iResult;
+    SOCKET listenSocket = INVALID_SOCKET;
+
+    struct addrinfo *result = NULL;
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_PASSIVE;
+
+    // Resolve the server address and port
+    iResult = getaddrinfo(NULL, std::to_string(listenPort).c_str(), &hints, &result);
+    if (iResult != 0) {
+        printf("getaddrinfo failed with error: %d\n", iResult);
+        return INVALID_SOCKET;
+    }
+
+    // Create a SOCKET for connecting to server
+    listenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (listenSocket == INVALID_SOCKET) {
+        printf("socket failed with error: %d\n", WSAGetLastError());
+        freeaddrinfo(result);
+        return INVALID_SOCKET;
+    }
+
+#ifdef TELNETSERVLIB_REUSEPORT
+    if (reusePort)
+    {
+        // Every reactor binds its own listener to the port and the kernel spreads connections between them
+        int on = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+#else
+    (void)reusePort;
+#endif
+
+    // Setup the TCP listening socket
+    iResult = bind(listenSocket, result->ai_addr, (int)result->ai_addrlen);
+    if (iResult == SOCKET_ERROR) {
+        printf("bind failed with error: %d\n", WSAGetLastError());
+        freeaddrinfo(result);
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+
+    freeaddrinfo(result);
+
+    iResult = listen(listenSocket, SOMAXCONN);
+    if (iResult == SOCKET_ERROR) {
+        printf("listen failed with error: %d\n", WSAGetLastError());
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+
+    // The poller only reports the listen socket when a connection is pending, but don't let a
+    // client that gives up in the meantime block accept().
+    setNonBlocking(listenSocket);
+    return listenSocket;
+}
+
+TelnetReactor::TelnetReactor(TelnetServer * server, bool threaded, size_t eventQueueCapacity) :
+    m_server(server), m_threaded(threaded), m_listenSocket(INVALID_SOCKET),
+#ifndef _WIN32
+    m_spareFd(-1),
+#endif
+    m_nextReactor(0), m_timerEpoch(std::chrono::steady_clock::now()), m_pollTime(m_timerEpoch),
+    m_router(nullptr), m_sessionLineLimit(SIZE_MAX), m_acceptsPerPoll(1), m_topicsPending(false), m_hasSubscribers(false),
+#ifdef TELNETSERVLIB_EPOLL
+    m_epollFd(-1), m_wakeFd(-1),
+#endif
+    m_hostEvents(threaded ? eventQueueCapacity : 1), m_running(false), m_wakePending(false), m_closedDown(false)
+{
+}
+
+TelnetReactor::~TelnetReactor()
+{
+    close();
+}
+
+bool TelnetReactor::open(SOCKET listenSocket)
+{
+    m_listenSocket = listenSocket;
+
+#ifdef TELNETSERVLIB_EPOLL
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFd == -1) {
+        printf("epoll_create1 failed with error: %d\n", errno);
+        return false;
+    }
+    m_events.resize(MAX_EPOLL_EVENTS);
+
+    if (m_threaded)
+    {
+        // Lets the host thread interrupt epoll_wait when it posts a command
+        m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &m_wakeFd;
+        epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &ev);
+    }
+#else
+    struct pollfd listenFd = { m_listenSocket, POLLIN, 0 };  // INVALID_SOCKET when this reactor does not listen
+    m_pollFds.assign(1, listenFd);
+#endif
+    if (m_listenSocket != INVALID_SOCKET)
+    {
+        watchSocket(m_listenSocket, nullptr);
+#ifndef _WIN32
+        m_spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+#endif
+    }
+    return true;
+}
+
+void TelnetReactor::close()
+{
+    // Only called once the reactor thread (if any) has stopped, which makes the caller the
+    // thread that owns the sessions now.
+    m_threadId = std::this_thread::get_id();
+    m_closedDown = true;
+    for (SP_TelnetSession &ts : m_sessions)
+    {
+        ts->closeConnection();
+    }
+    m_sessions.clear();
+    m_closed.clear();
+    m_pendingFlush.clear();
+    m_ready.clear();
+    m_subscribers.clear();
+    m_hasSubscribers = false;
+
+    TelnetReactorCommand cmd;
+    while (m_commands.pop(cmd))
+    {
+        if (cmd.type == TelnetReactorCommand::Adopt)
+            closesocket(cmd.socket);
+    }
+
+    while (TelnetServerEvent * ev = m_hostEvents.front())
+    {
+        ev->session.reset();
+        m_hostEvents.popFront();
+    }
+    m_eventOverflow.clear();
+
+    if (m_listenSocket != INVALID_SOCKET)
+    {
+        closesocket(m_listenSocket);
+        m_listenSocket = INVALID_SOCKET;
+    }
+#ifndef _WIN32
+    if (m_spareFd != -1)
+        ::close(m_spareFd);
+    m_spareFd = -1;
+#endif
+
+#ifdef TELNETSERVLIB_EPOLL
+    if (m_wakeFd != -1)
+        ::close(m_wakeFd);
+    if (m_epollFd != -1)
+        ::close(m_epollFd);
+    m_wakeFd = m_epollFd = -1;
+#endif
+}
+
+void TelnetReactor::start()
+{
+    m_running = true;
+    m_thread = std::thread(&TelnetReactor::run, this);
+}
+
+void TelnetReactor::stop()
+{
+    if (!m_running)
+        return;
+    m_running = false;
+    wake();
+    m_thread.join();
+}
+
+void TelnetReactor::run()
+{
+    m_threadId = std::this_thread::get_id();
+    while (m_running)
+    {
+        // Block until a socket is ready or the host posts something. Without a wake handle
+        // fall back to a short timeout so commands are still picked up promptly.
+#ifdef TELNETSERVLIB_EPOLL
+        poll(-1);
+#else
+        poll(REACTOR_POLL_MS);
+#endif
+    }
+}
+
+bool TelnetReactor::onReactorThread() const
+{
+    return std::this_thread::get_id() == m_threadId;
+}
+
+void TelnetReactor::post(TelnetReactorCommand &&cmd)
+{
+    // A session the host kept past shutdown() would otherwise sit in the queue, holding the
+    // reactor that holds it
+    if (m_closedDown)
+    {
+        if (cmd.type == TelnetReactorCommand::Adopt)
+            closesocket(cmd.socket);
+        return;
+    }
+    m_commands.push(std::move(cmd));
+    wake();
+}
+
+void TelnetReactor::wake()
+{
+#ifdef TELNETSERVLIB_EPOLL
+    // One wakeup covers any number of commands posted before the reactor gets to them
+    if (m_wakeFd != -1 && !m_wakePending.exchange(true))
+    {
+        uint64_t one = 1;
+        ssize_t written = write(m_wakeFd, &one, sizeof(one));
+        (void)written;
+    }
+#endif
+}
+
+void TelnetReactor::drainCommands()
+{
+#ifdef TELNETSERVLIB_EPOLL
+    if (m_wakeFd != -1)
+    {
+        uint64_t count;
+        ssize_t readBytes = read(m_wakeFd, &count, sizeof(count));
+        (void)readBytes;
+        m_wakePending = false;
+    }
+#endif
+
+    TelnetReactorCommand cmd;
+    while (m_commands.pop(cmd))
+    {
+        switch (cmd.type)
+        {
+        case TelnetReactorCommand::Send:
+            cmd.session->sendLine(std::move(cmd.data));
+            break;
+        case TelnetReactorCommand::SendPayload:
+            cmd.session->sendLine(cmd.payload);
+            break;
+        case TelnetReactorCommand::SendRaw:
+            cmd.session->sendRaw(std::move(cmd.data));
+            break;
+        case TelnetReactorCommand::Close:
+            cmd.session->closeConnection();
+            break;
+        case TelnetReactorCommand::Broadcast:
+            broadcast(cmd.payload);
+            break;
+        case TelnetReactorCommand::Adopt:
+            adoptConnection(cmd.socket);
+            break;
+        case TelnetReactorCommand::Prompt:
+            m_promptString = std::move(cmd.data);
+            break;
+        case TelnetReactorCommand::Subscribe:
+            cmd.session->subscribe(cmd.topic, cmd.count);
+            break;
+        case TelnetReactorCommand::Unsubscribe:
+            cmd.session->unsubscribe(cmd.topic);
+            break;
+        }
+        cmd.session.reset();
+        cmd.payload.reset();
+        cmd.topic.reset();
+    }
+}
+
+void TelnetReactor::watchSocket(SOCKET s, TelnetSession * session)
+{
+#ifdef TELNETSERVLIB_EPOLL
+    // Level triggered, so a session that still has unread data is reported again on the next update
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = session;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, s, &ev) == -1) {
+        printf("epoll_ctl failed with error: %d\n", errno);
+    }
+#else
+    // Entry 0 is the listen socket. Sessions follow in the same order as m_sessions.
+    if (session != nullptr)
+    {
+        struct pollfd sessionFd = { s, POLLIN, 0 };
+        m_pollFds.push_back(sessionFd);
+    }
+#endif
+}
+
+void TelnetReactor::watchWritable(TelnetSession * session, bool watch)
+{
+#ifdef TELNETSERVLIB_EPOLL
+    struct epoll_event ev;
+    ev.events = watch ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = session;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, session->m_socket, &ev) == -1) {
+        printf("epoll_ctl failed with error: %d\n", errno);
+    }
+#else
+    m_pollFds[m_sessions.denseIndex(session->m_slot) + 1].events = watch ? (POLLIN | POLLOUT) : POLLIN;
+#endif
+}
+
+void TelnetReactor::acceptConnection()
+{
+    // Drain the backlog rather than take one connection per poll, so a reconnect storm after a
+    // restart is let in within a frame or two. Connections the admission limits turn away are
+    // closed before a session is built for them.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (size_t accepted = 0; accepted < m_acceptsPerPoll; accepted++)
+    {
+        sockaddr_in address = {};
+        socklen_t addressLength = sizeof(address);
+#ifdef TELNETSERVLIB_ACCEPT4
+        SOCKET clientSocket = accept4(m_listenSocket, (struct sockaddr *)&address, &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        SOCKET clientSocket = accept(m_listenSocket, (struct sockaddr *)&address, &addressLength);
+#endif
+        if (clientSocket == INVALID_SOCKET)
+        {
+            if (acceptFailed(WSAGetLastError()))
+                continue;
+            return;
+        }
+
+        if (!m_server->m_admission.admit(address.sin_addr.s_addr, now))
+        {
+            closesocket(clientSocket);
+            TelnetReactorCounters::add(m_counters.rejects);
+            continue;
+        }
+
+        // Without SO_REUSEPORT, or after a takeover with fewer listeners than I/O threads, the
+        // listening reactors deal connections out to the others
+        std::vector<std::shared_ptr<TelnetReactor>> &reactors = m_server->m_reactors;
+        if (m_server->m_dealConnections)
+        {
+            TelnetReactor * target = reactors[m_nextReactor++ % reactors.size()].get();
+            if (target != this)
+            {
+                TelnetReactorCommand cmd;
+                cmd.type = TelnetReactorCommand::Adopt;
+                cmd.socket = clientSocket;
+                target->post(std::move(cmd));
+                continue;
+            }
+        }
+        adoptConnection(clientSocket);
+    }
+}
+
+bool TelnetReactor::acceptFailed(int error)
+{
+    // None of these close the listener: they are about one connection or a passing shortage,
+    // and the next poll tries again.
+    if (error == WSAEWOULDBLOCK)
+        return false;   // The backlog is empty
+#ifdef _WIN32
+    if (error == WSAECONNRESET || error == WSAEINTR)
+        return true;    // The pending connection went away before we got to it
+#else
+    if (error == EAGAIN)
+        return false;
+    if (error == ECONNABORTED || error == EPROTO || error == EINTR)
+        return true;
+
+    if ((error == EMFILE || error == ENFILE) && m_spareFd != -1)
+    {
+        // Out of descriptors. The listener stays readable, so rather than spin on it, free the
+        // spare, take the connection and close it straight away, then claim the spare back.
+        ::close(m_spareFd);
+        SOCKET clientSocket = accept(m_listenSocket, NULL, NULL);
+        if (clientSocket != INVALID_SOCKET)
+            closesocket(clientSocket);
+        m_spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        TelnetReactorCounters::add(m_counters.rejects);
+        return clientSocket != INVALID_SOCKET;
+    }
+#endif
+
+    TelnetReactorCounters::add(m_counters.acceptErrors);
+    printf("accept failed with error: %d\n", error);
+    return false;
+}
+
+void TelnetReactor::adoptConnection(SOCKET clientSocket)
+{
+    // Sessions and their control blocks come from a pool, so connection churn reuses memory
+    SP_TelnetSession s = std::allocate_shared < TelnetSession >(TelnetPoolAllocator<TelnetSession>(), clientSocket, m_server->shared_from_this(), shared_from_this());
+    s->m_slot = m_sessions.insert(s);
+    TelnetReactorCounters::add(m_counters.accepts);
+    watchSocket(clientSocket, s.get());
+    s->initialise();
+}
+
+size_t TelnetReactor::poll(int timeoutMs, std::chrono::steady_clock::time_point deadline)
+{
+    m_pollTime = std::chrono::steady_clock::now();
+    if (!drainOverflow())
+    {
+        // The host has fallen behind. Stop reading until it catches up, so a flood from one
+        // client backs up in its socket rather than in our memory or the host's frame.
+        drainCommands();
+        flushSessions();
+        reapSessions();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return 0;
+    }
+
+    // Sessions still holding input or topic lines from the last call mean there is work to do already,
+    // as does output queued before the thread started, such as an adopted session's unsent output
+    if (!m_ready.empty() || m_topicsPending || !m_pendingFlush.empty())
+        timeoutMs = 0;
+    // Armed timers need the wheel turned even if nothing else happens
+    if (!m_wheel.empty() && (timeoutMs < 0 || timeoutMs > TIMER_TICK_MS))
+        timeoutMs = TIMER_TICK_MS;
+
+    // Only sessions the OS reports as readable are queued, so an idle server costs one
+    // poll call per frame however many clients are connected.
+#ifdef TELNETSERVLIB_EPOLL
+    int eventCount = epoll_wait(m_epollFd, m_events.data(), (int)m_events.size(), timeoutMs);
+    m_pollTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < eventCount; i++)
+    {
+        void * ptr = m_events[i].data.ptr;
+        if (ptr == nullptr)
+        {
+            // There is a connection pending, so accept it.
+            acceptConnection();
+        }
+        else if (ptr == &m_wakeFd)
+        {
+            drainCommands();
+        }
+        else
+        {
+            TelnetSession * session = static_cast<TelnetSession *>(ptr);
+            if (m_events[i].events & EPOLLOUT)
+                session->writable();
+            if ((m_events[i].events & ~EPOLLOUT) && session->m_socket != INVALID_SOCKET)
+                markReady(session);
+        }
+    }
+#else
+    if (m_threaded)
+        drainCommands();
+
+    // The poll set is kept in step with m_sessions, so a frame does not have to visit every session
+    // to build it. New sessions are appended by acceptConnection, so remember how many it covers.
+    m_pollFds[0].fd = m_listenSocket;
+    size_t sessionCount = m_sessions.size();
+    int readyCount = WSAPoll(m_pollFds.data(), (unsigned long)m_pollFds.size(), timeoutMs);
+    m_pollTime = std::chrono::steady_clock::now();
+    if (readyCount > 0)
+    {
+        for (size_t i = 0; i < sessionCount; i++)
+        {
+            short revents = m_pollFds[i + 1].revents;
+            if (revents & POLLOUT)
+                m_sessions[i]->writable();
+            if ((revents & ~POLLOUT) && m_sessions[i]->m_socket != INVALID_SOCKET)
+                markReady(m_sessions[i].get());
+        }
+
+        if (m_pollFds[0].revents & POLLIN)
+        {
+            // There is a connection pending, so accept it.
+            acceptConnection();
+        }
+    }
+#endif
+
+    size_t serviced = serviceReady(deadline);
+    expireTimers();
+    pumpTopics();
+    flushSessions();
+    reapSessions();
+    return serviced;
+}
+
+void TelnetReactor::armTimer(TelnetTimerNode &node, std::chrono::steady_clock::time_point due)
+{
+    // Rounded up to a whole tick, so a timer never fires before it is due
+    int64_t ms = std::chrono::ceil<std::chrono::milliseconds>(due - m_timerEpoch).count();
+    m_wheel.arm(node, ms > 0 ? (uint64_t)(ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS : 0);
+}
+
+void TelnetReactor::expireTimers()
+{
+    int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(m_pollTime - m_timerEpoch).count();
+    m_wheel.advance((uint64_t)ms / TIMER_TICK_MS, [](TelnetTimerNode * node)
+    {
+        static_cast<TelnetSession *>(node->owner)->timerExpired();
+    });
+}
+
+void TelnetReactor::pumpTopics()
+{
+    m_topicsPending = false;
+    for (size_t i = 0; i < m_subscribers.size();)
+    {
+        TelnetSession * session = m_subscribers[i];
+        if (session->pumpTopics())
+            m_topicsPending = true;
+        if (i < m_subscribers.size() && m_subscribers[i] == session)
+            i++;    // Otherwise it closed, and the last subscriber has been moved into its place
+    }
+}
+
+void TelnetReactor::subscriberAdded(TelnetSession * session)
+{
+    m_subscribers.push_back(session);
+    m_hasSubscribers = true;
+}
+
+void TelnetReactor::subscriberRemoved(TelnetSession * session)
+{
+    auto it = std::find(m_subscribers.begin(), m_subscribers.end(), session);
+    if (it != m_subscribers.end())
+    {
+        *it = m_subscribers.back();
+        m_subscribers.pop_back();
+    }
+    m_hasSubscribers = !m_subscribers.empty();
+}
+
+void TelnetReactor::sessionClosed(TelnetSession * session)
+{
+    m_closed.push_back(session);
+#ifndef TELNETSERVLIB_EPOLL
+    m_pollFds[m_sessions.denseIndex(session->m_slot) + 1].fd = INVALID_SOCKET;  // Ignored by poll until the entry is removed
+#endif
+}
+
+void TelnetReactor::reapSessions()
+{
+    // Closed sessions leave the reactor here, once nothing from this poll can still be holding a
+    // raw pointer to them. One still in the ready queue waits until its turn has come round.
+    size_t kept = 0;
+    for (TelnetSession * ts : m_closed)
+    {
+        if (ts->m_readyQueued)
+        {
+            m_closed[kept++] = ts;
+            continue;
+        }
+
+        SP_TelnetSession session = *m_sessions.find(ts->m_slot);
+#ifndef TELNETSERVLIB_EPOLL
+        // Mirror the slot map, which moves its last entry into the gap
+        m_pollFds[m_sessions.denseIndex(ts->m_slot) + 1] = m_pollFds.back();
+        m_pollFds.pop_back();
+#endif
+        m_sessions.erase(ts->m_slot);
+        sessionDisconnected(session);
+    }
+    m_closed.resize(kept);
+}
+
+void TelnetReactor::markReady(TelnetSession * session)
+{
+    // Level triggered readiness reports a session again each poll until it is drained, so
+    // one already waiting for its turn keeps its place rather than joining twice
+    if (!session->m_readyQueued)
+    {
+        session->m_readyQueued = true;
+        m_ready.push_back(session);
+    }
+}
+
+size_t TelnetReactor::serviceReady(std::chrono::steady_clock::time_point deadline)
+{
+    // One turn each for the sessions queued now, in order. A session with input left over goes
+    // to the back, behind everyone who was waiting. Once the deadline passes the rest keep their
+    // place, so the next call starts with them. The first turn is always taken so a tiny budget
+    // still makes progress.
+    size_t turns = m_ready.size();
+    size_t serviced = 0;
+    bool timed = deadline != std::chrono::steady_clock::time_point::max();
+    while (serviced < turns)
+    {
+        if (timed && serviced > 0 && std::chrono::steady_clock::now() >= deadline)
+            break;
+
+        TelnetSession * session = m_ready.front();
+        m_ready.pop_front();
+        serviced++;
+        if (session->update(m_sessionLineLimit))
+            m_ready.push_back(session);
+        else
+            session->m_readyQueued = false;
+    }
+    return serviced;
+}
+
+void TelnetReactor::broadcast(const SP_TelnetPayload &payload)
+{
+    // Every session queues a reference to the same bytes
+    for (SP_TelnetSession &ts : m_sessions)
+    {
+        if (ts->m_socket != INVALID_SOCKET)
+            ts->sendLine(payload);
+    }
+}
+
+void TelnetReactor::flushSessions()
+{
+    // One send per session that wrote anything since the last flush. Sessions whose socket
+    // buffer is full leave the list and wait for the poller to report them writable, rather
+    // than being retried every update.
+    for (TelnetSession * ts : m_pendingFlush)
+    {
+        bool blocked = ts->flushOutput();
+        ts->m_flushPending = false;     // Cleared afterwards so output queued by the flush cannot touch the list
+        if (blocked && ts->m_socket != INVALID_SOCKET)
+        {
+            ts->m_writeBlocked = true;
+            TelnetReactorCounters::add(m_counters.writeStalls);
+            watchWritable(ts, true);
+        }
+    }
+    m_pendingFlush.clear();
+}
+
+TelnetServerEvent * TelnetReactor::beginEvent()
+{
+    // Events stay in order: once anything has overflowed, everything after it does too
+    if (m_eventOverflow.empty())
+    {
+        TelnetServerEvent * ev = m_hostEvents.beginPush();
+        if (ev != nullptr)
+            return ev;
+    }
+    m_eventOverflow.emplace_back();
+    return &m_eventOverflow.back();
+}
+
+void TelnetReactor::commitEvent()
+{
+    if (m_eventOverflow.empty())
+        m_hostEvents.commitPush();
+}
+
+bool TelnetReactor::drainOverflow()
+{
+    while (!m_eventOverflow.empty())
+    {
+        TelnetServerEvent * ev = m_hostEvents.beginPush();
+        if (ev == nullptr)
+            return false;
+        ev->type = m_eventOverflow.front().type;
+        ev->session = std::move(m_eventOverflow.front().session);
+        ev->line.swap(m_eventOverflow.front().line);
+        m_hostEvents.commitPush();
+        m_eventOverflow.pop_front();
+    }
+    return true;
+}
+
+void TelnetReactor::sessionConnected(const SP_TelnetSession &session)
+{
+    if (!m_threaded)
+    {
+        m_server->sessionConnected(session);
+        return;
+    }
+
+    TelnetServerEvent * ev = beginEvent();
+    ev->type = TelnetServerEvent::Connected;
+    ev->session = session;
+    commitEvent();
+}
+
+void TelnetReactor::sessionDisconnected(const SP_TelnetSession &session)
+{
+    if (!m_threaded)
+    {
+        m_server->sessionDisconnected(session);
+        return;
+    }
+
+    TelnetServerEvent * ev = beginEvent();
+    ev->type = TelnetServerEvent::Disconnected;
+    ev->session = session;
+    commitEvent();
+}
+
+void TelnetReactor::lineReceived(const SP_TelnetSession &session, std::string_view line)
+{
+    if (!m_threaded)
+    {
+        m_server->lineReceived(session, line);
+        return;
+    }
+
+    // The line has to outlive the input buffer, so it is copied into the event. Ring slots keep
+    // their string's capacity, so this only allocates while the ring is still warming up.
+    TelnetServerEvent * ev = beginEvent();
+    ev->type = TelnetServerEvent::Line;
+    ev->session = session;
+    ev->line.assign(line.data(), line.length());
+    commitEvent();
+}
+
+/* ------------------ Telnet Server -------------------*/
+static uint64_t elapsedNanoseconds(std::chrono::steady_clock::time_point start)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool TelnetServer::initialise(u_long listenPort, std::string promptString, unsigned ioThreads)
+{
+    if (m_initialised)
+    {
+        std::cout << "This Telnet Server instance has already been initialised. Please shut it down before reinitialising it.";
+        return false;
+    }
+
+    m_listenPort = listenPort;
+    m_promptString = promptString;
+    m_threaded = ioThreads > 0;
+
+    std::cout << "Starting Telnet Server on port " << std::to_string(m_listenPort) << "\n";
+
+    if (!openReactors(ioThreads, std::vector<SOCKET>()))
+        return false;
+
+    if (m_threaded)
+    {
+        for (auto &reactor : m_reactors)
+            reactor->start();
+    }
+
+    m_initialised = true;
+    return true;
+}
+
+bool TelnetServer::openReactors(unsigned ioThreads, const std::vector<SOCKET> &listeners)
+{
+#ifdef _WIN32
+    // Initialize Winsock
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        printf("WSAStartup failed with error: %d\n", iResult);
+        return false;
+    }
+#endif
+
+    // Inline mode runs a single reactor from update(). Threaded mode gives each I/O thread its own.
+    m_reactors.clear();
+    m_admission.limits(m_admissionLimits);
+    unsigned reactorCount = m_threaded ? ioThreads : 1;
+    unsigned listening = 0;
+    for (unsigned i = 0; i < reactorCount; i++)
+    {
+        // Listeners handed over by the previous process are used as they are. Otherwise every
+        // reactor binds its own where SO_REUSEPORT allows it, and just the first one where not.
+        bool bindListener = listeners.empty() && i == 0;
+#ifdef TELNETSERVLIB_REUSEPORT
+        bindListener = listeners.empty();
+#endif
+        SOCKET listenSocket = i < listeners.size() ? listeners[i] : INVALID_SOCKET;
+        if (bindListener)
+        {
+            listenSocket = createListenSocket(m_listenPort, reactorCount > 1);
+            if (listenSocket == INVALID_SOCKET)
+            {
+                m_reactors.clear();
+                return false;
+            }
+        }
+        if (listenSocket != INVALID_SOCKET)
+            listening++;
+
+        std::shared_ptr<TelnetReactor> reactor = std::make_shared<TelnetReactor>(this, m_threaded, m_eventQueueCapacity);
+        reactor->m_promptString = m_promptString;
+        reactor->m_outputLimits = m_outputLimits;
+        reactor->m_compression = m_compression;
+        reactor->m_timeouts = m_timeouts;
+        reactor->m_router = m_commandRouter.get();
+        reactor->m_sessionLineLimit = m_sessionLineLimit;
+        reactor->m_acceptsPerPoll = m_admissionLimits.acceptsPerPoll > 0 ? m_admissionLimits.acceptsPerPoll : 1;
+        m_reactors.push_back(std::move(reactor));
+        if (!m_reactors.back()->open(listenSocket))
+        {
+            for (size_t j = i + 1; j < listeners.size(); j++)
+                closesocket(listeners[j]);
+            m_reactors.clear();
+            return false;
+        }
+    }
+
+    // A listener with no reactor to watch it would hold connections nobody accepts
+    for (size_t j = reactorCount; j < listeners.size(); j++)
+        closesocket(listeners[j]);
+
+    m_dealConnections = listening < reactorCount;
+    return true;
+}
+
+void TelnetServer::update()
+{
+    update(SIZE_MAX);
+}
+
+size_t TelnetServer::update(size_t maxEvents)
+{
+    if (!m_initialised)
+        return 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t handled = 0;
+    if (m_threaded)
+        handled = drainEvents(maxEvents, std::chrono::steady_clock::time_point::max());
+    else
+        m_reactors[0]->poll(0);
+    runTasks(std::chrono::steady_clock::time_point::max());
+    if (m_threaded)
+        wakeSubscribers();
+    m_updateTime.record(elapsedNanoseconds(start));
+    return handled;
+}
+
+TelnetUpdateReport TelnetServer::update(std::chrono::microseconds budget)
+{
+    TelnetUpdateReport report;
+    if (!m_initialised)
+        return report;
+
+    // The budget covers the socket work and the callbacks. Output is always flushed, since
+    // holding it back would only make the next frame slower.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point deadline = start + budget;
+    if (m_threaded)
+    {
+        report.eventsHandled = drainEvents(SIZE_MAX, deadline);
+        for (auto &reactor : m_reactors)
+            report.eventsDeferred += reactor->m_hostEvents.size();
+    }
+    else
+    {
+        report.sessionsServiced = m_reactors[0]->poll(0, deadline);
+        report.sessionsDeferred = m_reactors[0]->m_ready.size();
+    }
+    report.tasksRun = runTasks(deadline);
+    report.tasksDeferred = m_tasks.size();
+    if (m_threaded)
+        wakeSubscribers();
+
+    uint64_t elapsed = elapsedNanoseconds(start);
+    m_updateTime.record(elapsed);
+    report.budgetExhausted = (report.eventsDeferred > 0 || report.sessionsDeferred > 0 || report.tasksDeferred > 0) &&
+        elapsed >= (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(budget).count();
+    return report;
+}
+
+void TelnetServer::post(FPTR_Task f)
+{
+    m_posted.push(std::move(f));
+}
+
+void TelnetServer::after(std::chrono::milliseconds delay, FPTR_Task f)
+{
+    Timer timer;
+    timer.due = std::chrono::steady_clock::now() + delay;
+    timer.sequence = m_timerSequence++;
+    timer.task = std::move(f);
+    m_timers.push_back(std::move(timer));
+    std::push_heap(m_timers.begin(), m_timers.end());
+}
+
+size_t TelnetServer::runTasks(std::chrono::steady_clock::time_point deadline)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!m_timers.empty() && m_timers.front().due <= now)
+    {
+        std::pop_heap(m_timers.begin(), m_timers.end());
+        m_tasks.push_back(std::move(m_timers.back().task));
+        m_timers.pop_back();
+    }
+    FPTR_Task posted;
+    while (m_posted.pop(posted))
+        m_tasks.push_back(std::move(posted));
+
+    // Only what was due on the way in runs, so a task that posts itself again runs once a frame.
+    // The first one always runs, so a tight budget still makes progress.
+    size_t due = m_tasks.size();
+    size_t ran = 0;
+    while (ran < due && !m_tasks.empty())
+    {
+        if (ran > 0 && deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline)
+            break;
+
+        FPTR_Task task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        task();
+        m_callbackTime.record(elapsedNanoseconds(start));
+        ran++;
+    }
+    return ran;
+}
+
+size_t TelnetServer::drainEvents(size_t maxEvents, std::chrono::steady_clock::time_point deadline)
+{
+    // The I/O threads have done the socket work. Run the callbacks for what they found here,
+    // on the thread that calls update(), taking one event from each thread in turn so a busy
+    // one cannot starve the rest. Whatever is left over waits for the next frame.
+    size_t handled = 0;
+    size_t idle = 0;
+    bool timed = deadline != std::chrono::steady_clock::time_point::max();
+    while (handled < maxEvents && idle < m_reactors.size())
+    {
+        if (timed && handled > 0 && std::chrono::steady_clock::now() >= deadline)
+            break;
+
+        TelnetReactor * reactor = m_reactors[m_nextDrain].get();
+        m_nextDrain = (m_nextDrain + 1) % m_reactors.size();
+
+        TelnetServerEvent * ev = reactor->m_hostEvents.front();
+        if (ev == nullptr)
+        {
+            idle++;
+            continue;
+        }
+        idle = 0;
+
+        if (ev->type == TelnetServerEvent::Connected)
+            sessionConnected(ev->session);
+        else if (ev->type == TelnetServerEvent::Disconnected)
+            sessionDisconnected(ev->session);
+        else
+            lineReceived(ev->session, ev->line);
+        ev->session.reset();
+        reactor->m_hostEvents.popFront();
+        handled++;
+    }
+    return handled;
+}
+
+TelnetServerMetrics TelnetServer::metrics() const
+{
+    TelnetServerMetrics metrics;
+    for (const auto &reactor : m_reactors)
+    {
+        const TelnetReactorCounters &c = reactor->m_counters;
+        metrics.accepts += c.accepts.load(std::memory_order_relaxed);
+        metrics.disconnects += c.disconnects.load(std::memory_order_relaxed);
+        metrics.bytesIn += c.bytesIn.load(std::memory_order_relaxed);
+        metrics.bytesOut += c.bytesOut.load(std::memory_order_relaxed);
+        metrics.recvCalls += c.recvCalls.load(std::memory_order_relaxed);
+        metrics.sendCalls += c.sendCalls.load(std::memory_order_relaxed);
+        metrics.linesIn += c.linesIn.load(std::memory_order_relaxed);
+        metrics.outputQueued += c.outputQueued.load(std::memory_order_relaxed);
+        metrics.bytesDropped += c.bytesDropped.load(std::memory_order_relaxed);
+        metrics.writeStalls += c.writeStalls.load(std::memory_order_relaxed);
+        metrics.slowDisconnects += c.slowDisconnects.load(std::memory_order_relaxed);
+        metrics.rejects += c.rejects.load(std::memory_order_relaxed);
+        metrics.acceptErrors += c.acceptErrors.load(std::memory_order_relaxed);
+        metrics.compressIn += c.compressIn.load(std::memory_order_relaxed);
+        metrics.compressOut += c.compressOut.load(std::memory_order_relaxed);
+        metrics.timeouts += c.timeouts.load(std::memory_order_relaxed);
+        metrics.keepalives += c.keepalives.load(std::memory_order_relaxed);
+        metrics.topicDropped += c.topicDropped.load(std::memory_order_relaxed);
+    }
+    metrics.sessions = metrics.accepts >= metrics.disconnects ? metrics.accepts - metrics.disconnects : 0;
+    metrics.linesDispatched = m_linesDispatched.load(std::memory_order_relaxed);
+    metrics.updateTime = m_updateTime.snapshot();
+    metrics.callbackTime = m_callbackTime.snapshot();
+    return metrics;
+}
+
+bool TelnetServer::compressionSupported()
+{
+#ifdef TELNETSERVLIB_MCCP
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void appendMetric(std::string &text, const char * name, const char * type, const char * help, uint64_t value)
+{
+    text += std::string("# HELP telnetservlib_") + name + " " + help + "\n";
+    text += std::string("# TYPE telnetservlib_") + name + " " + type + "\n";
+    text += std::string("telnetservlib_") + name + " " + std::to_string(value) + "\n";
+}
+
+static void appendHistogram(std::string &text, const char * name, const char * help, const TelnetHistogramSnapshot &h)
+{
+    // Fixed bucket bounds in seconds, filled from the log-linear buckets. A log-linear bucket
+    // is counted under the first bound its highest value fits.
+    static const double bounds[] = { 1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1.0 };
+    text += std::string("# HELP telnetservlib_") + name + " " + help + "\n";
+    text += std::string("# TYPE telnetservlib_") + name + " histogram\n";
+
+    char line[160];
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (double bound : bounds)
+    {
+        uint64_t boundNs = (uint64_t)(bound * 1e9);
+        while (bucket < h.buckets.size() && TelnetHistogram::bucketHighest((int)bucket) <= boundNs)
+            cumulative += h.buckets[bucket++];
+        snprintf(line, sizeof(line), "telnetservlib_%s_bucket{le=\"%g\"} %llu\n", name, bound, (unsigned long long)cumulative);
+        text += line;
+    }
+    snprintf(line, sizeof(line), "telnetservlib_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h.count);
+    text += line;
+    snprintf(line, sizeof(line), "telnetservlib_%s_sum %.9f\n", name, h.sum / 1e9);
+    text += line;
+    snprintf(line, sizeof(line), "telnetservlib_%s_count %llu\n", name, (unsigned long long)h.count);
+    text += line;
+}
+
+std::string TelnetServer::metricsText() const
+{
+    TelnetServerMetrics m = metrics();
+    std::string text;
+    appendMetric(text, "accepts_total", "counter", "Connections accepted.", m.accepts);
+    appendMetric(text, "disconnects_total", "counter", "Sessions closed.", m.disconnects);
+    appendMetric(text, "sessions", "gauge", "Sessions open.", m.sessions);
+    appendMetric(text, "received_bytes_total", "counter", "Bytes read from clients.", m.bytesIn);
+    appendMetric(text, "sent_bytes_total", "counter", "Bytes written to clients.", m.bytesOut);
+    appendMetric(text, "recv_calls_total", "counter", "Socket read calls.", m.recvCalls);
+    appendMetric(text, "send_calls_total", "counter", "Socket write calls.", m.sendCalls);
+    appendMetric(text, "lines_received_total", "counter", "Lines completed by clients.", m.linesIn);
+    appendMetric(text, "lines_dispatched_total", "counter", "Lines handed to the line callback.", m.linesDispatched);
+    appendMetric(text, "output_queued_bytes", "gauge", "Output waiting to be sent.", m.outputQueued);
+    appendMetric(text, "output_dropped_bytes_total", "counter", "Output discarded by the slow client policy.", m.bytesDropped);
+    appendMetric(text, "write_stalls_total", "counter", "Times a client's send buffer filled.", m.writeStalls);
+    appendMetric(text, "slow_disconnects_total", "counter", "Sessions closed by the slow client policy.", m.slowDisconnects);
+    appendMetric(text, "rejected_connections_total", "counter", "Connections turned away by the admission limits.", m.rejects);
+    appendMetric(text, "accept_errors_total", "counter", "Failed accepts.", m.acceptErrors);
+    appendMetric(text, "compression_input_bytes_total", "counter", "Output bytes fed to MCCP2 compression.", m.compressIn);
+    appendMetric(text, "compression_output_bytes_total", "counter", "Compressed bytes produced by MCCP2.", m.compressOut);
+    appendMetric(text, "timeouts_total", "counter", "Sessions closed by the idle or negotiation timeout.", m.timeouts);
+    appendMetric(text, "keepalives_total", "counter", "IAC NOPs sent to quiet clients.", m.keepalives);
+    appendMetric(text, "topic_lines_dropped_total", "counter", "Topic lines subscribers missed by falling a whole ring behind.", m.topicDropped);
+    appendHistogram(text, "update_seconds", "Wall time of TelnetServer::update().", m.updateTime);
+    appendHistogram(text, "callback_seconds", "Time spent in each connected or line callback.", m.callbackTime);
+    return text;
+}
+
+void TelnetServer::sessionConnected(const SP_TelnetSession &session)
+{
+    session->m_handle = m_sessions.insert(session);
+    if (m_connectedCallback)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_connectedCallback(session);
+        m_callbackTime.record(elapsedNanoseconds(start));
+    }
+}
+
+void TelnetServer::sessionDisconnected(const SP_TelnetSession &session)
+{
+    m_sessions.erase(session->m_handle);
+
+    // Anyone waiting for a line from it hears that none is coming
+    if (session->m_lineReader)
+    {
+        FPTR_LineReader reader = std::move(session->m_lineReader);
+        session->m_lineReader = nullptr;
+        reader(std::nullopt);
+    }
+}
+
+SP_TelnetSession TelnetServer::session(TelnetSessionHandle handle) const
+{
+    const SP_TelnetSession * session = m_sessions.find(handle);
+    return session != nullptr ? *session : SP_TelnetSession();
+}
+
+void TelnetServer::lineReceived(const SP_TelnetSession &session, std::string_view line)
+{
+    m_linesDispatched.fetch_add(1, std::memory_order_relaxed);
+    if (!session->m_lineReader && !m_commandRouter && !m_newlineViewCallback && !m_newlineCallback)
+        return;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (session->m_lineReader)
+    {
+        // Taken out first, so the reader can ask for another line
+        FPTR_LineReader reader = std::move(session->m_lineReader);
+        session->m_lineReader = nullptr;
+        reader(line);
+    }
+    else if (m_commandRouter)
+        m_commandRouter->dispatch(session, line);
+    else if (m_newlineViewCallback)
+        m_newlineViewCallback(session, line);
+    else
+        m_newlineCallback(session, std::string(line));
+    m_callbackTime.record(elapsedNanoseconds(start));
+}
+
+void TelnetServer::promptString(std::string prompt)
+{
+    m_promptString = prompt;
+    for (auto &reactor : m_reactors)
+    {
+        if (m_threaded)
+        {
+            TelnetReactorCommand cmd;
+            cmd.type = TelnetReactorCommand::Prompt;
+            cmd.data = prompt;
+            reactor->post(std::move(cmd));
+        }
+        else
+        {
+            reactor->m_promptString = prompt;
+        }
+    }
+}
+
+SP_TelnetPayload TelnetServer::encodeLine(const std::string &line)
+{
+    std::string encoded;
+    encoded.reserve(line.length() + 2);
+    encoded.append(line);
+    encoded.append("\r\n");
+    return std::make_shared<const std::string>(std::move(encoded));
+}
+
+void TelnetServer::broadcast(const std::string &line)
+{
+    broadcast(encodeLine(line));
+}
+
+void TelnetServer::broadcast(const SP_TelnetPayload &payload)
+{
+    for (auto &reactor : m_reactors)
+    {
+        if (m_threaded)
+        {
+            TelnetReactorCommand cmd;
+            cmd.type = TelnetReactorCommand::Broadcast;
+            cmd.payload = payload;
+            reactor->post(std::move(cmd));
+        }
+        else
+        {
+            reactor->broadcast(payload);
+        }
+    }
+}
+
+SP_TelnetTopic TelnetServer::topic(const std::string &name, size_t capacity)
+{
+    SP_TelnetTopic &topic = m_topics[name];
+    if (!topic)
+        topic = std::make_shared<TelnetTopic>(name, capacity);
+    return topic;
+}
+
+SP_TelnetTopic TelnetServer::findTopic(const std::string &name) const
+{
+    auto it = m_topics.find(name);
+    return it != m_topics.end() ? it->second : nullptr;
+}
+
+void TelnetServer::publish(const SP_TelnetTopic &topic, const std::string &line)
+{
+    publish(topic, encodeLine(line));
+}
+
+void TelnetServer::publish(const SP_TelnetTopic &topic, const SP_TelnetPayload &payload)
+{
+    if (!topic || !payload)
+        return;
+
+    // Inline mode picks the line up in the next update(). I/O threads are woken once at the end
+    // of the frame, however many lines went out in it.
+    topic->publish(payload);
+    if (topic->m_subscribers.load() > 0)
+        m_published = true;
+}
+
+void TelnetServer::wakeSubscribers()
+{
+    if (!m_published.exchange(false))
+        return;
+
+    for (auto &reactor : m_reactors)
+    {
+        if (reactor->m_hasSubscribers)
+            reactor->wake();
+    }
+}
+
+void TelnetServer::shutdown()
+{
+    // Stop the I/O threads first so the sessions can be closed from here
+    for (auto &reactor : m_reactors)
+        reactor->stop();
+
+    // Attempt to cleanly close every telnet session in flight, then the listeners. A reactor lives on
+    // after the next initialise for as long as the host still holds one of its sessions, whose
+    // calls then find the socket closed and do nothing.
+    for (auto &reactor : m_reactors)
+        reactor->close();
+    for (SP_TelnetSession &session : m_sessions)
+    {
+        if (session->m_lineReader)
+        {
+            FPTR_LineReader reader = std::move(session->m_lineReader);
+            session->m_lineReader = nullptr;
+            reader(std::nullopt);
+        }
+    }
+    m_sessions.clear();
+
+    // Tasks and timers that have not run are dropped. A coroutine waiting on one is destroyed.
+    FPTR_Task posted;
+    while (m_posted.pop(posted)) {}
+    m_tasks.clear();
+    m_timers.clear();
+
+    m_initialised = false;
+}
+/* ------------------ Handoff -------------------*/
+
+// What goes to the new process with each session's socket
+struct TelnetHandoffSession
+{
+    std::string buffer;                 // The partly typed line
+    uint32_t cursor;                    // Where in it the client's cursor is
+    uint32_t columns;                   // Terminal width
+    std::vector<std::string> history;   // Oldest first
+    std::string output;                 // Output the old process could not send yet
+    bool compressed;                    // MCCP2 was on. The new process starts a fresh stream
+};
+
+static void putU32(std::string &out, uint32_t value)
+{
+    out.append((const char *)&value, sizeof(value));
+}
+
+static void putString(std::string &out, std::string_view text)
+{
+    putU32(out, (uint32_t)text.length());
+    out.append(text.data(), text.length());
+}
+
+// Reads a snapshot, failing rather than reading past the end of a truncated one
+struct HandoffReader
+{
+    std::string_view data;
+    bool ok;
+
+    uint32_t u32()
+    {
+        uint32_t value = 0;
+        if (data.length() < sizeof(value))
+        {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, data.data(), sizeof(value));
+        data.remove_prefix(sizeof(value));
+        return value;
+    }
+
+    std::string string()
+    {
+        uint32_t length = u32();
+        if (length > data.length())
+        {
+            ok = false;
+            return std::string();
+        }
+        std::string text(data.substr(0, length));
+        data.remove_prefix(length);
+        return text;
+    }
+};
+
+#ifdef TELNETSERVLIB_HANDOFF
+static const uint32_t HANDOFF_MAGIC = 0x544c4830;       // "TLH0"
+static const uint32_t HANDOFF_VERSION = 2;
+static const uint32_t HANDOFF_LAST = 1;                 // The snapshot follows this message
+static const size_t HANDOFF_FDS_PER_MESSAGE = 64;       // Well inside the kernel's limit for one SCM_RIGHTS message
+
+// Starts every message. The descriptors travel with it, listeners first, then one per session in
+// the order of the snapshot's session records.
+struct HandoffHeader
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t fdCount;
+    uint32_t payloadLength;
+};
+
+static bool sendAll(SOCKET s, const char * data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(s, data, length, SEND_FLAGS);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool receiveAll(SOCKET s, char * data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t received = recv(s, data, length, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        data += received;
+        length -= (size_t)received;
+    }
+    return true;
+}
+
+static bool unixAddress(const std::string &path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.length() >= sizeof(address.sun_path))
+    {
+        printf("Handoff path is empty or too long: %s\n", path.c_str());
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.length() + 1);
+    return true;
+}
+
+static bool sendHandoff(SOCKET channel, const std::vector<SOCKET> &sockets, const std::string &snapshot)
+{
+    size_t next = 0;
+    for (;;)
+    {
+        size_t count = std::min(sockets.size() - next, HANDOFF_FDS_PER_MESSAGE);
+        bool last = next + count == sockets.size();
+        HandoffHeader header = { HANDOFF_MAGIC, last ? HANDOFF_LAST : 0, (uint32_t)count, last ? (uint32_t)snapshot.length() : 0 };
+
+        struct iovec iov = { &header, sizeof(header) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+            struct cmsghdr align;
+        } control;
+        if (count > 0)
+        {
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+            struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            memcpy(CMSG_DATA(cmsg), &sockets[next], sizeof(int) * count);
+        }
+        if (sendmsg(channel, &msg, SEND_FLAGS) != (ssize_t)sizeof(header))
+            return false;
+
+        next += count;
+        if (last)
+            return sendAll(channel, snapshot.data(), snapshot.length());
+    }
+}
+
+static bool receiveHandoff(SOCKET channel, std::vector<SOCKET> &sockets, std::string &snapshot)
+{
+    for (;;)
+    {
+        HandoffHeader header;
+        struct iovec iov = { &header, sizeof(header) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+            struct cmsghdr align;
+        } control;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t received = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t received = recvmsg(channel, &msg, 0);
+#endif
+
+        // Descriptors that arrive are ours to close, whatever else is wrong with the message
+        for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); received > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+                sockets.push_back(fd);
+            }
+        }
+
+        if (received <= 0 || (msg.msg_flags & MSG_CTRUNC))
+            return false;
+        if ((size_t)received < sizeof(header) && !receiveAll(channel, (char *)&header + received, sizeof(header) - received))
+            return false;
+        if (header.magic != HANDOFF_MAGIC)
+            return false;
+        if (header.flags & HANDOFF_LAST)
+        {
+            snapshot.resize(header.payloadLength);
+            return receiveAll(channel, &snapshot[0], snapshot.length());
+        }
+    }
+}
+#endif
+
+void TelnetReactor::finishInput()
+{
+    // Input this process has read would be lost with it, so apply all of it now. Anything still in
+    // the kernel's buffers goes across with the socket.
+    while (!m_ready.empty())
+    {
+        TelnetSession * session = m_ready.front();
+        m_ready.pop_front();
+        session->m_readyQueued = false;
+        while (session->m_socket != INVALID_SOCKET && session->m_eventCursor < session->m_inputEvents.size())
+            session->update(SIZE_MAX);
+    }
+}
+
+uint32_t TelnetReactor::saveSessions(std::vector<SOCKET> &sockets, std::string &records, std::vector<SP_TelnetSession> &uncompressed)
+{
+    uint32_t saved = 0;
+    for (SP_TelnetSession &ts : m_sessions)
+    {
+        // A compressed stream cannot be carried over, so end it cleanly and let the new process
+        // start another. Whatever will not go out now is sent by the new process.
+        bool compressed = ts->m_compressor != nullptr;
+        if (compressed)
+        {
+            ts->endCompression();
+            uncompressed.push_back(ts);
+        }
+        ts->keepPendingLine();
+        ts->flushOutput();
+        if (ts->m_socket == INVALID_SOCKET)
+            continue;
+
+        std::string output;
+        for (size_t i = ts->m_outHead; i < ts->m_outTail; i++)
+        {
+            const TelnetOutputChunk &chunk = ts->m_outChunks[i];
+            const std::string &bytes = chunk.shared ? *chunk.shared : chunk.owned;
+            output.append(bytes, chunk.sent, std::string::npos);
+        }
+
+        sockets.push_back(ts->m_socket);
+        putString(records, ts->m_buffer);
+        putU32(records, (uint32_t)ts->m_cursor);
+        putU32(records, ts->m_columns);
+        putU32(records, (uint32_t)ts->m_history.size());
+        for (size_t i = 0; i < ts->m_history.size(); i++)
+            putString(records, ts->m_history.at(i));
+        putString(records, output);
+        putU32(records, compressed ? 1 : 0);
+        saved++;
+    }
+    return saved;
+}
+
+void TelnetReactor::adoptSession(SOCKET clientSocket, const TelnetHandoffSession &state)
+{
+    SP_TelnetSession s = std::allocate_shared < TelnetSession >(TelnetPoolAllocator<TelnetSession>(), clientSocket, m_server->shared_from_this(), shared_from_this());
+    s->m_slot = m_sessions.insert(s);
+    s->m_adopted = true;
+    s->m_buffer = state.buffer;
+    s->m_cursor = std::min<size_t>(state.cursor, s->m_buffer.length());
+    if (state.columns > 0 && state.columns <= UINT16_MAX)
+        s->m_columns = (uint16_t)state.columns;
+    for (const std::string &line : state.history)
+        s->m_history.push(line);
+    s->m_historyCursor = s->m_history.size();
+    TelnetReactorCounters::add(m_counters.accepts);
+    m_server->m_admission.adopt();
+    watchSocket(clientSocket, s.get());
+
+    // The client already shows the prompt and its partly typed line, so only the old process's
+    // unsent output is queued
+    s->queueOutput(state.output.data(), state.output.length());
+    if (state.compressed)
+    {
+        // The client agreed to MCCP2 with the old process, so a new stream can simply be started
+        bool restart = false;
+#ifdef TELNETSERVLIB_MCCP
+        restart = m_compression.enabled;
+#endif
+        if (restart)
+        {
+            s->startCompression();
+        }
+        else
+        {
+            unsigned char wontCompress[3] = { TELNET_IAC, TELNET_WONT, TELNET_COMPRESS2 };
+            s->queueOutput((char *)wontCompress, 3);
+        }
+    }
+    s->initialise();
+}
+
+bool TelnetServer::handOver(const std::string &path, std::chrono::milliseconds timeout)
+{
+#ifdef TELNETSERVLIB_HANDOFF
+    if (!m_initialised)
+        return false;
+
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+        return false;
+    SOCKET channel = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (channel == INVALID_SOCKET || connect(channel, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR)
+    {
+        printf("Nothing is waiting to take over at %s (error %d)\n", path.c_str(), WSAGetLastError());
+        if (channel != INVALID_SOCKET)
+            closesocket(channel);
+        return false;
+    }
+
+    // Stop the I/O threads. From here this thread owns every session, as in shutdown().
+    for (auto &reactor : m_reactors)
+        reactor->stop();
+    for (auto &reactor : m_reactors)
+    {
+        reactor->m_threadId = std::this_thread::get_id();
+        reactor->drainCommands();
+        reactor->finishInput();
+        reactor->reapSessions();
+    }
+
+    // Run the callbacks for everything the I/O threads found. What they send is queued directly.
+    bool pending = m_threaded;
+    while (pending)
+    {
+        for (auto &reactor : m_reactors)
+            reactor->drainOverflow();
+        drainEvents(SIZE_MAX, std::chrono::steady_clock::time_point::max());
+        pending = false;
+        for (auto &reactor : m_reactors)
+        {
+            reactor->drainCommands();
+            reactor->reapSessions();
+            pending = pending || reactor->m_hostEvents.front() != nullptr || !reactor->m_eventOverflow.empty();
+        }
+    }
+
+    // Listeners first, then the sessions
+    std::vector<SOCKET> sockets;
+    for (auto &reactor : m_reactors)
+    {
+        if (reactor->m_listenSocket != INVALID_SOCKET)
+            sockets.push_back(reactor->m_listenSocket);
+    }
+    uint32_t listeners = (uint32_t)sockets.size();
+    uint32_t sessions = 0;
+    std::string records;
+    std::vector<SP_TelnetSession> uncompressed;
+    for (auto &reactor : m_reactors)
+        sessions += reactor->saveSessions(sockets, records, uncompressed);
+
+    std::string snapshot;
+    putU32(snapshot, HANDOFF_VERSION);
+    putU32(snapshot, (uint32_t)m_listenPort);
+    putU32(snapshot, listeners);
+    putU32(snapshot, sessions);
+    snapshot += records;
+
+    // Nothing is closed until the new process says it has everything, so if it fails this one can
+    // carry on where it was
+    struct timeval limit;
+    limit.tv_sec = (time_t)(timeout.count() / 1000);
+    limit.tv_usec = (suseconds_t)(timeout.count() % 1000) * 1000;
+    setsockopt(channel, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    char ack = 0;
+    if (!sendHandoff(channel, sockets, snapshot) || !receiveAll(channel, &ack, 1) || ack != 1)
+    {
+        printf("Handing over to %s failed. Carrying on.\n", path.c_str());
+        closesocket(channel);
+
+        // The compressed streams were ended for the new process. The clients still agree to MCCP2,
+        // so start them again as adoptSession() would have.
+        for (SP_TelnetSession &ts : uncompressed)
+        {
+            if (ts->m_socket == INVALID_SOCKET)
+                continue;
+            ts->startCompression();
+            ts->flushOutput();
+        }
+        if (m_threaded)
+        {
+            for (auto &reactor : m_reactors)
+                reactor->start();
+        }
+        return false;
+    }
+    closesocket(channel);
+
+    // The new process has its own copies. Closing ours does not end the connections, but
+    // closeConnection() would, so the sessions are dropped without shutting down their sockets.
+    for (auto &reactor : m_reactors)
+    {
+        for (SP_TelnetSession &ts : reactor->m_sessions)
+            ts->closeSocket();
+    }
+    shutdown();
+    std::cout << "Handed " << sessions << " sessions over to " << path << "\n";
+    return true;
+#else
+    (void)path;
+    (void)timeout;
+    printf("handOver is not supported on this platform\n");
+    return false;
+#endif
+}
+
+bool TelnetServer::takeOver(const std::string &path, std::string promptString, unsigned ioThreads, std::chrono::milliseconds timeout)
+{
+#ifdef TELNETSERVLIB_HANDOFF
+    if (m_initialised)
+    {
+        std::cout << "This Telnet Server instance has already been initialised. Please shut it down before reinitialising it.";
+        return false;
+    }
+
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+        return false;
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());   // Left behind by a takeover that did not finish
+    if (listener == INVALID_SOCKET || bind(listener, (struct sockaddr *)&address, sizeof(address)) == SOCKET_ERROR || listen(listener, 1) == SOCKET_ERROR)
+    {
+        printf("Could not wait for a handover at %s (error %d)\n", path.c_str(), WSAGetLastError());
+        if (listener != INVALID_SOCKET)
+            closesocket(listener);
+        return false;
+    }
+
+    std::cout << "Waiting at " << path << " for a Telnet Server to hand over\n";
+    struct pollfd waiting = { listener, POLLIN, 0 };
+    SOCKET channel = ::poll(&waiting, 1, (int)timeout.count()) > 0 ? accept(listener, NULL, NULL) : INVALID_SOCKET;
+    closesocket(listener);
+    unlink(path.c_str());
+    if (channel == INVALID_SOCKET)
+    {
+        std::cout << "Nothing was handed over\n";
+        return false;
+    }
+
+    // Don't wait forever on a process that dies halfway through
+    struct timeval limit = { (time_t)(timeout.count() / 1000), (suseconds_t)(timeout.count() % 1000) * 1000 };
+    setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+
+    std::vector<SOCKET> sockets;
+    std::string snapshot;
+    bool received = receiveHandoff(channel, sockets, snapshot);
+    HandoffReader reader = { snapshot, true };
+    uint32_t version = reader.u32();
+    uint32_t port = reader.u32();
+    uint32_t listeners = reader.u32();
+    uint32_t sessionCount = reader.u32();
+    bool usable = received && reader.ok && version == HANDOFF_VERSION && listeners > 0 && (size_t)listeners + sessionCount == sockets.size();
+
+    std::vector<TelnetHandoffSession> sessions(usable ? sessionCount : 0);
+    for (TelnetHandoffSession &state : sessions)
+    {
+        state.buffer = reader.string();
+        state.cursor = reader.u32();
+        state.columns = reader.u32();
+        uint32_t historyCount = reader.u32();
+        for (uint32_t i = 0; i < historyCount && reader.ok; i++)
+            state.history.push_back(reader.string());
+        state.output = reader.string();
+        state.compressed = reader.u32() != 0;
+    }
+
+    m_listenPort = port;
+    m_promptString = promptString;
+    m_threaded = ioThreads > 0;
+    if (!usable || !reader.ok || !openReactors(ioThreads, std::vector<SOCKET>(sockets.begin(), sockets.begin() + listeners)))
+    {
+        // The old process keeps its copies and carries on without an acknowledgement
+        printf("Could not take over from the old process\n");
+        for (size_t i = usable && reader.ok ? listeners : 0; i < sockets.size(); i++)
+            closesocket(sockets[i]);
+        closesocket(channel);
+        return false;
+    }
+
+    // Acknowledge before adopting anything. If the old process has already given up waiting it
+    // carries on with these sockets, so our copies are only closed: with nothing adopted yet,
+    // shutdown() just closes the listeners.
+    char ack = 1;
+    if (!sendAll(channel, &ack, 1))
+    {
+        printf("The old process stopped waiting at %s, so it keeps its sessions\n", path.c_str());
+        for (size_t i = listeners; i < sockets.size(); i++)
+            closesocket(sockets[i]);
+        closesocket(channel);
+        shutdown();
+        return false;
+    }
+    closesocket(channel);
+
+    std::cout << "Taking over Telnet Server on port " << std::to_string(m_listenPort) << " with " << sessionCount << " sessions\n";
+    for (uint32_t i = 0; i < sessionCount; i++)
+        m_reactors[i % m_reactors.size()]->adoptSession(sockets[listeners + i], sessions[i]);
+
+    if (m_threaded)
+    {
+        for (auto &reactor : m_reactors)
+            reactor->start();
+    }
+    m_initialised = true;
+    return true;
+#else
+    (void)path; (void)promptString; (void)ioThreads; (void)timeout;
+    printf("takeOver is not supported on this platform\n");
+    return false;
+#endif
+}
@@ -3,8 +3,8 @@ TelnetServLib
 =============
 
 TelnetServLib is a very light ANSI Telnet Server library for use in apps with 'game
-loops': i.e. update, render. It utilises TCP select to enable it to operate in the 
-main thread.
+loops': i.e. update, render. It utilises socket readiness polling (epoll on Linux, 
+poll/WSAPoll elsewhere) to enable it to operate in the main thread.
 
 License
 =======
@@ -37,119 +37,1384 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the FreeBSD Project.
 */
 
+#ifdef _WIN32
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET  (-1)
+#define SOCKET_ERROR    (-1)
+#endif
+
+#if defined(__linux__)
+#define TELNETSERVLIB_EPOLL     // Use an epoll reactor rather than poll() to find readable sessions
+#include <sys/epoll.h>
+#if defined(SO_REUSEPORT)
+#define TELNETSERVLIB_REUSEPORT // Each I/O thread can own a listener and let the kernel balance connections
+#endif
+#endif
+
+#ifndef _WIN32
+#include <sys/un.h>
+#define TELNETSERVLIB_HANDOFF   // Live sockets can be passed to a new process over a Unix domain socket (SCM_RIGHTS)
+#endif
+
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
 #include <functional>
-#include <list>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <array>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include <cstdarg>
+#include <charconv>
+#include <type_traits>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <cstdio>
+#define TELNETSERVLIB_COROUTINES    // Compiled as C++20: coroutine command handlers are available
+#endif
 
 class TelnetServer;
 class TelnetSession;
+class TelnetReactor;
+struct TelnetCompressor;
+struct TelnetHandoffSession;
+class TelnetCommandRouter;
+class TelnetTopic;
+
+typedef std::shared_ptr<const std::string> SP_TelnetPayload;   // Encoded output that can be queued on many sessions at once
+typedef std::shared_ptr<TelnetSession>   SP_TelnetSession;
+typedef std::vector < SP_TelnetSession > VEC_SP_TelnetSession;
+typedef std::shared_ptr<TelnetTopic>     SP_TelnetTopic;
+typedef std::function< void() > FPTR_Task;
+typedef std::function< void(std::optional<std::string_view>) > FPTR_LineReader;  // nullopt if the session closed first
 
-const std::string ANSI_FG_BLACK   ("\x1b[30m");
-const std::string ANSI_FG_RED     ("\x1b[31m");
-const std::string ANSI_FG_GREEN   ("\x1b[32m");
-const std::string ANSI_FG_YELLOW  ("\x1b[33m");
-const std::string ANSI_FG_BLUE    ("\x1b[34m");
-const std::string ANSI_FG_MAGENTA ("\x1b[35m");
-const std::string ANSI_FG_CYAN    ("\x1b[36m");
-const std::string ANSI_FG_WHITE   ("\x1b[37m");
-const std::string ANSI_FG_DEFAULT ("\x1b[39m");
+// Compile time constants: no per translation unit copies built at startup
+constexpr std::string_view ANSI_FG_BLACK   ("\x1b[30m");
+constexpr std::string_view ANSI_FG_RED     ("\x1b[31m");
+constexpr std::string_view ANSI_FG_GREEN   ("\x1b[32m");
+constexpr std::string_view ANSI_FG_YELLOW  ("\x1b[33m");
+constexpr std::string_view ANSI_FG_BLUE    ("\x1b[34m");
+constexpr std::string_view ANSI_FG_MAGENTA ("\x1b[35m");
+constexpr std::string_view ANSI_FG_CYAN    ("\x1b[36m");
+constexpr std::string_view ANSI_FG_WHITE   ("\x1b[37m");
+constexpr std::string_view ANSI_FG_DEFAULT ("\x1b[39m");
 
-const std::string ANSI_BG_BLACK   ("\x1b[40m");
-const std::string ANSI_BG_RED     ("\x1b[41m");
-const std::string ANSI_BG_GREEN   ("\x1b[42m");
-const std::string ANSI_BG_YELLOW  ("\x1b[43m");
-const std::string ANSI_BG_BLUE    ("\x1b[44m");
-const std::string ANSI_BG_MAGENTA ("\x1b[45m");
-const std::string ANSI_BG_CYAN    ("\x1b[46m");
-const std::string ANSI_BG_WHITE   ("\x1b[47m");
-const std::string ANSI_BG_DEFAULT ("\x1b[49m");
+constexpr std::string_view ANSI_BG_BLACK   ("\x1b[40m");
+constexpr std::string_view ANSI_BG_RED     ("\x1b[41m");
+constexpr std::string_view ANSI_BG_GREEN   ("\x1b[42m");
+constexpr std::string_view ANSI_BG_YELLOW  ("\x1b[43m");
+constexpr std::string_view ANSI_BG_BLUE    ("\x1b[44m");
+constexpr std::string_view ANSI_BG_MAGENTA ("\x1b[45m");
+constexpr std::string_view ANSI_BG_CYAN    ("\x1b[46m");
+constexpr std::string_view ANSI_BG_WHITE   ("\x1b[47m");
+constexpr std::string_view ANSI_BG_DEFAULT ("\x1b[49m");
 
-const std::string ANSI_BOLD_ON       ("\x1b[1m");
-const std::string ANSI_BOLD_OFF      ("\x1b[22m");
+constexpr std::string_view ANSI_RESET         ("\x1b[0m");     // Every colour and attribute back to the default
 
-const std::string ANSI_ITALICS_ON    ("\x1b[3m");
-const std::string ANSI_ITALCIS_OFF   ("\x1b[23m");
+constexpr std::string_view ANSI_BOLD_ON       ("\x1b[1m");
+constexpr std::string_view ANSI_BOLD_OFF      ("\x1b[22m");
 
-const std::string ANSI_UNDERLINE_ON  ("\x1b[4m");
-const std::string ANSI_UNDERLINE_OFF ("\x1b[24m");
+constexpr std::string_view ANSI_ITALICS_ON    ("\x1b[3m");
+constexpr std::string_view ANSI_ITALICS_OFF   ("\x1b[23m");
+constexpr std::string_view ANSI_ITALCIS_OFF = ANSI_ITALICS_OFF;    // The original spelling
 
-const std::string ANSI_INVERSE_ON    ("\x1b[7m");
-const std::string ANSI_INVERSE_OFF   ("\x1b[27m");
+constexpr std::string_view ANSI_UNDERLINE_ON  ("\x1b[4m");
+constexpr std::string_view ANSI_UNDERLINE_OFF ("\x1b[24m");
 
-const std::string ANSI_STRIKETHROUGH_ON  ("\x1b[9m");
-const std::string ANSI_STRIKETHROUGH_OFF ("\x1b[29m");
+constexpr std::string_view ANSI_INVERSE_ON    ("\x1b[7m");
+constexpr std::string_view ANSI_INVERSE_OFF   ("\x1b[27m");
 
-const std::string ANSI_ERASE_LINE        ("\x1b[2K");
-const std::string ANSI_ERASE_SCREEN      ("\x1b[2J");
+constexpr std::string_view ANSI_STRIKETHROUGH_ON  ("\x1b[9m");
+constexpr std::string_view ANSI_STRIKETHROUGH_OFF ("\x1b[29m");
 
-const std::string ANSI_ARROW_UP("\x1b\x5b\x41");
-const std::string ANSI_ARROW_DOWN("\x1b\x5b\x42");
-const std::string ANSI_ARROW_RIGHT("\x1b\x5b\x43");
-const std::string ANSI_ARROW_LEFT("\x1b\x5b\x44");
+constexpr std::string_view ANSI_ERASE_LINE        ("\x1b[2K");
+constexpr std::string_view ANSI_ERASE_SCREEN      ("\x1b[2J");
 
+constexpr std::string_view ANSI_ARROW_UP("\x1b\x5b\x41");
+constexpr std::string_view ANSI_ARROW_DOWN("\x1b\x5b\x42");
+constexpr std::string_view ANSI_ARROW_RIGHT("\x1b\x5b\x43");
+constexpr std::string_view ANSI_ARROW_LEFT("\x1b\x5b\x44");
 
-const std::string TELNET_ERASE_LINE      ("\xff\xf8");
+constexpr std::string_view TELNET_ERASE_LINE      ("\xff\xf8");
 
+const unsigned char TELNET_IAC  = 0xff;     // Interpret as command
+const unsigned char TELNET_DONT = 0xfe;
+const unsigned char TELNET_DO   = 0xfd;
+const unsigned char TELNET_WONT = 0xfc;
+const unsigned char TELNET_WILL = 0xfb;
+const unsigned char TELNET_SB   = 0xfa;     // Subnegotiation begin
+const unsigned char TELNET_EC   = 0xf7;     // Erase character
+const unsigned char TELNET_NOP  = 0xf1;     // No operation
+const unsigned char TELNET_SE   = 0xf0;     // Subnegotiation end
 
-class TelnetSession : public std::enable_shared_from_this < TelnetSession >
+const unsigned char TELNET_NAWS = 31;       // Negotiate about window size: the client reports its width and height
+const unsigned char TELNET_COMPRESS2 = 86;  // MCCP2: everything the server sends after IAC SB COMPRESS2 IAC SE is a zlib stream
+
+// A single item of client input, produced by TelnetInputParser
+struct TelnetInputEvent
+{
+    enum Type
+    {
+        Data,               // Plain bytes for the line. data/length point into the received chunk
+        Command,            // IAC <command> (NOP, AYT, BRK...)
+        Negotiation,        // IAC WILL/WONT/DO/DONT <option>
+        Subnegotiation,     // IAC SB <option> ... IAC SE. data/length hold the unescaped payload
+        CursorUp,
+        CursorDown,
+        CursorRight,
+        CursorLeft,
+        Home,
+        End,
+        Delete,             // Delete the character under the cursor
+        Erase,              // Backspace, DEL or IAC EC
+        Tab,                // Horizontal tab. data/length point at it, for sessions that treat it as data
+        EndOfLine           // CR, CR LF, CR NUL or LF
+    };
+
+    Type            type;
+    unsigned char   command;    // Telnet command for Command and Negotiation events
+    unsigned char   option;     // Telnet option for Negotiation and Subnegotiation events
+    const char *    data;       // Only valid until the next call to parse
+    size_t          length;
+};
+
+// Incremental Telnet/ANSI input state machine. Each received byte is looked at once and the
+// state is kept between reads, so sequences split across recv() calls are handled.
+class TelnetInputParser
+{
+public:
+    TelnetInputParser() : m_state(Normal), m_command(0), m_option(0), m_subPayloadCount(0), m_validateUtf8(true), m_utf8Expected(0) {}
+
+    // Appends the events found in data. Their payloads point into data or into the parser, so they are
+    // only valid until the next call
+    void parse(const char * data, size_t length, std::vector<TelnetInputEvent> &events);
+    void reset();
+
+    void validateUtf8(bool validate) { m_validateUtf8 = validate; }    // Replace malformed UTF-8 with U+FFFD (default on)
+    bool validateUtf8() const { return m_validateUtf8; }
+
+private:
+    enum State { Normal, CarriageReturn, Utf8, Iac, IacOption, SubOption, SubData, SubIac, Escape, Csi, Ss3 };
+
+    void emit(std::vector<TelnetInputEvent> &events, TelnetInputEvent::Type type, const char * data, size_t length);
+    void emitCsi(std::vector<TelnetInputEvent> &events, unsigned char final);
+
+    State         m_state;
+    unsigned char m_command;
+    unsigned char m_option;
+    std::string   m_subBuffer;      // Payload of the subnegotiation in progress
+    std::deque<std::string> m_subPayloads;  // Payloads completed during this parse. A deque so earlier ones never move
+    size_t        m_subPayloadCount;
+    std::string   m_csiParams;      // Parameter bytes of the escape sequence in progress
+    bool          m_validateUtf8;
+    int           m_utf8Expected;   // Length of the UTF-8 character split across reads
+    std::string   m_utf8Carry;      // Its bytes received so far
+    std::string   m_utf8Done;       // The completed character, handed out as a Data event
+};
+
+// Unbounded lock-free multi producer, single consumer queue (Vyukov). push never blocks and may
+// be called from any thread; pop must only be called from the one consuming thread.
+template <typename T>
+class TelnetMpscQueue
+{
+public:
+    TelnetMpscQueue() : m_head(new Node()), m_tail(m_head.load()) {}
+    ~TelnetMpscQueue()
+    {
+        T discard;
+        while (pop(discard)) {}
+        delete m_tail;
+    }
+
+    void push(T &&value)
+    {
+        Node * node = new Node();
+        node->value = std::move(value);
+        Node * previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    bool pop(T &value)
+    {
+        Node * next = m_tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+        value = std::move(next->value);
+        delete m_tail;
+        m_tail = next;      // next becomes the new stub node
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        Node() : next(nullptr) {}
+        std::atomic<Node *> next;
+        T value;
+    };
+
+    TelnetMpscQueue(const TelnetMpscQueue &) = delete;
+    TelnetMpscQueue &operator=(const TelnetMpscQueue &) = delete;
+
+    std::atomic<Node *> m_head;     // Producers append here
+    Node * m_tail;                  // Consumer side stub
+};
+
+// Bounded lock-free single producer, single consumer ring. Slots are filled and read in place,
+// so strings inside T keep their capacity from one lap of the ring to the next.
+template <typename T>
+class TelnetSpscQueue
+{
+public:
+    explicit TelnetSpscQueue(size_t capacity) : m_headCache(0), m_tailCache(0), m_head(0), m_tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    // Producer: get the next free slot (nullptr if full), fill it, then commit it
+    T * beginPush()
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_headCache == m_slots.size())
+        {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if (tail - m_headCache == m_slots.size())
+                return nullptr;
+        }
+        return &m_slots[tail & m_mask];
+    }
+    void commitPush() { m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer: look at the oldest slot (nullptr if empty), then release it
+    T * front()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tailCache)
+        {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tailCache)
+                return nullptr;
+        }
+        return &m_slots[head & m_mask];
+    }
+    void popFront() { m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+    size_t size() const { return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_relaxed); }   // Consumer only
+
+private:
+    std::vector<T> m_slots;
+    size_t m_mask;
+    alignas(64) size_t m_headCache;             // Producer's last view of m_head
+    alignas(64) size_t m_tailCache;             // Consumer's last view of m_tail
+    alignas(64) std::atomic<size_t> m_head;     // Written by the consumer
+    alignas(64) std::atomic<size_t> m_tail;     // Written by the producer
+};
+
+struct TelnetOutputChunk
+{
+    TelnetOutputChunk() : sent(0) {}
+
+    SP_TelnetPayload shared;    // Payload shared with other sessions (e.g. a broadcast). Null for owned bytes
+    std::string      owned;     // Bytes queued by this session only
+    size_t           sent;      // How much of this chunk has already been written to the socket
+};
+
+// How much unsent output a session may build up, and what happens to a client that cannot keep up
+struct TelnetOutputLimits
+{
+    enum Policy
+    {
+        DropOldest,     // Throw away the oldest unsent output until the queue is back under the low watermark
+        Coalesce,       // Stop queuing output, then send one notice of what was skipped once under the low watermark
+        Disconnect      // Close the connection
+    };
+
+    TelnetOutputLimits() : highWatermark(256 * 1024), lowWatermark(64 * 1024), policy(DropOldest) {}
+
+    size_t highWatermark;   // Queued bytes that trigger the policy
+    size_t lowWatermark;    // Queued bytes at which a backed up session is considered healthy again
+    Policy policy;
+};
+
+// MCCP2 output compression. Only available when the library is built with TELNETSERVLIB_MCCP and
+// linked against zlib; see TelnetServer::compressionSupported().
+struct TelnetCompressionOptions
+{
+    TelnetCompressionOptions() : enabled(true), level(6), memLevel(8), bypassBytes(64) {}
+
+    bool   enabled;         // Offer COMPRESS2 to new sessions, and accept it when a client asks
+    int    level;           // zlib compression level, 1 (fastest) to 9 (smallest)
+    int    memLevel;        // zlib memory level, 1 to 9. Each session's stream takes about 128 KB << (memLevel - 8) with the default window
+    size_t bypassBytes;     // Flushes smaller than this (keystroke echoes) are sent as stored blocks without searching for matches
+};
+
+// Which new connections are let in. Turned away connections are closed straight after accept,
+// before any session is built for them.
+struct TelnetAdmissionLimits
+{
+    TelnetAdmissionLimits() : acceptsPerPoll(256), maxSessions(0), connectRate(0), connectBurst(10) {}
+
+    size_t acceptsPerPoll;  // Connections taken from the backlog each time the listener is ready
+    size_t maxSessions;     // Open sessions across all I/O threads. 0 for no limit
+    double connectRate;     // Connections per second allowed from one source address. 0 for no limit
+    double connectBurst;    // Connections a source address may make at once before the rate applies
+};
+
+// Timers run for each session. 0 turns one off.
+struct TelnetTimeouts
+{
+    TelnetTimeouts() : idle(0), keepalive(0), negotiation(0) {}
+
+    bool enabled() const { return idle.count() > 0 || keepalive.count() > 0 || negotiation.count() > 0; }
+
+    std::chrono::milliseconds idle;         // Close a session whose client has sent nothing for this long
+    std::chrono::milliseconds keepalive;    // Send IAC NOP once the client has been quiet this long, and again each time it passes. A dead peer then fails a send
+    std::chrono::milliseconds negotiation;  // Close a session whose client has answered none of our telnet options this long after connecting
+};
+
+// Applies TelnetAdmissionLimits: a token bucket per source address and a count of open sessions.
+// Shared by every reactor. Buckets that have filled back up are pruned as the table grows, so a
+// flood from many addresses does not leave the table large.
+class TelnetAdmission
+{
+public:
+    TelnetAdmission() : m_pruneAt(MIN_PRUNE), m_open(0) {}
+
+    void limits(const TelnetAdmissionLimits &limits);   // Not while connections are being admitted
+    bool admit(uint32_t address, std::chrono::steady_clock::time_point now);   // Takes a token and a session place, or returns false
+    void release() { m_open.fetch_sub(1, std::memory_order_relaxed); }        // An admitted session has closed
+    void adopt() { m_open.fetch_add(1, std::memory_order_relaxed); }          // A session handed over by another process. Always let in
+    size_t trackedAddresses();
+
+private:
+    struct Bucket
+    {
+        double tokens;
+        std::chrono::steady_clock::time_point updated;
+    };
+
+    static constexpr size_t MIN_PRUNE = 1024;
+
+    void refill(Bucket &bucket, std::chrono::steady_clock::time_point now) const;
+    void prune(std::chrono::steady_clock::time_point now);
+
+    TelnetAdmissionLimits m_limits;
+    std::mutex m_mutex;
+    std::unordered_map<uint32_t, Bucket> m_buckets;     // By IPv4 address, in network order
+    size_t m_pruneAt;                                   // Table size that triggers the next prune
+    std::atomic<size_t> m_open;
+};
+
+// A copy of a TelnetHistogram taken at one moment
+struct TelnetHistogramSnapshot
+{
+    TelnetHistogramSnapshot() : count(0), sum(0), max(0) {}
+
+    uint64_t percentile(double p) const;    // p in [0, 1]. Accurate to within about 6%
+    double   mean() const { return count > 0 ? (double)sum / count : 0.0; }
+
+    std::vector<uint64_t> buckets;          // Counts per TelnetHistogram bucket
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+// Log-linear (HDR style) histogram of non-negative values such as nanoseconds. Each power of two
+// is split into 16 buckets, so it covers the full 64 bit range at a fixed relative precision.
+// Recording is a couple of relaxed atomic adds, and snapshots can be taken from any thread.
+class TelnetHistogram
 {
 public:
-    TelnetSession(SOCKET ClientSocket, std::shared_ptr<TelnetServer> ts) : m_socket(ClientSocket), m_telnetServer(ts) 
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    TelnetHistogram();
+
+    void record(uint64_t value);
+    TelnetHistogramSnapshot snapshot() const;
+
+    static int bucketIndex(uint64_t value);
+    static uint64_t bucketLowest(int index);    // Smallest value that lands in the bucket
+    static uint64_t bucketHighest(int index);   // Largest value that lands in the bucket
+
+private:
+    TelnetHistogram(const TelnetHistogram &) = delete;
+    TelnetHistogram &operator=(const TelnetHistogram &) = delete;
+
+    std::atomic<uint64_t> m_buckets[BUCKET_COUNT];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+// Counters kept by one reactor. Each is written only by the reactor's own thread, so an update is
+// a relaxed load and store rather than a locked add; any thread may read them.
+struct TelnetReactorCounters
+{
+    TelnetReactorCounters() : accepts(0), disconnects(0), bytesIn(0), bytesOut(0), recvCalls(0), sendCalls(0),
+        linesIn(0), outputQueued(0), bytesDropped(0), writeStalls(0), slowDisconnects(0), rejects(0), acceptErrors(0),
+        compressIn(0), compressOut(0), timeouts(0), keepalives(0), topicDropped(0) {}
+
+    static void add(std::atomic<uint64_t> &counter, uint64_t n = 1)
     {
-        m_historyCursor = m_history.end();
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> accepts;
+    std::atomic<uint64_t> disconnects;
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> recvCalls;
+    std::atomic<uint64_t> sendCalls;
+    std::atomic<uint64_t> linesIn;
+    std::atomic<uint64_t> outputQueued;     // Gauge: unsent output across the reactor's sessions after the last flush
+    std::atomic<uint64_t> bytesDropped;
+    std::atomic<uint64_t> writeStalls;
+    std::atomic<uint64_t> slowDisconnects;
+    std::atomic<uint64_t> rejects;
+    std::atomic<uint64_t> acceptErrors;
+    std::atomic<uint64_t> compressIn;
+    std::atomic<uint64_t> compressOut;
+    std::atomic<uint64_t> timeouts;
+    std::atomic<uint64_t> keepalives;
+    std::atomic<uint64_t> topicDropped;
+};
+
+struct TelnetSessionMetrics
+{
+    TelnetSessionMetrics() : bytesIn(0), bytesOut(0), linesIn(0), outputQueued(0) {}
+
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t linesIn;
+    uint64_t outputQueued;      // Unsent output after the last flush
+};
+
+// Everything the server has counted since it was initialised
+struct TelnetServerMetrics
+{
+    TelnetServerMetrics() : accepts(0), disconnects(0), sessions(0), bytesIn(0), bytesOut(0), recvCalls(0), sendCalls(0),
+        linesIn(0), linesDispatched(0), outputQueued(0), bytesDropped(0), writeStalls(0), slowDisconnects(0), rejects(0), acceptErrors(0),
+        compressIn(0), compressOut(0), timeouts(0), keepalives(0), topicDropped(0) {}
+
+    uint64_t accepts;
+    uint64_t disconnects;
+    uint64_t sessions;          // Open right now
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t recvCalls;
+    uint64_t sendCalls;
+    uint64_t linesIn;           // Lines completed by the I/O side
+    uint64_t linesDispatched;   // Lines handed to the line callback
+    uint64_t outputQueued;      // Unsent output across all sessions
+    uint64_t bytesDropped;      // Output discarded by DropOldest or Coalesce
+    uint64_t writeStalls;       // Times a socket's send buffer filled and we waited for it to drain
+    uint64_t slowDisconnects;   // Sessions closed by the Disconnect policy
+    uint64_t rejects;           // Connections turned away by the admission limits
+    uint64_t acceptErrors;      // Failed accepts other than a connection that went away first
+    uint64_t compressIn;        // Output bytes fed to MCCP2 streams...
+    uint64_t compressOut;       // ...and the compressed bytes that came out
+    uint64_t timeouts;          // Sessions closed by the idle or negotiation timeout
+    uint64_t keepalives;        // IAC NOPs sent to quiet clients
+    uint64_t topicDropped;      // Topic lines subscribers missed by falling a whole ring behind
+    TelnetHistogramSnapshot updateTime;     // Wall time of TelnetServer::update(), in nanoseconds
+    TelnetHistogramSnapshot callbackTime;   // Time spent in each connected or line callback, in nanoseconds
+};
+
+// What a budgeted TelnetServer::update() got through, and what it left for the next call
+struct TelnetUpdateReport
+{
+    TelnetUpdateReport() : sessionsServiced(0), sessionsDeferred(0), eventsHandled(0), eventsDeferred(0), tasksRun(0), tasksDeferred(0), budgetExhausted(false) {}
+
+    size_t sessionsServiced;    // Inline mode: sessions given a turn at their input
+    size_t sessionsDeferred;    // Inline mode: sessions with input still waiting for a turn
+    size_t eventsHandled;       // Threaded mode: callbacks run
+    size_t eventsDeferred;      // Threaded mode: events still queued by the I/O threads
+    size_t tasksRun;            // Posted tasks, timers and resumed coroutines
+    size_t tasksDeferred;       // Tasks that were due but left for the next call
+    bool   budgetExhausted;     // Stopped because the time ran out rather than the work
+};
+
+// Fixed capacity history of lines. Once full the oldest entry is overwritten in place, so its
+// string keeps its capacity and a warmed up history stops allocating.
+class TelnetHistoryRing
+{
+public:
+    explicit TelnetHistoryRing(size_t capacity) : m_entries(capacity), m_first(0), m_count(0) {}
+
+    void push(std::string_view line);
+    const std::string &at(size_t index) const { return m_entries[(m_first + index) % m_entries.size()]; }    // 0 is the oldest
+    const std::string &back() const { return at(m_count - 1); }
+    size_t size() const { return m_count; }
+    size_t capacity() const { return m_entries.size(); }
+
+private:
+    std::vector<std::string> m_entries;
+    size_t m_first;         // Index of the oldest entry
+    size_t m_count;
+};
+
+// Fixed size block allocator. Blocks are carved from slabs and returned to a free list, never to
+// the heap, so objects that come and go all day reuse the same memory. Thread safe.
+class TelnetSlabPool
+{
+public:
+    explicit TelnetSlabPool(size_t blockSize, size_t blocksPerSlab = 64);
+    ~TelnetSlabPool();
+
+    void * allocate();
+    void deallocate(void * block);
+    size_t blockSize() const { return m_blockSize; }
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock * next;
     };
 
+    TelnetSlabPool(const TelnetSlabPool &) = delete;
+    TelnetSlabPool &operator=(const TelnetSlabPool &) = delete;
+
+    std::mutex  m_mutex;
+    size_t      m_blockSize;
+    size_t      m_blocksPerSlab;
+    FreeBlock * m_free;
+    std::vector<void *> m_slabs;
+};
+
+// Allocator for std::allocate_shared that takes single objects (e.g. a session and its control
+// block) from a slab pool shared by every allocation of that type.
+template <typename T>
+class TelnetPoolAllocator
+{
+public:
+    typedef T value_type;
+
+    TelnetPoolAllocator() noexcept {}
+    template <typename U> TelnetPoolAllocator(const TelnetPoolAllocator<U> &) noexcept {}
+
+    T * allocate(size_t n)
+    {
+        if (n != 1)
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        return static_cast<T *>(pool().allocate());
+    }
+
+    void deallocate(T * p, size_t n)
+    {
+        if (n != 1)
+            ::operator delete(p);
+        else
+            pool().deallocate(p);
+    }
+
+    template <typename U> bool operator==(const TelnetPoolAllocator<U> &) const noexcept { return true; }
+    template <typename U> bool operator!=(const TelnetPoolAllocator<U> &) const noexcept { return false; }
+
+private:
+    static TelnetSlabPool &pool()
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "TelnetPoolAllocator does not support over-aligned types");
+        // Never destroyed: sessions held by statics may be released after other statics are gone
+        static TelnetSlabPool * s_pool = new TelnetSlabPool(sizeof(T));
+        return *s_pool;
+    }
+};
+
+// Stable reference to an entry in a TelnetSlotMap. A slot's generation moves on every time its
+// entry is removed, so an old handle never finds whatever reuses the slot.
+struct TelnetSlotHandle
+{
+    TelnetSlotHandle() : index(UINT32_MAX), generation(0) {}
+    TelnetSlotHandle(uint32_t i, uint32_t g) : index(i), generation(g) {}
+
+    bool operator==(const TelnetSlotHandle &other) const { return index == other.index && generation == other.generation; }
+    bool operator!=(const TelnetSlotHandle &other) const { return !(*this == other); }
+
+    uint32_t index;
+    uint32_t generation;
+};
+
+typedef TelnetSlotHandle TelnetSessionHandle;
+
+// Values packed densely for iteration and found in O(1) through generational handles. Removing
+// an entry moves the last value into its place, so nothing is shifted but the order changes.
+// Freed slots are reused, so the storage only grows to the most entries ever held at once.
+template <typename T>
+class TelnetSlotMap
+{
+public:
+    TelnetSlotMap() : m_freeHead(NO_SLOT) {}
+
+    TelnetSlotHandle insert(T value)
+    {
+        uint32_t index;
+        if (m_freeHead != NO_SLOT)
+        {
+            index = m_freeHead;
+            m_freeHead = m_slots[index].dense;
+        }
+        else
+        {
+            index = (uint32_t)m_slots.size();
+            m_slots.emplace_back();
+        }
+        m_slots[index].dense = (uint32_t)m_values.size();
+        m_values.push_back(std::move(value));
+        m_valueSlots.push_back(index);
+        return TelnetSlotHandle(index, m_slots[index].generation);
+    }
+
+    // Returns false for a stale handle. Otherwise the last value now sits at the removed one's dense index.
+    bool erase(TelnetSlotHandle handle)
+    {
+        if (!contains(handle))
+            return false;
+
+        uint32_t dense = m_slots[handle.index].dense;
+        uint32_t last = (uint32_t)m_values.size() - 1;
+        if (dense != last)
+        {
+            m_values[dense] = std::move(m_values[last]);
+            m_valueSlots[dense] = m_valueSlots[last];
+            m_slots[m_valueSlots[dense]].dense = dense;
+        }
+        m_values.pop_back();
+        m_valueSlots.pop_back();
+
+        m_slots[handle.index].generation++;
+        m_slots[handle.index].dense = m_freeHead;
+        m_freeHead = handle.index;
+        return true;
+    }
+
+    void clear()
+    {
+        while (!m_values.empty())
+            erase(handleAt(m_values.size() - 1));
+    }
+
+    bool contains(TelnetSlotHandle handle) const { return handle.index < m_slots.size() && m_slots[handle.index].generation == handle.generation; }
+    T * find(TelnetSlotHandle handle) { return contains(handle) ? &m_values[m_slots[handle.index].dense] : nullptr; }
+    const T * find(TelnetSlotHandle handle) const { return contains(handle) ? &m_values[m_slots[handle.index].dense] : nullptr; }
+    size_t denseIndex(TelnetSlotHandle handle) const { return m_slots[handle.index].dense; }   // Live handles only
+    TelnetSlotHandle handleAt(size_t dense) const { return TelnetSlotHandle(m_valueSlots[dense], m_slots[m_valueSlots[dense]].generation); }
+
+    size_t size() const { return m_values.size(); }
+    bool empty() const { return m_values.empty(); }
+    T &operator[](size_t dense) { return m_values[dense]; }
+    const T &operator[](size_t dense) const { return m_values[dense]; }
+    typename std::vector<T>::iterator begin() { return m_values.begin(); }
+    typename std::vector<T>::iterator end() { return m_values.end(); }
+    typename std::vector<T>::const_iterator begin() const { return m_values.begin(); }
+    typename std::vector<T>::const_iterator end() const { return m_values.end(); }
+
+private:
+    static const uint32_t NO_SLOT = UINT32_MAX;
+
+    struct Slot
+    {
+        Slot() : dense(0), generation(0) {}
+        uint32_t dense;         // Index into m_values, or the next free slot while unused
+        uint32_t generation;
+    };
+
+    std::vector<Slot>     m_slots;
+    std::vector<T>        m_values;
+    std::vector<uint32_t> m_valueSlots;     // Slot of each value, to fix up the one that moves on erase
+    uint32_t              m_freeHead;
+};
+
+// A timer on a TelnetTimerWheel. Kept inside whatever it times, so arming one never allocates.
+struct TelnetTimerNode
+{
+    TelnetTimerNode() : prev(nullptr), next(nullptr), due(0), owner(nullptr) {}
+
+    bool armed() const { return next != nullptr; }
+
+    TelnetTimerNode * prev;     // Neighbours in the wheel slot. Null while not armed
+    TelnetTimerNode * next;
+    uint64_t due;               // Tick the timer expires on
+    void *   owner;             // For the expiry callback. Not used by the wheel
+};
+
+// Hierarchical timing wheel. Level 0 has a slot for each of the next 64 ticks and every level
+// above covers 64 times the span of the one below, so four levels reach 64^4 ticks ahead. Arming
+// or cancelling a timer links or unlinks one node. A timer further out than level 0 is moved down
+// as the wheel turns past its slot, at most three times, so nothing is ever sorted or scanned.
+class TelnetTimerWheel
+{
+public:
+    static const int SLOT_BITS = 6;
+    static const size_t SLOTS = (size_t)1 << SLOT_BITS;
+    static const int LEVELS = 4;
+    static const uint64_t MAX_DELAY = ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;  // Ticks. Timers due later are brought in to this
+
+    TelnetTimerWheel();
+
+    void arm(TelnetTimerNode &node, uint64_t due);  // Arm, or move an armed timer. A tick already reached expires on the next one
+    void cancel(TelnetTimerNode &node);             // Does nothing if the timer is not armed
+    bool empty() const { return m_count == 0; }
+    size_t size() const { return m_count; }
+    uint64_t now() const { return m_now; }          // Last tick the wheel has turned to
+
+    // Turn the wheel to tick, calling expired(TelnetTimerNode *) for each timer due by then. The
+    // timer is disarmed first, so the callback may re-arm it or arm and cancel any other.
+    // Returns how many expired.
+    template <typename F>
+    size_t advance(uint64_t tick, F &&expired)
+    {
+        size_t count = 0;
+        while (m_now < tick)
+        {
+            if (m_count == 0)
+            {
+                m_now = tick;   // Nothing to pass on the way
+                break;
+            }
+
+            m_now++;
+            cascade();
+            TelnetTimerNode due;
+            take(m_slots[0][m_now & (SLOTS - 1)], due);
+            while (due.next != &due)
+            {
+                TelnetTimerNode * node = due.next;
+                unlink(*node);
+                count++;
+                expired(node);
+            }
+        }
+        return count;
+    }
+
+private:
+    TelnetTimerWheel(const TelnetTimerWheel &) = delete;
+    TelnetTimerWheel &operator=(const TelnetTimerWheel &) = delete;
+
+    void place(TelnetTimerNode &node);                          // Link into the slot for node.due
+    void unlink(TelnetTimerNode &node);
+    void cascade();                                             // Spread out the higher slots the wheel has just reached
+    static void take(TelnetTimerNode &slot, TelnetTimerNode &list); // Move a whole slot onto an empty list head
+
+    TelnetTimerNode m_slots[LEVELS][SLOTS];     // List heads. Each slot is a circular list through its head
+    uint64_t m_now;
+    size_t   m_count;                           // Armed timers, including any being expired
+};
+
+// One character cell of a TelnetScreen. Eight bytes with no padding, so rows can be compared with memcmp.
+struct TelnetCell
+{
+    enum Colour { Black, Red, Green, Yellow, Blue, Magenta, Cyan, White, Default = 9 };     // SGR colour numbers
+    enum Attribute { Bold = 1, Italics = 2, Underline = 4, Inverse = 8, Strikethrough = 16 };
+
+    TelnetCell(char32_t ch = ' ', uint8_t fg = Default, uint8_t bg = Default, uint16_t attrs = 0) : ch(ch), fg(fg), bg(bg), attrs(attrs) {}
+
+    bool operator==(const TelnetCell &other) const { return ch == other.ch && sameStyle(other); }
+    bool operator!=(const TelnetCell &other) const { return !(*this == other); }
+    bool sameStyle(const TelnetCell &other) const { return fg == other.fg && bg == other.bg && attrs == other.attrs; }
+
+    char32_t ch;        // Unicode scalar value, drawn one column wide
+    uint8_t  fg;        // Colour
+    uint8_t  bg;
+    uint16_t attrs;     // Attribute bits
+};
+
+// A grid of cells that remembers what the client was last sent. render() emits only the cursor
+// moves, SGR changes and characters needed to bring the client's screen up to date, so a
+// dashboard that changes a few numbers costs a few bytes per refresh.
+class TelnetScreen
+{
 public:
-    void sendLine(std::string data);    // Send a line of data to the Telnet Server
+    TelnetScreen(uint16_t width = 80, uint16_t height = 24);
+
+    void resize(uint16_t width, uint16_t height);   // Blanks the grid. The next render repaints everything
+    void clear(const TelnetCell &blank = TelnetCell());
+    void invalidate() { m_repaint = true; }         // The client's screen is unknown (cleared, or output dropped). Repaint on the next render
+    void set(uint16_t x, uint16_t y, const TelnetCell &cell);  // Ignored outside the grid
+    // Write UTF-8 text from (x, y) in one style, clipped at the right edge. Returns the column after the text.
+    uint16_t print(uint16_t x, uint16_t y, std::string_view text, uint8_t fg = TelnetCell::Default, uint8_t bg = TelnetCell::Default, uint16_t attrs = 0);
+    const TelnetCell &at(uint16_t x, uint16_t y) const { return m_cells[(size_t)y * m_width + x]; }
+
+    void render(std::string &out);      // Append the escape sequences for what changed, and take the grid as sent
+
+    uint16_t width() const { return m_width; }
+    uint16_t height() const { return m_height; }
+
+private:
+    void moveTo(std::string &out, uint16_t x, uint16_t y);
+    void applyStyle(std::string &out, const TelnetCell &cell);
+
+    uint16_t m_width;
+    uint16_t m_height;
+    std::vector<TelnetCell> m_cells;    // The frame being built
+    std::vector<TelnetCell> m_sent;     // What the client was last sent
+    bool     m_repaint;                 // Clear the client's screen and paint from blank on the next render
+    int      m_cursorX;                 // Where render() has left the client's cursor. -1 when unknown
+    int      m_cursorY;
+    TelnetCell m_style;                 // The style the client will draw with...
+    bool     m_styleKnown;              // ...if we know it
+};
+
+
+// Text built up on the stack for TelnetSession::sendf() and sendStyled(). Only a line longer than
+// INLINE_CAPACITY touches the heap.
+class TelnetFormatBuffer
+{
+public:
+    static const size_t INLINE_CAPACITY = 512;
+
+    TelnetFormatBuffer() : m_length(0) {}
+    TelnetFormatBuffer(const TelnetFormatBuffer &) = delete;
+    TelnetFormatBuffer &operator=(const TelnetFormatBuffer &) = delete;
+
+    void append(std::string_view text);
+    void append(char c) { append(std::string_view(&c, 1)); }
+    void append(long long value)          { appendNumber(value); }
+    void append(unsigned long long value) { appendNumber(value); }
+    void append(double value);
+    void vprintf(const char *format, va_list args);
+
+    // Anything else that is a number or converts to a string_view
+    template <typename T>
+    void append(const T &value)
+    {
+        if constexpr (std::is_same_v<T, bool>)
+            append(value ? std::string_view("true") : std::string_view("false"));
+        else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+            appendNumber((long long)value);
+        else if constexpr (std::is_integral_v<T>)
+            appendNumber((unsigned long long)value);
+        else if constexpr (std::is_floating_point_v<T>)
+            append((double)value);
+        else
+            append(std::string_view(value));
+    }
+
+    std::string_view view() const { return m_overflow.empty() ? std::string_view(m_inline.data(), m_length) : std::string_view(m_overflow); }
+    bool styled() const { return view().find('\x1b') != std::string_view::npos; }
+
+private:
+    template <typename T>
+    void appendNumber(T value)
+    {
+        char digits[24];
+        std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+        append(std::string_view(digits, result.ptr - digits));
+    }
+
+    std::array<char, INLINE_CAPACITY> m_inline;
+    size_t m_length;                // Used of m_inline
+    std::string m_overflow;         // Everything, once it no longer fits inline
+};
+
+// A named stream of lines, such as a log channel, that sessions can subscribe to. Each line is
+// encoded once into a fixed size ring and numbered; a subscribed session only keeps the number of
+// the next line it wants. Publishing never waits on a subscriber. One that falls a whole ring
+// behind skips to the oldest line still held and is told how many it missed.
+class TelnetTopic
+{
+public:
+    TelnetTopic(const std::string &name, size_t capacity);
+
+    const std::string &name() const { return m_name; }
+    size_t capacity() const { return m_lines.size(); }
+    uint64_t head() const { return m_head.load(std::memory_order_acquire); }     // Number the next line will get
+    size_t subscribers() const { return m_subscribers.load(std::memory_order_relaxed); }
+    // Append up to max lines, from number from onwards, to out. Returns the number of the first
+    // one, which is past from if those lines have already been overwritten.
+    uint64_t read(uint64_t from, size_t max, std::vector<SP_TelnetPayload> &out) const;
+
+private:
+    TelnetTopic(const TelnetTopic &) = delete;
+    TelnetTopic &operator=(const TelnetTopic &) = delete;
+
+    void publish(const SP_TelnetPayload &line);    // Through TelnetServer::publish, which wakes the subscribers
+
+    std::string m_name;
+    mutable std::mutex m_mutex;                 // Held while slots are copied or replaced, never while anything is sent
+    std::vector<SP_TelnetPayload> m_lines;      // Line n is at n % capacity
+    std::atomic<uint64_t> m_head;
+    std::atomic<size_t> m_subscribers;          // Across all reactors
+
+friend TelnetServer;
+friend TelnetSession;
+};
+
+class TelnetSession : public std::enable_shared_from_this < TelnetSession >
+{
+public:
+    TelnetSession(SOCKET ClientSocket, std::shared_ptr<TelnetServer> ts, std::shared_ptr<TelnetReactor> reactor);
+    ~TelnetSession();
+
+public:
+    void sendLine(std::string data);    // Queue a line of data for the client. Sent at the end of TelnetServer::update()
+    void sendLine(const SP_TelnetPayload &payload); // Queue a line made by TelnetServer::encodeLine without copying it
+    void sendRaw(std::string data);     // Queue bytes exactly as given: no line ending, no prompt handling
+    // Queue a line formatted printf style, e.g. sendf("%sHP%s %d/%d", ANSI_FG_RED.data(), ANSI_FG_DEFAULT.data(), hp, max).
+    // On the session's own thread nothing is allocated unless the line is over 512 bytes.
+    void sendf(const char *format, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 2, 3)))
+#endif
+        ;
+    // Queue a line made of the pieces in order: strings, ANSI constants, numbers. A line that sets a
+    // style ends with ANSI_RESET, so the style does not run on into the prompt. Allocates as sendf().
+    //     session->sendStyled(ANSI_FG_GREEN, "HP ", hp, '/', maxHp, ANSI_FG_DEFAULT, "  Gold ", gold);
+    template <typename... Pieces>
+    void sendStyled(const Pieces &... pieces)
+    {
+        TelnetFormatBuffer line;
+        (line.append(pieces), ...);
+        if (line.styled())
+            line.append(ANSI_RESET);
+        sendLineView(line.view());
+    }
+    TelnetScreen &screen();             // Host thread: the session's virtual screen, 80x24 until resized
+    bool sendScreen();                  // Send what changed on screen() since the last call. Returns false if the frame was skipped
     void closeClient();                 // Finish the session
+    TelnetSessionMetrics metrics() const;   // Safe to call from any thread
+    TelnetSessionHandle handle() const { return m_handle; } // Stays valid after the session closes. See TelnetServer::session()
+    bool compressing() const { return m_compressor != nullptr; }    // MCCP2 is on. Reactor thread only
+    std::shared_ptr<TelnetServer> server() const { return m_telnetServer.lock(); }
+    bool adopted() const { return m_adopted; }  // Handed over by the previous process (TelnetServer::takeOver) rather than accepted
+    // Send the client each line published to topic from now on, starting with up to backlog of the
+    // most recent. Lines go out as the client reads them. Callable from any thread.
+    void subscribe(const SP_TelnetTopic &topic, size_t backlog = 0);
+    void unsubscribe(const SP_TelnetTopic &topic);
+    // Host thread: the next line from this session goes to reader instead of the line callbacks or
+    // router. Returns false, without keeping reader, if the session has already closed.
+    bool readLine(FPTR_LineReader reader);
 
     static void UNIT_TEST();
 
+    static const size_t INPUT_BUFFER_SIZE = 4096;   // Bytes read from the socket at a time
+
 protected:
     void initialise();                  // 
-    void update();                      // Called every frame/loop by the Terminal Server
+    bool update(size_t maxLines);       // Take a turn at the input, completing at most maxLines lines. Returns true if there is more to do
 
 private:
-    void sendPromptAndBuffer();         // Write the prompt and any data sat in the input buffer
-    void eraseLine();                   // Erase all characters on the current line and move prompt back to beginning of line
-    void echoBack(char * buffer, u_long length);
-    static void stripNVT(std::string &buffer);
-    static void stripEscapeCharacters(std::string &buffer);                 // Remove all escape characters from the line
-    static bool processBackspace(std::string &buffer);                      // Takes backspace commands and removes them and the preceeding character from the m_buffer. // Handles arrow key actions for history management. Returns true if the input buffer was changed.
-    void addToHistory(std::string line);                                    // Add a command into the command history
-    bool processCommandHistory(std::string &buffer);                        // Handles arrow key actions for history management. Returns true if the input buffer was changed.
-    static std::vector<std::string> getCompleteLines(std::string &buffer);  
+    void sendPromptAndBuffer();         // Write the prompt and any data sat in the input buffer, leaving the cursor where it was
+    bool eraseLine();                   // Erase the prompt and line, including rows it wrapped onto, and go back to the start of it. False if nothing was shown
+    void sendLineView(std::string_view line);   // sendLine() for text that is not ours to keep
+    void queueLine(std::string_view line);      // Reactor thread: wipe the prompt, queue the line and redraw the prompt
+    void queueOutput(const char * data, size_t length);                     // Append to the output queue and schedule a flush
+    void queuePayload(const SP_TelnetPayload &payload);                     // Queue a reference to a shared payload
+    void scheduleFlush();
+    void clearOutput();
+    bool flushOutput();                                                     // Send the output queue. Returns true if some could not be sent yet
+    void publishQueued();                                                   // Update the queue depth seen by metrics()
+    void writable();                                                        // The socket can take more after a full send buffer
+    void enforceOutputLimit();                                              // Apply the slow client policy once over the high watermark
+    void resumeOutput();                                                    // Coalesce: queue the notice of skipped output
+    void negotiateCompression(unsigned char command);                       // Client's DO or DONT for COMPRESS2
+    void startCompression();
+    void endCompression();                                                  // Finish the zlib stream; later output goes out plain
+    void compressPending(bool finish);                                      // Deflate the chunks queued since the last flush
+    void closeConnection();                                                 // closeClient() on the reactor's thread
+    void closeSocket();                                                     // Drop the connection without a clean shutdown
+    void startTimers();                                                     // Arm the reactor's timeouts for a new session
+    void timerExpired();                                                    // Act on whichever timeouts have passed and re-arm for the next
+    size_t lineColumns(size_t bytes) const;                                 // Columns from the start of the prompt to byte bytes of m_buffer
+    void queueText(std::string_view text);                                  // Queue line text, escaping IAC
+    void queueCursorMove(size_t from, size_t to);                           // Move the client's cursor between columns of the line
+    void textWritten(size_t column);                                        // Text has been written up to column: settle a pending wrap
+    void redrawTail(size_t from, size_t oldEnd);                            // Rewrite m_buffer from byte from, blank what is left of a line that ended at column oldEnd, and put the cursor at m_cursor
+    void editLine(const TelnetInputEvent &ev);                              // Cursor movement, delete and backspace
+    void replaceLine(std::string_view line);                                // Swap in a line from the history, redrawing only what differs
+    bool pumpTopics();                                                      // Queue topic lines published since the last call, while the client has room. True if some are left
+    void dropSubscriptions();
+    bool receive();                                                         // Read and parse what the socket has. Returns false if there was nothing
+    void processInputEvents(size_t maxLines);                               // Apply parsed input to the line, history and callbacks
+    void keepPendingLine();                                                 // Copy a zero-copy line start out of the input buffer
+    void completeCommand();                                                 // Tab: complete the command name from the server's router
+    void addToHistory(std::string_view line);                               // Add a command into the command history
+    bool recallHistory(bool older);                                         // Handles arrow key actions for history management. Returns true if the input buffer was changed.
 
 private:
-    SOCKET m_socket;                // The Winsock socket
-    std::shared_ptr<TelnetServer> m_telnetServer; // Parent TelnetServer class
+    SOCKET m_socket;                // The client socket. INVALID_SOCKET once the session is closed
+    std::weak_ptr<TelnetServer> m_telnetServer;   // Parent TelnetServer class. Weak, so sessions do not keep the server alive
+    std::shared_ptr<TelnetReactor> m_reactor;   // The reactor that does this session's I/O. Kept alive for a session the host holds across a restart
+    TelnetSlotHandle m_slot;        // Our entry in the reactor's session map
+    TelnetSessionHandle m_handle;   // Our entry in the server's session map, as seen by the host thread
+    std::vector<char> m_input;      // The last read. Parsed in place, and only refilled once its events are all handled
     std::string m_buffer;           // Buffer of input data (mid line)
-    std::list<std::string>           m_history;  // A history of all completed commands
-    std::list<std::string>::iterator m_historyCursor;
+    size_t      m_cursor;           // Byte of m_buffer the cursor is on. At the end of m_lineView while that is in use
+    uint16_t    m_columns;          // Terminal width, from NAWS. 80 until the client says
+    std::string_view m_lineView;    // Start of a line still sitting unedited in m_input
+    std::string m_dispatchBuffer;   // Holds the completed line while the callback runs
+    TelnetInputParser m_parser;     // Turns received bytes into input events
+    std::vector<TelnetInputEvent> m_inputEvents;    // Reused event list for each read
+    std::vector<std::string_view> m_completions;    // Reused list of tab completion candidates
+    size_t      m_eventCursor;      // First event in m_inputEvents not yet applied
+    bool        m_readyQueued;      // True while this session is on the reactor's ready queue
+    std::vector<TelnetOutputChunk> m_outChunks; // Output waiting for the end of frame flush. Chunks are recycled
+    size_t      m_outHead;          // First chunk not fully sent
+    size_t      m_outTail;          // One past the last chunk in use
+    size_t      m_outBytes;         // Bytes queued and not yet sent
+    size_t      m_plainFrom;        // While compressing: chunks from here on are not deflated yet. Those before it are wire bytes
+    std::unique_ptr<TelnetCompressor> m_compressor; // MCCP2 stream. Null while output is uncompressed
+    bool        m_compressOffered;  // We sent WILL COMPRESS2 and the client has not answered
+    bool        m_flushPending;     // True while this session is on the server's flush list
+    bool        m_writeBlocked;     // Send buffer full. Waiting for the poller to say the socket is writable
+    bool        m_outputSuspended;  // Coalesce policy: output is being skipped until the queue drains
+    size_t      m_skippedBytes;     // Output skipped while suspended
+    std::atomic<uint64_t> m_bytesIn;        // Metrics, written by the reactor thread only
+    std::atomic<uint64_t> m_bytesOut;
+    std::atomic<uint64_t> m_linesIn;
+    std::atomic<uint64_t> m_outQueued;      // m_outBytes as of the last flush
+    TelnetHistoryRing m_history;    // The most recent completed commands
+    size_t      m_historyCursor;    // Entry shown by the arrow keys. m_history.size() when not browsing
+    std::unique_ptr<TelnetScreen> m_screen; // Created by screen(). Belongs to the host thread
+    FPTR_LineReader m_lineReader;   // Set by readLine(). Belongs to the host thread
+    bool        m_adopted;          // Came from a takeover. Telnet options were negotiated by the old process
+    TelnetTimerNode m_timer;        // On the reactor's wheel for the earliest of the timeouts still to come
+    std::chrono::steady_clock::time_point m_connectedAt;
+    std::chrono::steady_clock::time_point m_lastInput;      // Last read that returned data
+    std::chrono::steady_clock::time_point m_lastKeepalive;  // Last IAC NOP we sent
+    bool        m_negotiated;       // The client has sent a telnet negotiation, so it is a telnet client and alive
+
+    struct Subscription
+    {
+        SP_TelnetTopic topic;
+        uint64_t       next;        // Number of the next line to send
+    };
+    std::vector<Subscription> m_subscriptions;  // Reactor thread
 
 friend TelnetServer;
+friend TelnetReactor;
 };
 
-typedef std::shared_ptr<TelnetSession>   SP_TelnetSession;
-typedef std::vector < SP_TelnetSession > VEC_SP_TelnetSession;
-
 typedef std::function< void(SP_TelnetSession) >              FPTR_ConnectedCallback;
 typedef std::function< void(SP_TelnetSession, std::string) > FPTR_NewLineCallback;
+typedef std::function< void(SP_TelnetSession, std::string_view) > FPTR_NewLineViewCallback;
+
+// The words of a command line, as views into the line. Only valid as long as the line is.
+class TelnetArgs
+{
+public:
+    static const size_t MAX_ARGS = 32;  // Words past the last slot stay together in it
+
+    TelnetArgs() : m_count(0) {}
+    explicit TelnetArgs(std::string_view line) : m_count(0) { parse(line); }
+
+    void parse(std::string_view line);  // Split on spaces and tabs. "Double quotes" keep a word's spaces
+    size_t size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+    std::string_view operator[](size_t i) const { return i < m_count ? m_args[i] : std::string_view(); }
+    std::string_view rest(size_t i) const;  // The line as typed from word i on, e.g. the text of "say hello there"
+    const std::string_view * begin() const { return m_args.data(); }
+    const std::string_view * end() const { return m_args.data() + m_count; }
+
+private:
+    std::array<std::string_view, MAX_ARGS> m_args;
+    size_t m_count;
+    std::string_view m_line;
+};
+
+typedef std::function< void(SP_TelnetSession, const TelnetArgs &) > FPTR_CommandHandler;
+
+// An entry of a command table. Constant, so a table can be built at compile time:
+//     static constexpr TelnetCommand commands[] = { { "status", &showStatus, "Show server status" } };
+struct TelnetCommand
+{
+    std::string_view name;
+    void (*handler)(SP_TelnetSession, const TelnetArgs &);
+    std::string_view help;
+};
+
+// What tab completion can do with a partly typed command name
+struct TelnetCompletion
+{
+    TelnetCompletion() : candidates(0), complete(false) {}
+
+    std::string_view append;    // Text to add to the line. Empty if the word is ambiguous at this point
+    size_t candidates;          // Commands the word could still become
+    bool complete;              // append finishes the only candidate
+};
+
+// Commands by name in a prefix trie. A line is matched in one walk over its first word, which
+// may be any unambiguous prefix of a command; names are matched without regard to ASCII case.
+// Register everything before handing the router to TelnetServer::commandRouter().
+class TelnetCommandRouter
+{
+public:
+    enum Match { Found, Unknown, Ambiguous };
+
+    TelnetCommandRouter();
+
+    bool add(std::string_view name, FPTR_CommandHandler handler, std::string_view help = std::string_view());   // False if the name is taken or empty
+    template <size_t N> void add(const TelnetCommand (&table)[N])
+    {
+        for (const TelnetCommand &command : table)
+            add(command.name, command.handler, command.help);
+    }
+    // Called for a line whose first word matches no command, or more than one
+    void fallback(std::function< void(SP_TelnetSession, const TelnetArgs &, Match) > f) { m_fallback = f; }
+
+    bool dispatch(const SP_TelnetSession &session, std::string_view line) const;   // Run the line's command. False if there was none
+    Match resolve(std::string_view word, size_t &command) const;
+    TelnetCompletion complete(std::string_view line) const;
+    void candidates(std::string_view prefix, std::vector<std::string_view> &names) const;    // Alphabetical
+
+    size_t size() const { return m_commands.size(); }
+    std::string_view name(size_t command) const { return m_commands[command].name; }
+    std::string_view help(size_t command) const { return m_commands[command].help; }
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    struct Node
+    {
+        Node(char c) : c(c), firstChild(NONE), nextSibling(NONE), command(NONE), anyCommand(NONE), count(0) {}
+
+        char     c;             // Lower case
+        uint32_t firstChild;    // Children are kept in order of c
+        uint32_t nextSibling;
+        uint32_t command;       // Command whose name ends here
+        uint32_t anyCommand;    // Some command below here, to take completion text from
+        uint32_t count;         // Commands ending here or below
+    };
+
+    struct Entry
+    {
+        std::string name;
+        FPTR_CommandHandler handler;
+        std::string help;
+    };
+
+    uint32_t find(std::string_view prefix) const;   // Node for prefix, or NONE
+    void collect(uint32_t node, std::vector<std::string_view> &names) const;
+
+    std::vector<Node>  m_nodes;     // m_nodes[0] is the root
+    std::vector<Entry> m_commands;
+    std::function< void(SP_TelnetSession, const TelnetArgs &, Match) > m_fallback;
+};
+
+// Work the host thread hands to an I/O thread
+struct TelnetReactorCommand
+{
+    enum Type { Send, SendPayload, SendRaw, Close, Broadcast, Adopt, Prompt, Subscribe, Unsubscribe };
+
+    TelnetReactorCommand() : type(Send), socket(INVALID_SOCKET), count(0) {}
+
+    Type             type;
+    SP_TelnetSession session;
+    std::string      data;      // Line for Send, bytes for SendRaw, prompt for Prompt
+    SP_TelnetPayload payload;   // For SendPayload and Broadcast
+    SOCKET           socket;    // Accepted connection for Adopt
+    SP_TelnetTopic   topic;     // For Subscribe and Unsubscribe
+    size_t           count;     // Backlog lines for Subscribe
+};
+
+// Something an I/O thread found that the host thread's callbacks need to hear about
+struct TelnetServerEvent
+{
+    enum Type { Connected, Line, Disconnected };
+
+    TelnetServerEvent() : type(Connected) {}
+
+    Type             type;
+    SP_TelnetSession session;
+    std::string      line;
+};
+
+// Owns a readiness poller and a set of sessions. Inline servers have one that is polled from
+// TelnetServer::update(); threaded servers run one per I/O thread.
+class TelnetReactor : public std::enable_shared_from_this < TelnetReactor >
+{
+public:
+    TelnetReactor(TelnetServer * server, bool threaded, size_t eventQueueCapacity);
+    ~TelnetReactor();
+
+    bool open(SOCKET listenSocket);         // listenSocket may be INVALID_SOCKET if connections are handed to us
+    void close();
+    // Give ready sessions a turn each, then flush output. Sessions not reached by the deadline keep
+    // their place for the next call. Returns how many sessions had a turn.
+    size_t poll(int timeoutMs, std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+    void start();                           // Threaded mode: run poll() on a thread of our own
+    void stop();
+
+    void post(TelnetReactorCommand &&cmd);  // Queue work for the reactor thread. Callable from any thread
+    bool onReactorThread() const;
+    bool interactivePrompt() const { return m_promptString.length() > 0; }
+
+private:
+    void run();
+    void wake();
+    void drainCommands();
+    void armTimer(TelnetTimerNode &node, std::chrono::steady_clock::time_point due);
+    void expireTimers();                                    // Turn the wheel to m_pollTime
+    void pumpTopics();                                      // Give each subscribed session the topic lines it has room for
+    void subscriberAdded(TelnetSession * session);
+    void subscriberRemoved(TelnetSession * session);
+    void watchSocket(SOCKET s, TelnetSession * session);    // Register a socket with the readiness poller
+    void watchWritable(TelnetSession * session, bool watch);    // Also wake for the session's socket becoming writable
+    void acceptConnection();                                // Take connections from the backlog, up to the per-poll cap
+    bool acceptFailed(int error);                           // Returns true if accepting should carry on
+    void adoptConnection(SOCKET clientSocket);
+    void adoptSession(SOCKET clientSocket, const TelnetHandoffSession &state);  // takeOver: a session from the old process
+    void finishInput();                                     // handOver: apply input already read, so no line is lost
+    uint32_t saveSessions(std::vector<SOCKET> &sockets, std::string &records, std::vector<SP_TelnetSession> &uncompressed);  // handOver: flush and describe each session. Adds those whose compression it ended to uncompressed
+    void broadcast(const SP_TelnetPayload &payload);
+    void markReady(TelnetSession * session);                // Queue a session for a turn at its input
+    size_t serviceReady(std::chrono::steady_clock::time_point deadline);
+    void flushSessions();                                   // Send each session's queued output
+    void sessionConnected(const SP_TelnetSession &session); // Forward to the host: directly, or via the event queue
+    void sessionDisconnected(const SP_TelnetSession &session);
+    void sessionClosed(TelnetSession * session);            // The socket has been closed. The session is reaped at the end of the poll
+    void reapSessions();                                    // Drop closed sessions and tell the host they have gone
+    void lineReceived(const SP_TelnetSession &session, std::string_view line);
+    TelnetServerEvent * beginEvent();                       // Slot for the next host event, in the ring or the overflow
+    void commitEvent();
+    bool drainOverflow();                                   // Move overflow into the ring. Returns true once it is empty
+
+private:
+    TelnetServer * m_server;
+    bool           m_threaded;
+    SOCKET         m_listenSocket;
+#ifndef _WIN32
+    int            m_spareFd;                       // Held in reserve so a connection can be accepted and closed when out of descriptors
+#endif
+    size_t         m_nextReactor;                   // Round robin target when handing out connections
+    std::string    m_promptString;                  // This reactor's copy of the server prompt
+    TelnetOutputLimits m_outputLimits;              // This reactor's copy of the server output limits
+    TelnetCompressionOptions m_compression;         // This reactor's copy of the server compression options
+    TelnetTimeouts m_timeouts;                      // This reactor's copy of the server timeouts
+    TelnetTimerWheel m_wheel;                       // One timer per session while any timeout is set
+    std::chrono::steady_clock::time_point m_timerEpoch; // Tick 0 of m_wheel
+    std::chrono::steady_clock::time_point m_pollTime;   // When the current poll woke. Stamps input and turns the wheel
+    const TelnetCommandRouter * m_router;           // For tab completion. Owned by the server and read only once running
+    size_t         m_sessionLineLimit;              // This reactor's copy of the server line limit
+    size_t         m_acceptsPerPoll;
+    TelnetSlotMap<SP_TelnetSession> m_sessions;     // Open sessions, densely packed. Closed ones are removed in O(1)
+    std::vector<TelnetSession *> m_closed;          // Closed since the last reapSessions()
+    std::deque<TelnetSession *> m_ready;            // Sessions with input to process, in the order they get a turn
+    std::vector<TelnetSession *> m_pendingFlush;    // Sessions with queued output
+    std::vector<TelnetSession *> m_subscribers;     // Sessions subscribed to at least one topic
+    std::vector<SP_TelnetPayload> m_topicLines;     // Reused for reading topic rings
+    bool m_topicsPending;                           // A subscriber stopped short of the end of a ring, so poll again without waiting
+    std::atomic<bool> m_hasSubscribers;             // m_subscribers is not empty. Read by the host to decide whom to wake
+#ifdef TELNETSERVLIB_EPOLL
+    int    m_epollFd;                               // epoll instance watching the listen socket and every session
+    int    m_wakeFd;                                // eventfd the host writes to when it posts a command
+    std::vector<struct epoll_event> m_events;       // Reused event array for epoll_wait
+#else
+    std::vector<struct pollfd> m_pollFds;           // Listen socket, then one entry per session in m_sessions order
+#endif
+    TelnetMpscQueue<TelnetReactorCommand> m_commands;   // Work posted by the host (or another reactor)
+    TelnetSpscQueue<TelnetServerEvent> m_hostEvents;    // Threaded mode: connections and lines for the host thread
+    std::deque<TelnetServerEvent> m_eventOverflow;      // Events produced while the ring was full. Reading pauses until it drains
+    std::thread       m_thread;
+    std::thread::id   m_threadId;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_wakePending;
+    std::atomic<bool> m_closedDown;                     // close() has run. Commands posted since are dropped
+    TelnetReactorCounters m_counters;
+
+friend TelnetSession;
+friend TelnetServer;
+};
 
 class TelnetServer : public std::enable_shared_from_this < TelnetServer >
 {
 public:
-    TelnetServer() : m_initialised(false), m_promptString("") {};
+    ~TelnetServer() { shutdown(); }
+    TelnetServer() : m_initialised(false), m_threaded(false), m_dealConnections(false), m_promptString(""), m_eventQueueCapacity(4096), m_nextDrain(0), m_historyCapacity(50), m_sessionLineLimit(64), m_linesDispatched(0), m_timerSequence(0), m_published(false) {};
 
-    bool initialise(u_long listenPort, std::string promptString = "");
+    // ioThreads == 0 runs everything inside update(). Otherwise that many I/O threads own the sockets
+    // and update() only runs the callbacks for what they found.
+    bool initialise(u_long listenPort, std::string promptString = "", unsigned ioThreads = 0);
     void update();
+    size_t update(size_t maxEvents);    // Threaded mode: run the callbacks for at most maxEvents events. Returns how many ran
+    TelnetUpdateReport update(std::chrono::microseconds budget);   // Stop once budget has passed. The next call carries on where this one stopped
     void shutdown();
 
+    // Restart without dropping anyone. The new process calls takeOver() instead of initialise() and
+    // waits up to timeout at path, a Unix socket it creates, for the running process to call
+    // handOver(path). The listeners and every session's socket, partial line and history move
+    // across and the clients see nothing but a pause. handOver() shuts this server down once the
+    // new process has everything. If nothing is waiting at path, or the new process has not
+    // confirmed within timeout, handOver() returns false and this server carries on, with any
+    // compressed sessions given a fresh MCCP2 stream. A takeOver() whose confirmation comes too late
+    // returns false without touching the sessions. Both must be the same version of the library.
+    // Not available on Windows.
+    bool handOver(const std::string &path, std::chrono::milliseconds timeout = std::chrono::seconds(10));
+    bool takeOver(const std::string &path, std::string promptString = "", unsigned ioThreads = 0, std::chrono::milliseconds timeout = std::chrono::seconds(10));
+
+    // Threaded mode: events each I/O thread can have waiting for update(). A thread that fills its
+    // queue stops reading its sockets until the host catches up. Set before initialise().
+    void eventQueueCapacity(size_t capacity) { m_eventQueueCapacity = capacity; }
+    size_t eventQueueCapacity() const { return m_eventQueueCapacity; }
+
+    // Per-session output queue bounds and slow client policy. Set before initialise().
+    void outputLimits(const TelnetOutputLimits &limits) { m_outputLimits = limits; }
+    TelnetOutputLimits outputLimits() const { return m_outputLimits; }
+
+    // MCCP2 settings for sessions. Set before initialise(). Without TELNETSERVLIB_MCCP they are ignored.
+    void compression(const TelnetCompressionOptions &options) { m_compression = options; }
+    TelnetCompressionOptions compression() const { return m_compression; }
+    static bool compressionSupported();     // True if the library was built with zlib
+
+    // Accept cap, session limit and per-address connection rate. Set before initialise().
+    void admissionLimits(const TelnetAdmissionLimits &limits) { m_admissionLimits = limits; }
+    TelnetAdmissionLimits admissionLimits() const { return m_admissionLimits; }
+
+    // Idle disconnect, keepalive and negotiation timeouts for each session. Set before initialise().
+    void timeouts(const TelnetTimeouts &timeouts) { m_timeouts = timeouts; }
+    TelnetTimeouts timeouts() const { return m_timeouts; }
+
+    // Lines a session may complete in one turn before the next ready session gets one, so a paste
+    // cannot hold up everyone else. The rest waits in the session's input buffer. Set before initialise().
+    void sessionLineLimit(size_t lines) { m_sessionLineLimit = lines > 0 ? lines : 1; }
+    size_t sessionLineLimit() const { return m_sessionLineLimit; }
+
+    // Named streams of lines that sessions can subscribe to, e.g. log channels an operator can tail.
+    // topic() creates the topic on first use; capacity is the lines its ring holds. Host thread.
+    SP_TelnetTopic topic(const std::string &name, size_t capacity = 1024);
+    SP_TelnetTopic findTopic(const std::string &name) const;   // nullptr if there is no such topic
+    // Add a line to a topic. Costs one encode and a slot in the ring however many sessions are
+    // subscribed; they pick it up as their sockets take it. Callable from any thread.
+    void publish(const SP_TelnetTopic &topic, const std::string &line);
+    void publish(const SP_TelnetTopic &topic, const SP_TelnetPayload &payload);
+
+    // Run f on the thread that calls update(), during the next update(). Callable from any thread.
+    void post(FPTR_Task f);
+    // Host thread: run f from the first update() at least delay from now
+    void after(std::chrono::milliseconds delay, FPTR_Task f);
+
+    TelnetServerMetrics metrics() const;    // Snapshot of the counters and histograms. Callable from any thread after initialise()
+    std::string metricsText() const;        // The same in the Prometheus text exposition format
+
+    // Commands each session remembers for the arrow keys. Applies to sessions connected after the call.
+    void historyCapacity(size_t capacity) { m_historyCapacity = capacity; }
+    size_t historyCapacity() const { return m_historyCapacity; }
+
 public:
     void connectedCallback(FPTR_ConnectedCallback f) { m_connectedCallback = f; }
     FPTR_ConnectedCallback connectedCallback() const { return m_connectedCallback; }
@@ -157,23 +1422,254 @@ public:
     void newLineCallback(FPTR_NewLineCallback f) { m_newlineCallback = f; }
     FPTR_NewLineCallback newLineCallBack() const { return m_newlineCallback; }
 
-    VEC_SP_TelnetSession sessions() const { return m_sessions; }
+    // Send lines to a command router instead of the line callbacks, and complete command names on
+    // tab. Register the router's commands before calling initialise().
+    void commandRouter(std::shared_ptr<TelnetCommandRouter> router) { m_commandRouter = router; }
+    std::shared_ptr<TelnetCommandRouter> commandRouter() const { return m_commandRouter; }
+
+    // Allocation free alternative to newLineCallback. The view is only valid during the call.
+    void newLineViewCallback(FPTR_NewLineViewCallback f) { m_newlineViewCallback = f; }
+    FPTR_NewLineViewCallback newLineViewCallback() const { return m_newlineViewCallback; }
+
+    VEC_SP_TelnetSession sessions() const { return VEC_SP_TelnetSession(m_sessions.begin(), m_sessions.end()); }
+    size_t sessionCount() const { return m_sessions.size(); }
+    SP_TelnetSession session(TelnetSessionHandle handle) const;     // nullptr once the session has closed
+
+    static SP_TelnetPayload encodeLine(const std::string &line);   // Encode a line once so it can be sent to many sessions
+    void broadcast(const std::string &line);                        // Send a line to every connected session
+    void broadcast(const SP_TelnetPayload &payload);
 
     bool interactivePrompt() const { return m_promptString.length() > 0; }
-    void promptString(std::string prompt) { m_promptString = prompt; }
+    void promptString(std::string prompt);
     std::string promptString() const { return m_promptString; }
 
 private:
-    void acceptConnection();
+    bool openReactors(unsigned ioThreads, const std::vector<SOCKET> &listeners);     // Listeners to use, or empty to bind our own. Threads are not started
+    size_t drainEvents(size_t maxEvents, std::chrono::steady_clock::time_point deadline);    // Threaded mode: run the callbacks for the I/O threads' events
+    void sessionConnected(const SP_TelnetSession &session);                 // Runs the callbacks on the host thread
+    void sessionDisconnected(const SP_TelnetSession &session);              // Drops the host's reference
+    void lineReceived(const SP_TelnetSession &session, std::string_view line);
+    size_t runTasks(std::chrono::steady_clock::time_point deadline);        // Returns how many ran
+    void wakeSubscribers();                                                 // Threaded mode: once a frame, if anything was published
+
+    struct Timer
+    {
+        std::chrono::steady_clock::time_point due;
+        uint64_t  sequence;     // Keeps timers due at the same time in the order they were set
+        FPTR_Task task;
+
+        bool operator<(const Timer &other) const { return due != other.due ? due > other.due : sequence > other.sequence; }   // Earliest on top of the heap
+    };
 
 private:
     u_long m_listenPort;
-    SOCKET m_listenSocket;
-    VEC_SP_TelnetSession m_sessions;
+    TelnetSlotMap<SP_TelnetSession> m_sessions;     // Sessions as seen from the host thread
     bool   m_initialised;
+    bool   m_threaded;
+    bool   m_dealConnections;                       // Fewer listeners than reactors: the listening ones deal connections out
     std::string m_promptString;                     // A string that denotes the current prompt
+    std::vector<std::shared_ptr<TelnetReactor>> m_reactors;
+    size_t m_eventQueueCapacity;
+    size_t m_nextDrain;                             // Reactor whose events update() looks at first, for fairness
+    std::atomic<size_t> m_historyCapacity;          // Read by the I/O threads when they create sessions
+    TelnetOutputLimits m_outputLimits;
+    TelnetCompressionOptions m_compression;
+    TelnetAdmissionLimits m_admissionLimits;
+    TelnetAdmission m_admission;
+    TelnetTimeouts m_timeouts;
+    size_t m_sessionLineLimit;
+    std::atomic<uint64_t> m_linesDispatched;
+    TelnetMpscQueue<FPTR_Task> m_posted;            // From post(), on any thread
+    std::deque<FPTR_Task> m_tasks;                  // Due to run on the host thread
+    std::vector<Timer> m_timers;                    // Heap of after() tasks
+    uint64_t m_timerSequence;
+    std::unordered_map<std::string, SP_TelnetTopic> m_topics;
+    std::atomic<bool> m_published;                  // A topic with subscribers has had a line since the last wakeSubscribers()
+    TelnetHistogram m_updateTime;
+    TelnetHistogram m_callbackTime;
 
 protected:
     FPTR_ConnectedCallback m_connectedCallback;     // Called after the telnet session is initialised. function(SP_TelnetSession) {}
     FPTR_NewLineCallback   m_newlineCallback;       // Called after every new line (from CR or LF)     function(SP_TelnetSession, std::string) {}
-};
\ No newline at end of file
+    FPTR_NewLineViewCallback m_newlineViewCallback; // As above without copying the line. Takes precedence when set
+    std::shared_ptr<TelnetCommandRouter> m_commandRouter;  // Takes precedence over both when set
+
+friend TelnetSession;
+friend TelnetReactor;
+};
+
+#ifdef TELNETSERVLIB_COROUTINES
+// A suspended coroutine waiting for the host thread to pick it up. Shared by the copies of the task
+// that will resume it, and destroys the coroutine if none of them ever does (e.g. the server shuts
+// down first), so its locals are not leaked.
+class TelnetResumer
+{
+public:
+    explicit TelnetResumer(std::coroutine_handle<> handle) : m_handle(handle) {}
+    ~TelnetResumer() { if (m_handle) m_handle.destroy(); }
+    TelnetResumer(const TelnetResumer &) = delete;
+    TelnetResumer &operator=(const TelnetResumer &) = delete;
+
+    void resume() { std::coroutine_handle<> handle = m_handle; m_handle = nullptr; if (handle) handle.resume(); }
+    void release() { m_handle = nullptr; }  // The coroutine carries on by itself after all
+
+private:
+    std::coroutine_handle<> m_handle;
+};
+typedef std::shared_ptr<TelnetResumer> SP_TelnetResumer;
+
+// Return type of a coroutine handler. It starts at once, runs up to its first co_await inside the
+// callback that started it, and is resumed from TelnetServer::update() on the host thread after
+// that, so the code between awaits needs no more locking than an ordinary callback. Handlers take
+// the session by value; copy anything in TelnetArgs you need before the first co_await, as the
+// line it points into is gone by then.
+//     router->add("wait", [](SP_TelnetSession s, const TelnetArgs &) -> TelnetTask
+//     {
+//         co_await TelnetDelay(*s->server(), std::chrono::seconds(5));
+//         s->sendLine("Done");
+//     });
+struct TelnetTask
+{
+    struct promise_type
+    {
+        TelnetTask get_return_object() { return TelnetTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception()
+        {
+            // Nobody is left to catch it once the handler has suspended
+            try { throw; }
+            catch (const std::exception &e) { printf("TelnetTask ended by exception: %s\n", e.what()); }
+            catch (...) { printf("TelnetTask ended by exception\n"); }
+        }
+    };
+};
+
+// co_await TelnetDelay(server, 250ms): resume from the first update() at least that long from now
+class TelnetDelay
+{
+public:
+    TelnetDelay(TelnetServer &server, std::chrono::milliseconds delay) : m_server(server), m_delay(delay) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        SP_TelnetResumer resumer = std::make_shared<TelnetResumer>(handle);
+        m_server.after(m_delay, [resumer]() { resumer->resume(); });
+    }
+    void await_resume() const noexcept {}
+
+private:
+    TelnetServer &m_server;
+    std::chrono::milliseconds m_delay;
+};
+
+// co_await TelnetNextFrame(server): give the host thread back until update() runs its tasks. A
+// coroutine that does this in a loop does one step per update().
+class TelnetNextFrame
+{
+public:
+    explicit TelnetNextFrame(TelnetServer &server) : m_server(server) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        SP_TelnetResumer resumer = std::make_shared<TelnetResumer>(handle);
+        m_server.post([resumer]() { resumer->resume(); });
+    }
+    void await_resume() const noexcept {}
+
+private:
+    TelnetServer &m_server;
+};
+
+// co_await TelnetNextLine(session): the next line the client enters, instead of it going to the
+// callbacks or router. nullopt if the session closes first.
+class TelnetNextLine
+{
+public:
+    explicit TelnetNextLine(SP_TelnetSession session) : m_session(std::move(session)) {}
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        SP_TelnetResumer resumer = std::make_shared<TelnetResumer>(handle);
+        std::optional<std::string> *line = &m_line;
+        if (m_session->readLine([resumer, line](std::optional<std::string_view> received)
+            {
+                if (received)
+                    *line = std::string(*received);
+                resumer->resume();
+            }))
+            return true;
+
+        resumer->release();     // Already closed: carry on with nullopt
+        return false;
+    }
+    std::optional<std::string> await_resume() { return std::move(m_line); }
+
+private:
+    SP_TelnetSession m_session;
+    std::optional<std::string> m_line;
+};
+
+// A result that another thread will produce. Hand a copy to the worker, co_await the token, and the
+// coroutine resumes on the host thread from the update() after complete() is called. Only the
+// first complete() counts. A token must be completed: until it is, it and its coroutine keep each
+// other alive. If the server has been destroyed by then, there is no host thread left to resume on
+// and complete() destroys the coroutine, locals and all, on the thread that called it.
+template <typename T>
+class TelnetToken
+{
+public:
+    explicit TelnetToken(const std::shared_ptr<TelnetServer> &server) : m_state(std::make_shared<State>())
+    {
+        m_state->server = server;
+    }
+
+    // Any thread
+    void complete(T value) const
+    {
+        SP_TelnetResumer waiter;
+        std::shared_ptr<TelnetServer> server;
+        {
+            std::lock_guard<std::mutex> lock(m_state->mutex);
+            if (m_state->value)
+                return;
+            m_state->value = std::move(value);
+            waiter = std::move(m_state->waiter);
+            server = m_state->server.lock();
+        }
+        if (waiter && server)
+            server->post([waiter]() { waiter->resume(); });
+        // Otherwise the last reference to the waiter goes here, destroying the frame on this thread
+    }
+
+    bool await_ready() const
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return m_state->value.has_value();
+    }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if (m_state->value)
+            return false;       // Completed since await_ready()
+        m_state->waiter = std::make_shared<TelnetResumer>(handle);
+        return true;
+    }
+    T await_resume()
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        return std::move(*m_state->value);
+    }
+
+private:
+    struct State
+    {
+        std::mutex mutex;
+        std::optional<T> value;
+        SP_TelnetResumer waiter;
+        std::weak_ptr<TelnetServer> server;
+    };
+    std::shared_ptr<State> m_state;
+};
+#endif
\ No newline at end of file